@@ -0,0 +1,138 @@
+// Tempestade de ligacoes: varios processos cliente ligam-se e desligam-se do
+// servidor o mais depressa possivel. Mede ligacoes por segundo e a latencia
+// de kvs_connect (do pedido ate a resposta do servidor).
+//
+// Uso: connect_bench <register_path> [clients] [connects_per_client]
+//                    [fifo|shm|socket]
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "src/client/api.h"
+#include "src/common/constants.h"
+#include "src/common/io.h"
+
+static long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int compare_ll(const void *a, const void *b) {
+  long long x = *(const long long *)a;
+  long long y = *(const long long *)b;
+  return (x > y) - (x < y);
+}
+
+static int connect_once(const char *transport, const char *id,
+                        const char *register_path) {
+  if (strcmp(transport, "shm") == 0) {
+    char shm_name[MAX_PIPE_PATH_LENGTH];
+    snprintf(shm_name, MAX_PIPE_PATH_LENGTH, "/kvs_%s", id);
+    return kvs_connect_shm(shm_name, register_path);
+  }
+  if (strcmp(transport, "socket") == 0) {
+    return kvs_connect_socket(register_path);
+  }
+
+  char req_pipe_path[MAX_PIPE_PATH_LENGTH];
+  char resp_pipe_path[MAX_PIPE_PATH_LENGTH];
+  char notif_pipe_path[MAX_PIPE_PATH_LENGTH];
+  snprintf(req_pipe_path, MAX_PIPE_PATH_LENGTH, "/tmp/req_%s", id);
+  snprintf(resp_pipe_path, MAX_PIPE_PATH_LENGTH, "/tmp/resp_%s", id);
+  snprintf(notif_pipe_path, MAX_PIPE_PATH_LENGTH, "/tmp/notif_%s", id);
+  int notif_pipe;
+  return kvs_connect(req_pipe_path, resp_pipe_path, register_path,
+                     notif_pipe_path, &notif_pipe);
+}
+
+// Processo cliente: envia ao pai, pelo pipe out_fd, a latencia de cada
+// ligacao bem sucedida.
+static void run_client(size_t client, size_t connects, const char *transport,
+                       const char *register_path, int out_fd) {
+  // A API imprime uma linha por operacao; nao interessa para a medicao
+  int devnull = open("/dev/null", O_WRONLY);
+  dup2(devnull, STDOUT_FILENO);
+
+  char id[32];
+  snprintf(id, sizeof(id), "bench%zu", client);
+  for (size_t i = 0; i < connects; i++) {
+    long long start = now_ns();
+    if (connect_once(transport, id, register_path) != 0) {
+      fprintf(stderr, "Client %zu failed to connect\n", client);
+      break;
+    }
+    long long elapsed = now_ns() - start;
+    kvs_disconnect();
+    kvs_end();
+    write_all(out_fd, &elapsed, sizeof(elapsed));
+  }
+  close(out_fd);
+  _exit(0);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr,
+            "Usage: %s <register_path> [clients] [connects_per_client] "
+            "[fifo|shm|socket]\n",
+            argv[0]);
+    return 1;
+  }
+  const char *register_path = argv[1];
+  size_t clients = argc > 2 ? strtoul(argv[2], NULL, 10) : 8;
+  size_t connects = argc > 3 ? strtoul(argv[3], NULL, 10) : 200;
+  const char *transport = argc > 4 ? argv[4] : "fifo";
+
+  int fds[2];
+  if (clients == 0 || connects == 0 || pipe(fds) == -1) {
+    fprintf(stderr, "Invalid arguments\n");
+    return 1;
+  }
+
+  long long start = now_ns();
+  for (size_t c = 0; c < clients; c++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(fds[0]);
+      run_client(c, connects, transport, register_path, fds[1]);
+    } else if (pid < 0) {
+      perror("Failed to fork client");
+      return 1;
+    }
+  }
+  close(fds[1]);
+
+  size_t total = clients * connects;
+  long long *samples = malloc(total * sizeof(long long));
+  size_t n = 0;
+  while (n < total && read_all(fds[0], &samples[n], sizeof(long long), NULL) == 1) {
+    n++;
+  }
+  while (wait(NULL) > 0)
+    ;
+  double seconds = (double)(now_ns() - start) / 1e9;
+  close(fds[0]);
+
+  if (n == 0) {
+    fprintf(stderr, "No connection succeeded\n");
+    free(samples);
+    return 1;
+  }
+
+  qsort(samples, n, sizeof(long long), compare_ll);
+  printf("%s: %zu clients, %zu/%zu connects in %.3f s\n", transport, clients,
+         n, total, seconds);
+  printf("connects/s %.0f  p50 %.1f us  p99 %.1f us  max %.1f us\n",
+         (double)n / seconds, (double)samples[n / 2] / 1000.0,
+         (double)samples[n * 99 / 100] / 1000.0,
+         (double)samples[n - 1] / 1000.0);
+
+  free(samples);
+  return 0;
+}
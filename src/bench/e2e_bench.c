@@ -0,0 +1,201 @@
+// Mede o servidor de ponta a ponta sobre uma diretoria de jobs (ver job_gen):
+// para cada numero de tarefas, corre src/server/kvs -e, que percorre a
+// diretoria, executa os jobs, escreve os .out e termina. Reporta comandos por
+// segundo a partir do tempo que o servidor indica para os jobs.
+//
+// Uso: e2e_bench <jobs_dir> [thread_counts] [max_backups] [server_options...]
+//      (ex.: e2e_bench /tmp/jobs 1,2,4,8 2 -c 1024)
+// Deve ser corrido na raiz do repositorio.
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SERVER_PATH "src/server/kvs"
+#define REGISTER_PATH "/tmp/kvs_e2e_register"
+#define MAX_SERVER_ARGS 32
+
+static long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int has_suffix(const char *name, const char *suffix) {
+  size_t len = strlen(name);
+  size_t suffix_len = strlen(suffix);
+  return len > suffix_len && strcmp(name + len - suffix_len, suffix) == 0;
+}
+
+/// Conta os comandos (linhas nao vazias) dos ficheiros .job.
+static size_t count_commands(const char *dir_name, size_t *files) {
+  DIR *dir = opendir(dir_name);
+  if (dir == NULL) {
+    return 0;
+  }
+  size_t commands = 0;
+  *files = 0;
+  struct dirent *entry;
+  char path[PATH_MAX];
+  while ((entry = readdir(dir)) != NULL) {
+    if (!has_suffix(entry->d_name, ".job")) {
+      continue;
+    }
+    snprintf(path, sizeof(path), "%s/%s", dir_name, entry->d_name);
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+      continue;
+    }
+    (*files)++;
+    int ch;
+    int empty = 1;
+    while ((ch = fgetc(in)) != EOF) {
+      if (ch == '\n') {
+        commands += !empty;
+        empty = 1;
+      } else {
+        empty = 0;
+      }
+    }
+    commands += !empty;
+    fclose(in);
+  }
+  closedir(dir);
+  return commands;
+}
+
+/// Apaga os .out, .bck e segmentos de backup (.bck.<i>) de uma corrida
+/// anterior.
+static void clean_outputs(const char *dir_name) {
+  DIR *dir = opendir(dir_name);
+  if (dir == NULL) {
+    return;
+  }
+  struct dirent *entry;
+  char path[PATH_MAX];
+  while ((entry = readdir(dir)) != NULL) {
+    if (has_suffix(entry->d_name, ".out") || has_suffix(entry->d_name, ".bck") ||
+        strstr(entry->d_name, ".bck.") != NULL) {
+      snprintf(path, sizeof(path), "%s/%s", dir_name, entry->d_name);
+      unlink(path);
+    }
+  }
+  closedir(dir);
+}
+
+/// Corre o servidor uma vez.
+/// @param job_seconds Tempo dos jobs indicado pelo servidor, ou o tempo total
+/// se o servidor nao o indicar.
+/// @return 0 se o servidor terminou normalmente, 1 caso contrario.
+static int run_server(char **args, double *job_seconds) {
+  int fds[2];
+  if (pipe(fds) == -1) {
+    return 1;
+  }
+
+  long long start = now_ns();
+  pid_t pid = fork();
+  if (pid == 0) {
+    // Os jobs imprimem no stdout (EOF, WAIT); so interessa o stderr
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    dup2(fds[1], STDERR_FILENO);
+    close(fds[0]);
+    execv(SERVER_PATH, args);
+    perror("Failed to run " SERVER_PATH);
+    _exit(127);
+  } else if (pid < 0) {
+    perror("Failed to fork server");
+    return 1;
+  }
+  close(fds[1]);
+
+  // Guardar o stderr todo; a linha que interessa e a ultima
+  char output[4096];
+  size_t len = 0;
+  char chunk[512];
+  ssize_t n;
+  while ((n = read(fds[0], chunk, sizeof(chunk))) > 0) {
+    for (ssize_t i = 0; i < n; i++) {
+      if (len == sizeof(output) - 1) {
+        memmove(output, output + sizeof(output) / 2, sizeof(output) / 2 - 1);
+        len = sizeof(output) / 2 - 1;
+      }
+      output[len++] = chunk[i];
+    }
+  }
+  output[len] = '\0';
+  close(fds[0]);
+
+  int status;
+  waitpid(pid, &status, 0);
+  *job_seconds = (double)(now_ns() - start) / 1e9;
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "%s", output);
+    return 1;
+  }
+
+  const char *line = strstr(output, "Jobs done in ");
+  if (line != NULL) {
+    *job_seconds = strtod(line + strlen("Jobs done in "), NULL);
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr,
+            "Usage: %s <jobs_dir> [thread_counts] [max_backups] "
+            "[server_options...]\n",
+            argv[0]);
+    return 1;
+  }
+  const char *jobs_dir = argv[1];
+  const char *thread_counts = argc > 2 ? argv[2] : "1,2,4,8";
+  const char *max_backups = argc > 3 ? argv[3] : "1";
+
+  size_t files;
+  size_t commands = count_commands(jobs_dir, &files);
+  if (commands == 0) {
+    fprintf(stderr, "No commands in %s/*.job\n", jobs_dir);
+    return 1;
+  }
+  printf("%zu job files, %zu commands\n", files, commands);
+  printf("%8s %10s %14s\n", "threads", "seconds", "commands/s");
+
+  char *list = strdup(thread_counts);
+  for (char *threads = strtok(list, ","); threads != NULL;
+       threads = strtok(NULL, ",")) {
+    // kvs -e [opcoes] <jobs_dir> <threads> <backups> <register>
+    char *args[MAX_SERVER_ARGS];
+    int n = 0;
+    args[n++] = SERVER_PATH;
+    args[n++] = "-e";
+    for (int i = 4; i < argc && n < MAX_SERVER_ARGS - 5; i++) {
+      args[n++] = argv[i];
+    }
+    args[n++] = (char *)jobs_dir;
+    args[n++] = threads;
+    args[n++] = (char *)max_backups;
+    args[n++] = REGISTER_PATH;
+    args[n] = NULL;
+
+    clean_outputs(jobs_dir);
+    double seconds;
+    if (run_server(args, &seconds) != 0) {
+      fprintf(stderr, "Server failed with %s threads\n", threads);
+      free(list);
+      return 1;
+    }
+    printf("%8s %10.3f %14.0f\n", threads, seconds,
+           (double)commands / seconds);
+  }
+  free(list);
+  return 0;
+}
@@ -0,0 +1,237 @@
+// Gera uma diretoria de ficheiros .job sinteticos para medir o servidor de
+// ponta a ponta. Cada comando e WRITE, READ, DELETE, SHOW ou BACKUP segundo a
+// mistura pedida, e as chaves de cada comando seguem uma distribuicao de Zipf.
+//
+// Uso: job_gen [-f files] [-c commands_per_file]
+//              [-m write:read:delete:show:backup] [-n keys] [-p pairs]
+//              [-s zipf_skew] [-v value_len] [-S seed] <jobs_dir>
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "src/server/constants.h"
+
+enum { MIX_WRITE, MIX_READ, MIX_DELETE, MIX_SHOW, MIX_BACKUP, MIX_COUNT };
+
+typedef struct GenConfig {
+  size_t files;
+  size_t commands; // Por ficheiro
+  unsigned int mix[MIX_COUNT];
+  size_t keys;
+  size_t pairs; // Maximo de pares por WRITE/READ/DELETE
+  double skew;  // 0 = uniforme
+  size_t value_len;
+  unsigned long seed;
+} GenConfig;
+
+static GenConfig config = {8, 10000, {45, 45, 8, 1, 1}, 1000, 4, 0.99, 16, 1};
+static double *zipf_cdf; // zipf_cdf[i] = P(rank <= i)
+
+/// xorshift64*, como em kvs_bench.
+static unsigned long long next_random(unsigned long long *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 2685821657736338717ULL;
+}
+
+static double next_unit(unsigned long long *state) {
+  return (double)(next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int build_zipf(void) {
+  zipf_cdf = malloc(config.keys * sizeof(double));
+  if (zipf_cdf == NULL) {
+    return 1;
+  }
+  double sum = 0;
+  for (size_t i = 0; i < config.keys; i++) {
+    sum += 1.0 / pow((double)(i + 1), config.skew);
+    zipf_cdf[i] = sum;
+  }
+  for (size_t i = 0; i < config.keys; i++) {
+    zipf_cdf[i] /= sum;
+  }
+  return 0;
+}
+
+static size_t pick_key(unsigned long long *rng) {
+  double u = next_unit(rng);
+  size_t low = 0;
+  size_t high = config.keys - 1;
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    if (zipf_cdf[mid] < u) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+/// Nome da chave de um rank. A primeira letra depende do rank, para que as
+/// chaves quentes se espalhem pelos buckets da tabela.
+static void key_name(size_t rank, char *key) {
+  snprintf(key, MAX_STRING_SIZE, "%c%zu", 'a' + (int)(rank % 26), rank);
+}
+
+static void write_keys(FILE *out, unsigned long long *rng, int with_values) {
+  size_t pairs = 1 + next_random(rng) % config.pairs;
+  char key[MAX_STRING_SIZE];
+  fputc('[', out);
+  for (size_t i = 0; i < pairs; i++) {
+    key_name(pick_key(rng), key);
+    if (!with_values) {
+      fprintf(out, i == 0 ? "%s" : ",%s", key);
+      continue;
+    }
+    fprintf(out, "(%s,", key);
+    for (size_t c = 0; c < config.value_len; c++) {
+      fputc('a' + (int)(next_random(rng) % 26), out);
+    }
+    fputc(')', out);
+  }
+  fputs("]\n", out);
+}
+
+static int generate_file(const char *dir, size_t file) {
+  char path[MAX_JOB_FILE_NAME_SIZE];
+  snprintf(path, sizeof(path), "%s/bench%03zu.job", dir, file);
+  FILE *out = fopen(path, "w");
+  if (out == NULL) {
+    perror(path);
+    return 1;
+  }
+
+  unsigned int total = 0;
+  for (int i = 0; i < MIX_COUNT; i++) {
+    total += config.mix[i];
+  }
+  unsigned long long rng = (config.seed + file + 1) * 0x9E3779B97F4A7C15ULL;
+  for (size_t c = 0; c < config.commands; c++) {
+    unsigned int pick = (unsigned int)(next_random(&rng) % total);
+    int kind = 0;
+    while (pick >= config.mix[kind]) {
+      pick -= config.mix[kind++];
+    }
+
+    switch (kind) {
+    case MIX_WRITE:
+      fputs("WRITE ", out);
+      write_keys(out, &rng, 1);
+      break;
+    case MIX_READ:
+      fputs("READ ", out);
+      write_keys(out, &rng, 0);
+      break;
+    case MIX_DELETE:
+      fputs("DELETE ", out);
+      write_keys(out, &rng, 0);
+      break;
+    case MIX_SHOW:
+      fputs("SHOW\n", out);
+      break;
+    default:
+      fputs("BACKUP\n", out);
+      break;
+    }
+  }
+  return fclose(out) == 0 ? 0 : 1;
+}
+
+static int parse_mix(const char *str) {
+  char *endptr = (char *)str;
+  unsigned int total = 0;
+  for (int i = 0; i < MIX_COUNT; i++) {
+    config.mix[i] = (unsigned int)strtoul(endptr, &endptr, 10);
+    total += config.mix[i];
+    if (i < MIX_COUNT - 1 && *endptr++ != ':') {
+      return 1;
+    }
+  }
+  return *endptr != '\0' || total == 0;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [-f files] [-c commands_per_file] "
+          "[-m write:read:delete:show:backup] [-n keys] [-p pairs] "
+          "[-s zipf_skew] [-v value_len] [-S seed] <jobs_dir>\n",
+          name);
+}
+
+int main(int argc, char **argv) {
+  int opt;
+  char *endptr = "";
+  while ((opt = getopt(argc, argv, "f:c:m:n:p:s:v:S:")) != -1) {
+    switch (opt) {
+    case 'f':
+      config.files = strtoul(optarg, &endptr, 10);
+      break;
+    case 'c':
+      config.commands = strtoul(optarg, &endptr, 10);
+      break;
+    case 'm':
+      if (parse_mix(optarg) != 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'n':
+      config.keys = strtoul(optarg, &endptr, 10);
+      break;
+    case 'p':
+      config.pairs = strtoul(optarg, &endptr, 10);
+      break;
+    case 's':
+      config.skew = strtod(optarg, &endptr);
+      break;
+    case 'v':
+      config.value_len = strtoul(optarg, &endptr, 10);
+      break;
+    case 'S':
+      config.seed = strtoul(optarg, &endptr, 10);
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+    if (*endptr != '\0') {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (argc - optind < 1 || config.files == 0 || config.keys == 0 ||
+      config.pairs == 0 || config.pairs > MAX_WRITE_SIZE || config.skew < 0 ||
+      config.value_len == 0 || config.value_len > MAX_VALUE_SIZE) {
+    usage(argv[0]);
+    return 1;
+  }
+  const char *dir = argv[optind];
+  if (mkdir(dir, 0777) == -1 && errno != EEXIST) {
+    perror(dir);
+    return 1;
+  }
+  if (build_zipf() != 0) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+
+  for (size_t f = 0; f < config.files; f++) {
+    if (generate_file(dir, f) != 0) {
+      free(zipf_cdf);
+      return 1;
+    }
+  }
+  printf("%zu files x %zu commands in %s\n", config.files, config.commands,
+         dir);
+  free(zipf_cdf);
+  return 0;
+}
@@ -0,0 +1,332 @@
+// Carga sintetica sobre o nucleo da KVS (operations.o + kvs.o), sem sessoes
+// nem ficheiros .job: varias threads fazem leituras e escritas de um par
+// sobre um conjunto fixo de chaves, escolhidas com uma distribuicao de Zipf.
+// Mede operacoes por segundo e percentis de latencia por tipo de operacao.
+//
+// Uso: kvs_bench [-t threads] [-n keys] [-o ops_per_thread] [-r read_percent]
+//                [-s zipf_skew] [-k min_key_len:max_key_len] [-v value_len]
+//                [-S seed]
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "src/server/constants.h"
+#include "src/server/operations.h"
+
+typedef struct BenchConfig {
+  size_t threads;
+  size_t keys;
+  size_t ops;          // Por thread
+  unsigned int reads;  // Percentagem de leituras
+  double skew;         // 0 = uniforme
+  size_t min_key_len;
+  size_t max_key_len;
+  size_t value_len;
+  unsigned long seed;
+} BenchConfig;
+
+typedef struct Worker {
+  pthread_t thread;
+  unsigned long long rng;
+  long long *read_samples;
+  long long *write_samples;
+  size_t num_reads;
+  size_t num_writes;
+  size_t misses; // Leituras de chaves que nao existiam
+} Worker;
+
+static BenchConfig config = {4, 10000, 200000, 90, 0.99, 8, 16, 32, 1};
+static char (*key_names)[MAX_STRING_SIZE];
+static double *zipf_cdf; // zipf_cdf[i] = P(rank <= i)
+static char *value;
+
+static long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int compare_ll(const void *a, const void *b) {
+  long long x = *(const long long *)a;
+  long long y = *(const long long *)b;
+  return (x > y) - (x < y);
+}
+
+/// xorshift64*: cada thread tem o seu estado, sem partilha.
+static unsigned long long next_random(unsigned long long *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 2685821657736338717ULL;
+}
+
+/// Numero uniforme em [0, 1).
+static double next_unit(unsigned long long *state) {
+  return (double)(next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/// Gera as chaves: comecam por uma letra (hash() so aceita letras e digitos),
+/// com o comprimento uniforme em [min_key_len, max_key_len]. A ordem e
+/// aleatoria, por isso as chaves mais quentes nao ficam todas no mesmo bucket.
+static int generate_keys(void) {
+  key_names = calloc(config.keys, sizeof(*key_names));
+  if (key_names == NULL) {
+    return 1;
+  }
+  static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+  size_t digits = (size_t)snprintf(NULL, 0, "%zu", config.keys - 1);
+  unsigned long long rng = config.seed * 0x9E3779B97F4A7C15ULL + 1;
+  for (size_t i = 0; i < config.keys; i++) {
+    size_t len = config.min_key_len +
+                 next_random(&rng) % (config.max_key_len - config.min_key_len + 1);
+    key_names[i][0] = alphabet[next_random(&rng) % 26];
+    for (size_t c = 1; c < len; c++) {
+      key_names[i][c] = alphabet[next_random(&rng) % (sizeof(alphabet) - 1)];
+    }
+    // Garante chaves distintas: o sufixo, de largura fixa, e o indice
+    char suffix[24];
+    snprintf(suffix, sizeof(suffix), "%0*zu", (int)digits, i);
+    memcpy(key_names[i] + len - digits, suffix, digits);
+  }
+  return 0;
+}
+
+/// Pre-calcula a funcao de distribuicao de Zipf: P(rank i) ~ 1 / (i + 1)^skew.
+static int build_zipf(void) {
+  zipf_cdf = malloc(config.keys * sizeof(double));
+  if (zipf_cdf == NULL) {
+    return 1;
+  }
+  double sum = 0;
+  for (size_t i = 0; i < config.keys; i++) {
+    sum += 1.0 / pow((double)(i + 1), config.skew);
+    zipf_cdf[i] = sum;
+  }
+  for (size_t i = 0; i < config.keys; i++) {
+    zipf_cdf[i] /= sum;
+  }
+  return 0;
+}
+
+/// Escolhe o indice de uma chave segundo a distribuicao de Zipf.
+static size_t pick_key(unsigned long long *rng) {
+  double u = next_unit(rng);
+  size_t low = 0;
+  size_t high = config.keys - 1;
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    if (zipf_cdf[mid] < u) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+static void *run_worker(void *arg) {
+  Worker *worker = arg;
+  char keys[1][MAX_STRING_SIZE];
+  char *values[1];
+
+  for (size_t i = 0; i < config.ops; i++) {
+    size_t key = pick_key(&worker->rng);
+    memcpy(keys[0], key_names[key], MAX_STRING_SIZE);
+    int is_read = next_random(&worker->rng) % 100 < config.reads;
+
+    long long start = now_ns();
+    if (is_read) {
+      kvs_read_values(1, keys, values, NULL);
+    } else {
+      values[0] = value;
+      kvs_write(1, keys, values);
+    }
+    long long elapsed = now_ns() - start;
+
+    if (is_read) {
+      worker->read_samples[worker->num_reads++] = elapsed;
+      if (values[0] == NULL) {
+        worker->misses++;
+      }
+      free(values[0]);
+    } else {
+      worker->write_samples[worker->num_writes++] = elapsed;
+    }
+  }
+  return NULL;
+}
+
+static void report(const char *name, long long *samples, size_t n,
+                   double seconds) {
+  if (n == 0) {
+    return;
+  }
+  qsort(samples, n, sizeof(long long), compare_ll);
+  printf("%-6s %10zu ops %12.0f ops/s  p50 %7.2f us  p90 %7.2f us  "
+         "p99 %7.2f us  p99.9 %8.2f us  max %9.2f us\n",
+         name, n, (double)n / seconds, (double)samples[n / 2] / 1000.0,
+         (double)samples[n * 90 / 100] / 1000.0,
+         (double)samples[n * 99 / 100] / 1000.0,
+         (double)samples[n * 999 / 1000] / 1000.0,
+         (double)samples[n - 1] / 1000.0);
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [-t threads] [-n keys] [-o ops_per_thread] "
+          "[-r read_percent] [-s zipf_skew] [-k min_key_len:max_key_len] "
+          "[-v value_len] [-S seed]\n",
+          name);
+}
+
+static int parse_args(int argc, char **argv) {
+  int opt;
+  char *endptr;
+  while ((opt = getopt(argc, argv, "t:n:o:r:s:k:v:S:")) != -1) {
+    switch (opt) {
+    case 't':
+      config.threads = strtoul(optarg, &endptr, 10);
+      break;
+    case 'n':
+      config.keys = strtoul(optarg, &endptr, 10);
+      break;
+    case 'o':
+      config.ops = strtoul(optarg, &endptr, 10);
+      break;
+    case 'r':
+      config.reads = (unsigned int)strtoul(optarg, &endptr, 10);
+      break;
+    case 's':
+      config.skew = strtod(optarg, &endptr);
+      break;
+    case 'k':
+      config.min_key_len = strtoul(optarg, &endptr, 10);
+      config.max_key_len = config.min_key_len;
+      if (*endptr == ':') {
+        config.max_key_len = strtoul(endptr + 1, &endptr, 10);
+      }
+      break;
+    case 'v':
+      config.value_len = strtoul(optarg, &endptr, 10);
+      break;
+    case 'S':
+      config.seed = strtoul(optarg, &endptr, 10);
+      break;
+    default:
+      return 1;
+    }
+    if (*endptr != '\0') {
+      return 1;
+    }
+  }
+
+  // As chaves precisam de espaco para o sufixo com o indice
+  size_t digits = (size_t)snprintf(NULL, 0, "%zu", config.keys - 1);
+  return config.threads == 0 || config.keys == 0 || config.ops == 0 ||
+         config.reads > 100 || config.skew < 0 ||
+         config.min_key_len <= digits ||
+         config.min_key_len > config.max_key_len ||
+         config.max_key_len >= MAX_STRING_SIZE || config.value_len == 0 ||
+         config.value_len > MAX_VALUE_SIZE;
+}
+
+int main(int argc, char **argv) {
+  if (parse_args(argc, argv) != 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  if (kvs_init() != 0) {
+    fprintf(stderr, "Failed to initialize KVS\n");
+    return 1;
+  }
+  value = malloc(config.value_len + 1);
+  if (value == NULL || generate_keys() != 0 || build_zipf() != 0) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+  memset(value, 'v', config.value_len);
+  value[config.value_len] = '\0';
+
+  // Todas as chaves existem antes da medicao
+  for (size_t i = 0; i < config.keys; i++) {
+    char *values[1] = {value};
+    kvs_write(1, &key_names[i], values);
+  }
+
+  Worker *workers = calloc(config.threads, sizeof(Worker));
+  for (size_t t = 0; t < config.threads; t++) {
+    workers[t].rng = (config.seed + t + 1) * 0x9E3779B97F4A7C15ULL;
+    workers[t].read_samples = malloc(config.ops * sizeof(long long));
+    workers[t].write_samples = malloc(config.ops * sizeof(long long));
+    if (workers[t].read_samples == NULL || workers[t].write_samples == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      return 1;
+    }
+  }
+
+  long long start = now_ns();
+  for (size_t t = 0; t < config.threads; t++) {
+    if (pthread_create(&workers[t].thread, NULL, run_worker, &workers[t]) !=
+        0) {
+      perror("Failed to create thread");
+      return 1;
+    }
+  }
+  for (size_t t = 0; t < config.threads; t++) {
+    pthread_join(workers[t].thread, NULL);
+  }
+  double seconds = (double)(now_ns() - start) / 1e9;
+
+  // Junta as amostras de todas as threads
+  size_t num_reads = 0;
+  size_t num_writes = 0;
+  size_t misses = 0;
+  for (size_t t = 0; t < config.threads; t++) {
+    num_reads += workers[t].num_reads;
+    num_writes += workers[t].num_writes;
+    misses += workers[t].misses;
+  }
+  long long *reads = malloc((num_reads + 1) * sizeof(long long));
+  long long *writes = malloc((num_writes + 1) * sizeof(long long));
+  long long *all = malloc((num_reads + num_writes) * sizeof(long long));
+  size_t r = 0;
+  size_t w = 0;
+  for (size_t t = 0; t < config.threads; t++) {
+    memcpy(reads + r, workers[t].read_samples,
+           workers[t].num_reads * sizeof(long long));
+    memcpy(writes + w, workers[t].write_samples,
+           workers[t].num_writes * sizeof(long long));
+    r += workers[t].num_reads;
+    w += workers[t].num_writes;
+    free(workers[t].read_samples);
+    free(workers[t].write_samples);
+  }
+  memcpy(all, reads, num_reads * sizeof(long long));
+  memcpy(all + num_reads, writes, num_writes * sizeof(long long));
+
+  printf("%zu threads, %zu keys (length %zu-%zu), %zu byte values, "
+         "%u%% reads, zipf %.2f\n",
+         config.threads, config.keys, config.min_key_len, config.max_key_len,
+         config.value_len, config.reads, config.skew);
+  printf("%zu ops in %.3f s, %zu read misses\n", num_reads + num_writes,
+         seconds, misses);
+  report("total", all, num_reads + num_writes, seconds);
+  report("read", reads, num_reads, seconds);
+  report("write", writes, num_writes, seconds);
+
+  free(all);
+  free(reads);
+  free(writes);
+  free(workers);
+  free(zipf_cdf);
+  free(key_names);
+  free(value);
+  kvs_terminate();
+  return 0;
+}
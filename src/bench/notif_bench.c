@@ -0,0 +1,365 @@
+// Carga de notificacoes: varios processos cliente abrem uma sessao cada e
+// subscrevem um conjunto de chaves; uma sessao escritora faz PUT dessas
+// chaves com o instante de envio (CLOCK_MONOTONIC) no valor. Cada subscritor
+// mede o tempo desde o envio do PUT ate a notificacao lhe chegar. Reporta
+// notificacoes entregues, notificacoes/s e percentis de latencia.
+//
+// O servidor so aceita MAX_SESSION_COUNT sessoes em simultaneo (sessions + 1
+// sao precisas); para mais sessoes compilar com make SESSIONS=<n>.
+//
+// Uso: notif_bench <register_path> [sessions] [subs_per_session] [keys]
+//                  [writes] [fifo|shm|socket] [interval_us]
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "src/client/api.h"
+#include "src/common/constants.h"
+#include "src/common/io.h"
+
+#define READY_TIMEOUT_MS 5000 // Espera pela ligacao e subscricoes
+#define DRAIN_TIMEOUT_MS 5000 // Espera pelas ultimas notificacoes
+#define END_VALUE "end"
+
+static long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int compare_ll(const void *a, const void *b) {
+  long long x = *(const long long *)a;
+  long long y = *(const long long *)b;
+  return (x > y) - (x < y);
+}
+
+static int connect_once(const char *transport, const char *id,
+                        const char *register_path) {
+  if (strcmp(transport, "shm") == 0) {
+    char shm_name[MAX_PIPE_PATH_LENGTH];
+    snprintf(shm_name, MAX_PIPE_PATH_LENGTH, "/kvs_%s", id);
+    return kvs_connect_shm(shm_name, register_path);
+  }
+  if (strcmp(transport, "socket") == 0) {
+    return kvs_connect_socket(register_path);
+  }
+
+  char req_pipe_path[MAX_PIPE_PATH_LENGTH];
+  char resp_pipe_path[MAX_PIPE_PATH_LENGTH];
+  char notif_pipe_path[MAX_PIPE_PATH_LENGTH];
+  snprintf(req_pipe_path, MAX_PIPE_PATH_LENGTH, "/tmp/req_%s", id);
+  snprintf(resp_pipe_path, MAX_PIPE_PATH_LENGTH, "/tmp/resp_%s", id);
+  snprintf(notif_pipe_path, MAX_PIPE_PATH_LENGTH, "/tmp/notif_%s", id);
+  int notif_pipe;
+  return kvs_connect(req_pipe_path, resp_pipe_path, register_path,
+                     notif_pipe_path, &notif_pipe);
+}
+
+static void key_name(size_t index, char *key) {
+  snprintf(key, MAX_STRING_SIZE, "n%zu", index);
+}
+
+/// Chave j das subscritas pela sessao s: as sessoes rodam sobre o conjunto
+/// de chaves, para que cada chave tenha o mesmo numero de subscritores.
+static size_t session_key(size_t session, size_t j, size_t subs, size_t keys) {
+  return (session * subs + j) % keys;
+}
+
+/// Latencias recebidas por um subscritor, preenchidas pela tarefa que le as
+/// notificacoes.
+typedef struct Receiver {
+  pthread_mutex_t lock;
+  long long *samples;
+  size_t count;
+  size_t capacity;
+  size_t subs;
+  int done_fd; // Recebe um byte quando chegaram todos os END_VALUE
+} Receiver;
+
+static void *receive_notifications(void *arg) {
+  Receiver *receiver = arg;
+  char key[MAX_STRING_SIZE + 1];
+  char *value = malloc(MAX_VALUE_SIZE + 1);
+  size_t ends = 0;
+  while (value != NULL && ends < receiver->subs) {
+    if (kvs_read_notification(key, value, MAX_VALUE_SIZE + 1) <= 0) {
+      break; // Sessao fechada
+    }
+    long long received = now_ns();
+    if (strcmp(value, END_VALUE) == 0) {
+      ends++;
+      continue;
+    }
+    pthread_mutex_lock(&receiver->lock);
+    if (receiver->count == receiver->capacity) {
+      size_t capacity = receiver->capacity * 2 + 1024;
+      long long *grown =
+          realloc(receiver->samples, capacity * sizeof(long long));
+      if (grown == NULL) {
+        pthread_mutex_unlock(&receiver->lock);
+        break;
+      }
+      receiver->samples = grown;
+      receiver->capacity = capacity;
+    }
+    receiver->samples[receiver->count++] = received - strtoll(value, NULL, 10);
+    pthread_mutex_unlock(&receiver->lock);
+  }
+  free(value);
+  write_all(receiver->done_fd, "d", 1);
+  return NULL;
+}
+
+// Processo subscritor: avisa o pai pelo ready_fd quando as subscricoes estao
+// feitas. Termina quando recebe o END_VALUE de todas as chaves ou quando o pai
+// fecha o stop_fd, e envia-lhe entao pelo out_fd o numero de amostras e as
+// latencias.
+static void run_subscriber(size_t session, size_t subs, size_t keys,
+                           const char *transport, const char *register_path,
+                           int ready_fd, int stop_fd, int out_fd) {
+  // A API imprime uma linha por operacao; nao interessa para a medicao
+  int devnull = open("/dev/null", O_WRONLY);
+  dup2(devnull, STDOUT_FILENO);
+
+  char id[32];
+  snprintf(id, sizeof(id), "nsub%zu", session);
+  if (connect_once(transport, id, register_path) != 0) {
+    fprintf(stderr, "Session %zu failed to connect\n", session);
+    _exit(1);
+  }
+  char key[MAX_STRING_SIZE + 1];
+  for (size_t j = 0; j < subs; j++) {
+    key_name(session_key(session, j, subs, keys), key);
+    kvs_subscribe(key);
+  }
+
+  int done[2];
+  Receiver receiver = {PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, subs, -1};
+  pthread_t thread;
+  if (pipe(done) == -1) {
+    _exit(1);
+  }
+  receiver.done_fd = done[1];
+  if (pthread_create(&thread, NULL, receive_notifications, &receiver) != 0) {
+    _exit(1);
+  }
+  write_all(ready_fd, "r", 1);
+  close(ready_fd);
+
+  // Esperar pelo fim das notificacoes ou pela ordem do pai
+  struct pollfd pfds[2] = {{done[0], POLLIN, 0}, {stop_fd, POLLIN, 0}};
+  while (poll(pfds, 2, -1) == -1) {
+  }
+  kvs_disconnect(); // A tarefa, se ainda estiver a ler, ve a sessao fechar
+  pthread_join(thread, NULL);
+  kvs_end();
+
+  write_all(out_fd, &receiver.count, sizeof(receiver.count));
+  if (receiver.count > 0) {
+    write_all(out_fd, receiver.samples, receiver.count * sizeof(long long));
+  }
+  close(out_fd);
+  free(receiver.samples);
+  _exit(0);
+}
+
+/// Espera que um descritor tenha dados, ate timeout_ms.
+static int wait_readable(int fd, int timeout_ms) {
+  struct pollfd pfd = {fd, POLLIN, 0};
+  return poll(&pfd, 1, timeout_ms) == 1;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr,
+            "Usage: %s <register_path> [sessions] [subs_per_session] [keys] "
+            "[writes] [fifo|shm|socket] [interval_us]\n",
+            argv[0]);
+    return 1;
+  }
+  const char *register_path = argv[1];
+  size_t sessions = argc > 2 ? strtoul(argv[2], NULL, 10) : 1;
+  size_t subs = argc > 3 ? strtoul(argv[3], NULL, 10) : 1;
+  size_t keys = argc > 4 ? strtoul(argv[4], NULL, 10) : subs;
+  size_t writes = argc > 5 ? strtoul(argv[5], NULL, 10) : 10000;
+  const char *transport = argc > 6 ? argv[6] : "fifo";
+  unsigned int interval_us =
+      argc > 7 ? (unsigned int)strtoul(argv[7], NULL, 10) : 0;
+
+  int ready[2];
+  int stop[2]; // Fechar stop[1] manda parar todos os subscritores
+  if (sessions == 0 || subs == 0 || subs > MAX_NUMBER_SUB || keys < subs ||
+      writes == 0 || pipe(ready) == -1 || pipe(stop) == -1) {
+    fprintf(stderr, "Invalid arguments (at most %d subscriptions per session)\n",
+            MAX_NUMBER_SUB);
+    return 1;
+  }
+
+  // So se podem subscrever chaves que existem: cria-las numa sessao propria,
+  // antes de haver subscritores
+  fflush(stdout);
+  int saved_stdout = dup(STDOUT_FILENO);
+  int devnull = open("/dev/null", O_WRONLY);
+  dup2(devnull, STDOUT_FILENO);
+  close(devnull);
+  char key[MAX_STRING_SIZE];
+  if (connect_once(transport, "nwriter", register_path) != 0) {
+    fprintf(stderr, "Writer failed to connect\n");
+    return 1;
+  }
+  for (size_t k = 0; k < keys; k++) {
+    key_name(k, key);
+    kvs_put(key, "0");
+  }
+  kvs_disconnect();
+  kvs_end();
+
+  pid_t *pids = calloc(sessions, sizeof(pid_t));
+  int *out_fds = calloc(sessions, sizeof(int));
+  for (size_t s = 0; s < sessions; s++) {
+    int fds[2];
+    if (pipe(fds) == -1) {
+      perror("Failed to create pipe");
+      return 1;
+    }
+    pids[s] = fork();
+    if (pids[s] == 0) {
+      close(ready[0]);
+      close(stop[1]);
+      close(fds[0]);
+      run_subscriber(s, subs, keys, transport, register_path, ready[1],
+                     stop[0], fds[1]);
+    } else if (pids[s] < 0) {
+      perror("Failed to fork client");
+      return 1;
+    }
+    close(fds[1]);
+    out_fds[s] = fds[0];
+  }
+  close(ready[1]);
+  close(stop[0]);
+
+  // Todas as sessoes tem de estar ligadas e subscritas antes da primeira escrita
+  size_t ready_count = 0;
+  char byte;
+  while (ready_count < sessions && wait_readable(ready[0], READY_TIMEOUT_MS) &&
+         read(ready[0], &byte, 1) == 1) {
+    ready_count++;
+  }
+  close(ready[0]);
+  if (ready_count < sessions) {
+    fprintf(stderr,
+            "Only %zu of %zu sessions connected; the server takes %d sessions "
+            "(build both with make SESSIONS=%zu)\n",
+            ready_count, sessions, MAX_SESSION_COUNT, sessions + 1);
+    // As sessoes ligadas desligam-se; as outras ficaram presas a ligar
+    close(stop[1]);
+    for (size_t s = 0; s < sessions; s++) {
+      wait_readable(out_fds[s], 1000);
+      kill(pids[s], SIGKILL);
+    }
+    while (wait(NULL) > 0)
+      ;
+    return 1;
+  }
+
+  // Sessao escritora; as linhas "Server returned" continuam em /dev/null
+  if (connect_once(transport, "nwriter", register_path) != 0) {
+    fprintf(stderr, "Writer failed to connect\n");
+    return 1;
+  }
+
+  char value[32];
+  long long start = now_ns();
+  for (size_t i = 0; i < writes; i++) {
+    key_name(i % keys, key);
+    snprintf(value, sizeof(value), "%lld", now_ns());
+    if (kvs_put(key, value) != 0) {
+      fprintf(stderr, "Put failed\n");
+      break;
+    }
+    if (interval_us > 0) {
+      struct timespec delay = {0, (long)interval_us * 1000L};
+      nanosleep(&delay, NULL);
+    }
+  }
+  double seconds = (double)(now_ns() - start) / 1e9;
+  for (size_t k = 0; k < keys; k++) {
+    key_name(k, key);
+    kvs_put(key, END_VALUE);
+  }
+  kvs_disconnect();
+  kvs_end();
+  fflush(stdout);
+  dup2(saved_stdout, STDOUT_FILENO);
+  close(saved_stdout);
+
+  // Notificacoes esperadas: cada escrita chega a todos os subscritores da chave
+  size_t *subscribers = calloc(keys, sizeof(size_t));
+  for (size_t s = 0; s < sessions; s++) {
+    for (size_t j = 0; j < subs; j++) {
+      subscribers[session_key(s, j, subs, keys)]++;
+    }
+  }
+  size_t expected = 0;
+  for (size_t i = 0; i < writes; i++) {
+    expected += subscribers[i % keys];
+  }
+  free(subscribers);
+
+  // Uma notificacao perdida deixaria o subscritor a espera: depois do prazo,
+  // os que ainda nao acabaram enviam o que receberam
+  long long deadline = now_ns() + DRAIN_TIMEOUT_MS * 1000000LL;
+  for (size_t s = 0; s < sessions; s++) {
+    long long left_ms = (deadline - now_ns()) / 1000000LL;
+    wait_readable(out_fds[s], left_ms > 0 ? (int)left_ms : 0);
+  }
+  close(stop[1]);
+
+  long long *samples = malloc(expected * sizeof(long long));
+  size_t n = 0;
+  for (size_t s = 0; s < sessions; s++) {
+    size_t count = 0;
+    if (read_all(out_fds[s], &count, sizeof(count), NULL) != 1) {
+      count = 0;
+    }
+    for (size_t i = 0; i < count; i++) {
+      long long sample;
+      if (read_all(out_fds[s], &sample, sizeof(sample), NULL) != 1) {
+        break;
+      }
+      if (n < expected) {
+        samples[n++] = sample;
+      }
+    }
+    close(out_fds[s]);
+  }
+  while (wait(NULL) > 0)
+    ;
+
+  printf("%s: %zu sessions x %zu subscriptions over %zu keys, %zu writes in "
+         "%.3f s\n",
+         transport, sessions, subs, keys, writes, seconds);
+  printf("notifications %zu/%zu, %.0f/s\n", n, expected, (double)n / seconds);
+  if (n > 0) {
+    qsort(samples, n, sizeof(long long), compare_ll);
+    printf("latency p50 %.1f us  p99 %.1f us  p99.9 %.1f us  max %.1f us\n",
+           (double)samples[n / 2] / 1000.0,
+           (double)samples[n * 99 / 100] / 1000.0,
+           (double)samples[n * 999 / 1000] / 1000.0,
+           (double)samples[n - 1] / 1000.0);
+  }
+
+  free(samples);
+  free(pids);
+  free(out_fds);
+  return 0;
+}
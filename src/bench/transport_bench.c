@@ -0,0 +1,144 @@
+// Compara a latencia de ida e volta (round trip) de um pedido/resposta entre
+// dois processos usando named pipes e usando os aneis em memoria partilhada.
+//
+// Uso: transport_bench [iterations] [request_bytes]
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "src/common/constants.h"
+#include "src/common/io.h"
+#include "src/common/shm_ring.h"
+
+#define RESPONSE_SIZE 2 // (char) OP_CODE | (char) result
+
+static const char *req_fifo = "/tmp/kvs_bench_req";
+static const char *resp_fifo = "/tmp/kvs_bench_resp";
+static const char *shm_name = "/kvs_bench";
+
+static long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int compare_ll(const void *a, const void *b) {
+  long long x = *(const long long *)a;
+  long long y = *(const long long *)b;
+  return (x > y) - (x < y);
+}
+
+static void report(const char *name, long long *samples, size_t n) {
+  qsort(samples, n, sizeof(long long), compare_ll);
+  long long total = 0;
+  for (size_t i = 0; i < n; i++) {
+    total += samples[i];
+  }
+  printf("%-5s avg %8.2f us  p50 %8.2f us  p99 %8.2f us  max %8.2f us\n",
+         name, (double)total / (double)n / 1000.0,
+         (double)samples[n / 2] / 1000.0,
+         (double)samples[n * 99 / 100] / 1000.0,
+         (double)samples[n - 1] / 1000.0);
+}
+
+static int bench_fifo(size_t iterations, size_t req_size, long long *samples) {
+  unlink(req_fifo);
+  unlink(resp_fifo);
+  if (mkfifo(req_fifo, 0666) == -1 || mkfifo(resp_fifo, 0666) == -1) {
+    perror("Failed to create named pipes");
+    return 1;
+  }
+
+  char *buf = calloc(1, req_size);
+  pid_t pid = fork();
+  if (pid == 0) {
+    // Servidor de eco: le o pedido e devolve uma resposta curta
+    int in = open(req_fifo, O_RDONLY);
+    int out = open(resp_fifo, O_WRONLY);
+    while (read_all(in, buf, req_size, NULL) == 1) {
+      write_all(out, buf, RESPONSE_SIZE);
+    }
+    _exit(0);
+  }
+
+  int out = open(req_fifo, O_WRONLY);
+  int in = open(resp_fifo, O_RDONLY);
+  for (size_t i = 0; i < iterations; i++) {
+    long long start = now_ns();
+    write_all(out, buf, req_size);
+    read_all(in, buf, RESPONSE_SIZE, NULL);
+    samples[i] = now_ns() - start;
+  }
+
+  close(out);
+  close(in);
+  waitpid(pid, NULL, 0);
+  unlink(req_fifo);
+  unlink(resp_fifo);
+  free(buf);
+  return 0;
+}
+
+static int bench_shm(size_t iterations, size_t req_size, long long *samples) {
+  ShmSession *session = shm_session_create(shm_name);
+  if (session == NULL) {
+    return 1;
+  }
+
+  char *buf = calloc(1, req_size);
+  pid_t pid = fork();
+  if (pid == 0) {
+    while (shm_ring_read(session, &session->req, buf, req_size) == 1) {
+      shm_ring_write(session, &session->resp, buf, RESPONSE_SIZE);
+    }
+    _exit(0);
+  }
+
+  for (size_t i = 0; i < iterations; i++) {
+    long long start = now_ns();
+    shm_ring_write(session, &session->req, buf, req_size);
+    shm_ring_read(session, &session->resp, buf, RESPONSE_SIZE);
+    samples[i] = now_ns() - start;
+  }
+
+  shm_session_close(session);
+  waitpid(pid, NULL, 0);
+  shm_session_unmap(session);
+  shm_unlink(shm_name);
+  free(buf);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  size_t iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+  size_t req_size = argc > 2 ? strtoul(argv[2], NULL, 10) : 1 + MAX_STRING_SIZE;
+  if (iterations == 0 || req_size < RESPONSE_SIZE) {
+    fprintf(stderr, "Usage: %s [iterations] [request_bytes >= %d]\n", argv[0],
+            RESPONSE_SIZE);
+    return 1;
+  }
+
+  long long *samples = malloc(iterations * sizeof(long long));
+  if (samples == NULL) {
+    fprintf(stderr, "Failed to allocate samples\n");
+    return 1;
+  }
+
+  printf("%zu round trips, %zu byte requests\n", iterations, req_size);
+  if (bench_fifo(iterations, req_size, samples) == 0) {
+    report("fifo", samples, iterations);
+  }
+  if (bench_shm(iterations, req_size, samples) == 0) {
+    report("shm", samples, iterations);
+  }
+
+  free(samples);
+  return 0;
+}
@@ -1,13 +1,19 @@
 #include "api.h"
 #include "src/common/constants.h"
+#include "src/common/io.h"
 #include "src/common/protocol.h"
+#include "src/common/shm_ring.h"
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 
 static char global_req_pipe_path[MAX_PIPE_PATH_LENGTH];
 static char global_resp_pipe_path[MAX_PIPE_PATH_LENGTH];
@@ -15,6 +21,161 @@ static char global_notif_pipe_path[MAX_PIPE_PATH_LENGTH];
 static int req_fd = -1;
 static int resp_fd = -1;
 static int notif_fd = -1;
+static char global_shm_name[MAX_PIPE_PATH_LENGTH];
+static ShmSession *shm_session = NULL; // NULL se a sessao usa FIFOs
+
+// Transporte por socket: respostas e notificacoes chegam pela mesma ligacao.
+// Quem precisa de uma mensagem e nao a encontra ja recebida passa a ser o
+// leitor do socket e entrega a outra tarefa o que nao for para si. Como nos
+// outros transportes, cada mensagem e consumida como um fluxo, em partes.
+#define SOCK_NOTIF_QUEUE 64
+static int sock_fd = -1;
+static pthread_mutex_t sock_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sock_cond = PTHREAD_COND_INITIALIZER;
+static int sock_reading = 0; // Ha uma tarefa bloqueada em recv
+static int sock_closed = 0;
+static char sock_record[1 + MAX_RESPONSE_SIZE]; // So usado pelo leitor
+static char sock_resp[MAX_RESPONSE_SIZE];
+static size_t sock_resp_len = 0;
+static size_t sock_resp_pos = 0; // Ha uma resposta por ler se pos < len
+static char *sock_notifs[SOCK_NOTIF_QUEUE]; // Alocadas, sem o opcode
+static size_t sock_notif_lens[SOCK_NOTIF_QUEUE];
+static size_t sock_notif_head = 0;
+static size_t sock_notif_count = 0;
+static size_t sock_notif_pos = 0; // Bytes ja lidos da primeira notificacao
+
+// Copia os proximos size bytes de uma mensagem recebida.
+// @return 1 em caso de sucesso, -1 se a mensagem acabou antes.
+static int sock_take(const char *msg, size_t len, size_t *pos, char *buf,
+                     size_t size) {
+  if (len - *pos < size) {
+    *pos = len;
+    return -1; // Mensagem truncada
+  }
+  memcpy(buf, msg + *pos, size);
+  *pos += size;
+  return 1;
+}
+
+// Le os proximos size bytes da resposta (want_notif == 0) ou da notificacao
+// (want_notif == 1) em curso na ligacao por socket.
+// @return 1 em caso de sucesso, 0 se a ligacao foi fechada, -1 em erro.
+static int sock_recv(int want_notif, char *buf, size_t size) {
+  int result = 1;
+  pthread_mutex_lock(&sock_lock);
+  while (1) {
+    if (!want_notif && sock_resp_pos < sock_resp_len) {
+      result = sock_take(sock_resp, sock_resp_len, &sock_resp_pos, buf, size);
+      break;
+    }
+    if (want_notif && sock_notif_count > 0) {
+      size_t len = sock_notif_lens[sock_notif_head];
+      result = sock_take(sock_notifs[sock_notif_head], len, &sock_notif_pos,
+                         buf, size);
+      if (sock_notif_pos == len) {
+        free(sock_notifs[sock_notif_head]);
+        sock_notif_head = (sock_notif_head + 1) % SOCK_NOTIF_QUEUE;
+        sock_notif_count--;
+        sock_notif_pos = 0;
+        pthread_cond_broadcast(&sock_cond);
+      }
+      break;
+    }
+    if (sock_closed) {
+      result = 0;
+      break;
+    }
+    if (sock_reading || sock_notif_count == SOCK_NOTIF_QUEUE) {
+      pthread_cond_wait(&sock_cond, &sock_lock);
+      continue;
+    }
+
+    sock_reading = 1;
+    pthread_mutex_unlock(&sock_lock);
+    ssize_t n = recv(sock_fd, sock_record, sizeof(sock_record), 0);
+    pthread_mutex_lock(&sock_lock);
+    sock_reading = 0;
+
+    if (n <= 0) {
+      sock_closed = 1;
+    } else if (sock_record[0] == OP_CODE_NOTIFY) {
+      size_t slot = (sock_notif_head + sock_notif_count) % SOCK_NOTIF_QUEUE;
+      sock_notifs[slot] = malloc((size_t)n - 1);
+      if (sock_notifs[slot] != NULL) {
+        memcpy(sock_notifs[slot], sock_record + 1, (size_t)n - 1);
+        sock_notif_lens[slot] = (size_t)n - 1;
+        sock_notif_count++;
+      } else {
+        fprintf(stderr, "Failed to allocate notification\n");
+      }
+    } else {
+      memcpy(sock_resp, sock_record, (size_t)n);
+      sock_resp_len = (size_t)n;
+      sock_resp_pos = 0;
+    }
+    pthread_cond_broadcast(&sock_cond);
+  }
+  pthread_mutex_unlock(&sock_lock);
+  return result;
+}
+
+// Envia um pedido ao servidor pelo FIFO de pedidos ou pelo anel partilhado.
+static int send_request(const void *buf, size_t size) {
+  if (shm_session != NULL) {
+    return shm_ring_write(shm_session, &shm_session->req, buf, size);
+  }
+  if (sock_fd != -1) {
+    return send(sock_fd, buf, size, MSG_NOSIGNAL) == (ssize_t)size ? 1 : -1;
+  }
+  return write_all(req_fd, buf, size);
+}
+
+// Le uma resposta do servidor.
+static int read_response(void *buf, size_t size) {
+  if (shm_session != NULL) {
+    return shm_ring_read(shm_session, &shm_session->resp, buf, size);
+  }
+  if (sock_fd != -1) {
+    return sock_recv(0, buf, size);
+  }
+  return read_all(resp_fd, buf, size, NULL);
+}
+
+// Le parte de uma notificacao do servidor.
+static int read_notification(void *buf, size_t size) {
+  if (shm_session != NULL) {
+    return shm_ring_read(shm_session, &shm_session->notif, buf, size);
+  }
+  if (sock_fd != -1) {
+    return sock_recv(1, buf, size);
+  }
+  return read_all(notif_fd, buf, size, NULL);
+}
+
+// Le um campo (value) com o leitor dado. Um valor que nao caiba em
+// value_size e truncado, e o resto e lido e descartado para que a proxima
+// leitura comece na mensagem seguinte.
+// @return 1 em caso de sucesso, 0 se a sessao foi fechada, -1 em erro.
+static int read_value(int (*reader)(void *, size_t), char *value,
+                      size_t value_size) {
+  uint32_t len;
+  int result = reader(&len, sizeof(len));
+  if (result <= 0) {
+    return result;
+  }
+  size_t keep = len < value_size ? len : value_size - 1;
+  if (keep > 0) {
+    result = reader(value, keep);
+  }
+  value[keep] = '\0';
+  for (size_t left = len - keep; left > 0 && result > 0;) {
+    char discard[256];
+    size_t chunk = left < sizeof(discard) ? left : sizeof(discard);
+    result = reader(discard, chunk);
+    left -= chunk;
+  }
+  return result;
+}
 
 int kvs_connect(char const *req_pipe_path, char const *resp_pipe_path,
                 char const *server_pipe_path, char const *notif_pipe_path,
@@ -79,8 +240,7 @@ int kvs_connect(char const *req_pipe_path, char const *resp_pipe_path,
 
   // Ler resposta do servidor
   char response[2];
-  ssize_t bytes_read = read(resp_fd, response, sizeof(response));
-  if (bytes_read == -1) {
+  if (read_response(response, sizeof(response)) <= 0) {
     perror("Failed to read connect response");
     close(resp_fd);
     resp_fd = -1;
@@ -92,20 +252,123 @@ int kvs_connect(char const *req_pipe_path, char const *resp_pipe_path,
   return response[1];
 }
 
+int kvs_connect_shm(char const *shm_name, char const *server_pipe_path) {
+  shm_session = shm_session_create(shm_name);
+  if (shm_session == NULL) {
+    return 1;
+  }
+  strncpy(global_shm_name, shm_name, sizeof(global_shm_name) - 1);
+
+  // FIFO da resposta de conexao, unico canal que o servidor tem se nao
+  // conseguir abrir a regiao
+  char connect_pipe_path[MAX_PIPE_PATH_LENGTH];
+  snprintf(connect_pipe_path, MAX_PIPE_PATH_LENGTH, "/tmp%s_connect", shm_name);
+  unlink(connect_pipe_path);
+  if (mkfifo(connect_pipe_path, 0666) == -1) {
+    perror("Failed to create named pipe");
+    kvs_end();
+    return 1;
+  }
+
+  // Abrir pipe do servidor
+  int server_fd = open(server_pipe_path, O_WRONLY);
+  if (server_fd == -1) {
+    perror("Failed to open server pipe");
+    unlink(connect_pipe_path);
+    kvs_end();
+    return 1;
+  }
+
+  // Mesmo formato que OP_CODE_CONNECT, com o nome da regiao no 1o campo
+  char message[1 + 3 * MAX_PIPE_PATH_LENGTH] = {0};
+  message[0] = OP_CODE_CONNECT_SHM;
+  snprintf(message + 1, MAX_PIPE_PATH_LENGTH, "%s", shm_name);
+  snprintf(message + (MAX_PIPE_PATH_LENGTH+1), MAX_PIPE_PATH_LENGTH, "%s",
+           connect_pipe_path);
+
+  if (write(server_fd, message, sizeof(message)) == -1) {
+    perror("Failed to send connection request");
+    close(server_fd);
+    unlink(connect_pipe_path);
+    kvs_end();
+    return 1;
+  }
+
+  close(server_fd);
+
+  // Ler resposta do servidor
+  char response[2];
+  int connect_fd = open(connect_pipe_path, O_RDONLY);
+  int result = connect_fd == -1
+                   ? -1
+                   : read_all(connect_fd, response, sizeof(response), NULL);
+  if (connect_fd != -1) {
+    close(connect_fd);
+  }
+  unlink(connect_pipe_path);
+  if (result <= 0) {
+    fprintf(stderr, "Failed to read connect response\n");
+    kvs_end();
+    return 1;
+  }
+
+  printf("Server returned %d for operation: connect\n", response[1]);
+
+  if (response[1] != 0) {
+    kvs_end();
+  }
+  return response[1];
+}
+
+int kvs_connect_socket(char const *server_socket_path) {
+  struct sockaddr_un addr;
+  if (strlen(server_socket_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Server socket path too long\n");
+    return 1;
+  }
+
+  sock_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  if (sock_fd == -1) {
+    perror("Failed to create socket");
+    return 1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, server_socket_path);
+  if (connect(sock_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    perror("Failed to connect to server socket");
+    close(sock_fd);
+    sock_fd = -1;
+    return 1;
+  }
+
+  // A ligacao aceite e o pedido de conexao; o servidor responde por ela
+  char response[2];
+  if (read_response(response, sizeof(response)) <= 0) {
+    fprintf(stderr, "Failed to read connect response\n");
+    kvs_end();
+    return 1;
+  }
+
+  printf("Server returned %d for operation: connect\n", response[1]);
+
+  return response[1];
+}
+
 int kvs_disconnect(void) {
   char message[1];
   message[0] = OP_CODE_DISCONNECT;
 
   // Enviar mensagem de desconexão ao servidor
-  if (write(req_fd, message, sizeof(message)) == -1) {
+  if (send_request(message, sizeof(message)) == -1) {
     perror("Failed to send disconnect message");
     return 1;
   }
 
   // Ler resposta do servidor
   char response[2];
-  ssize_t bytes_read = read(resp_fd, response, sizeof(response));
-  if (bytes_read == -1) {
+  if (read_response(response, sizeof(response)) <= 0) {
     perror("Failed to read disconnect response");
     return 1;
   }
@@ -117,6 +380,19 @@ int kvs_disconnect(void) {
     return 1;
   }
 
+  if (shm_session != NULL) {
+    // Acordar a tarefa de notificacoes; a regiao e libertada em kvs_end
+    shm_session_close(shm_session);
+    shm_unlink(global_shm_name);
+    return 0;
+  }
+
+  if (sock_fd != -1) {
+    // Acordar a tarefa de notificacoes; a ligacao e fechada em kvs_end
+    shutdown(sock_fd, SHUT_RDWR);
+    return 0;
+  }
+
   // Fechar pipes
   close(req_fd);
   close(resp_fd);
@@ -139,15 +415,14 @@ int kvs_subscribe(const char *key) {
   snprintf(message + 1, MAX_STRING_SIZE, "%s", key);
 
   // Enviar mensagem de subscrição ao servidor
-  if (write(req_fd, message, sizeof(message)) == -1) {
+  if (send_request(message, sizeof(message)) == -1) {
     perror("Failed to send subscribe message");
     return 1;
   }
 
   // Ler resposta do servidor
   char response[2];
-  ssize_t bytes_read = read(resp_fd, response, sizeof(response));
-  if (bytes_read == -1) {
+  if (read_response(response, sizeof(response)) <= 0) {
     perror("Failed to read subscribe response");
     return 1;
   }
@@ -168,15 +443,14 @@ int kvs_unsubscribe(const char *key) {
   snprintf(message + 1, MAX_STRING_SIZE, "%s", key);
 
   // Enviar mensagem de cancelamento de subscrição ao servidor
-  if (write(req_fd, message, sizeof(message)) == -1) {
+  if (send_request(message, sizeof(message)) == -1) {
     perror("Failed to send unsubscribe message");
     return 1;
   }
 
   // Ler resposta do servidor
   char response[2];
-  ssize_t bytes_read = read(resp_fd, response, sizeof(response));
-  if (bytes_read == -1) {
+  if (read_response(response, sizeof(response)) <= 0) {
     perror("Failed to read unsubscribe response");
     return 1;
   }
@@ -191,11 +465,233 @@ int kvs_unsubscribe(const char *key) {
   return 0;
 }
 
+int kvs_get(const char *key, char *value) {
+  char message[1 + MAX_STRING_SIZE] = {0};
+  message[0] = OP_CODE_GET;
+  snprintf(message + 1, MAX_STRING_SIZE, "%s", key);
+
+  if (send_request(message, sizeof(message)) == -1) {
+    perror("Failed to send get message");
+    return 1;
+  }
+
+  char response[2];
+  if (read_response(response, sizeof(response)) <= 0 ||
+      read_value(read_response, value, MAX_VALUE_SIZE + 1) <= 0) {
+    perror("Failed to read get response");
+    return 1;
+  }
+
+  printf("Server returned %d for operation: get\n", response[1]);
+  return response[1] != 0;
+}
+
+int kvs_put(const char *key, const char *value) {
+  if (strlen(value) > MAX_VALUE_SIZE) {
+    fprintf(stderr, "Value too long for put\n");
+    return 1;
+  }
+
+  char message[1 + MAX_STRING_SIZE + MAX_VALUE_FIELD] = {0};
+  message[0] = OP_CODE_PUT;
+  snprintf(message + 1, MAX_STRING_SIZE, "%s", key);
+  size_t size = 1 + MAX_STRING_SIZE;
+  size += encode_value(message + size, value);
+
+  if (send_request(message, size) == -1) {
+    perror("Failed to send put message");
+    return 1;
+  }
+
+  char response[2];
+  if (read_response(response, sizeof(response)) <= 0) {
+    perror("Failed to read put response");
+    return 1;
+  }
+
+  printf("Server returned %d for operation: put\n", response[1]);
+  return response[1] != 0;
+}
+
+int kvs_del(const char *key) {
+  char message[1 + MAX_STRING_SIZE] = {0};
+  message[0] = OP_CODE_DELETE;
+  snprintf(message + 1, MAX_STRING_SIZE, "%s", key);
+
+  if (send_request(message, sizeof(message)) == -1) {
+    perror("Failed to send delete message");
+    return 1;
+  }
+
+  char response[2];
+  if (read_response(response, sizeof(response)) <= 0) {
+    perror("Failed to read delete response");
+    return 1;
+  }
+
+  printf("Server returned %d for operation: delete\n", response[1]);
+  return response[1] != 0;
+}
+
+int kvs_mget(size_t num_keys, char keys[][MAX_STRING_SIZE],
+             char values[][MAX_VALUE_SIZE + 1], int *found) {
+  if (num_keys > MAX_MGET_KEYS) {
+    fprintf(stderr, "Too many keys for mget\n");
+    return 1;
+  }
+
+  char message[2 + MAX_MGET_KEYS * MAX_STRING_SIZE] = {0};
+  message[0] = OP_CODE_MGET;
+  message[1] = (char)num_keys;
+  for (size_t i = 0; i < num_keys; i++) {
+    snprintf(message + 2 + i * MAX_STRING_SIZE, MAX_STRING_SIZE, "%s",
+             keys[i]);
+  }
+
+  if (send_request(message, sizeof(message)) == -1) {
+    perror("Failed to send mget message");
+    return 1;
+  }
+
+  // A resposta traz sempre um valor por chave, mesmo que result seja 1
+  char response[2];
+  if (read_response(response, sizeof(response)) <= 0) {
+    perror("Failed to read mget response");
+    return 1;
+  }
+  for (size_t i = 0; i < num_keys; i++) {
+    char slot_found;
+    if (read_response(&slot_found, 1) <= 0 ||
+        read_value(read_response, values[i], MAX_VALUE_SIZE + 1) <= 0) {
+      perror("Failed to read mget response");
+      return 1;
+    }
+    found[i] = slot_found;
+  }
+
+  printf("Server returned %d for operation: mget\n", response[1]);
+  return response[1] != 0;
+}
+
+int kvs_getv(const char *key, char *value, unsigned long *version) {
+  char message[1 + MAX_STRING_SIZE] = {0};
+  message[0] = OP_CODE_GETV;
+  snprintf(message + 1, MAX_STRING_SIZE, "%s", key);
+
+  if (send_request(message, sizeof(message)) == -1) {
+    perror("Failed to send getv message");
+    return 1;
+  }
+
+  char response[2 + sizeof(uint64_t)];
+  if (read_response(response, sizeof(response)) <= 0 ||
+      read_value(read_response, value, MAX_VALUE_SIZE + 1) <= 0) {
+    perror("Failed to read getv response");
+    return 1;
+  }
+
+  printf("Server returned %d for operation: getv\n", response[1]);
+  uint64_t wire_version;
+  memcpy(&wire_version, response + 2, sizeof(wire_version));
+  *version = (unsigned long)wire_version;
+  return response[1] != 0;
+}
+
+int kvs_cas(size_t num_pairs, char keys[][MAX_STRING_SIZE],
+            const unsigned long *versions, char values[][MAX_VALUE_SIZE + 1],
+            unsigned long *new_versions) {
+  if (num_pairs > MAX_MGET_KEYS) {
+    fprintf(stderr, "Too many pairs for cas\n");
+    return 1;
+  }
+
+  // O pedido segue numa so escrita, com o tamanho dos valores que leva
+  size_t size = 2;
+  for (size_t i = 0; i < num_pairs; i++) {
+    size += CAS_ENTRY_HEADER + strnlen(values[i], MAX_VALUE_SIZE);
+  }
+  char *message = calloc(1, size);
+  if (message == NULL) {
+    perror("Failed to allocate cas message");
+    return 1;
+  }
+  message[0] = OP_CODE_CAS;
+  message[1] = (char)num_pairs;
+  char *entry = message + 2;
+  for (size_t i = 0; i < num_pairs; i++) {
+    uint64_t wire_version = versions[i];
+    snprintf(entry, MAX_STRING_SIZE, "%s", keys[i]);
+    memcpy(entry + MAX_STRING_SIZE, &wire_version, sizeof(wire_version));
+    values[i][MAX_VALUE_SIZE] = '\0';
+    entry += MAX_STRING_SIZE + sizeof(wire_version);
+    entry += encode_value(entry, values[i]);
+  }
+
+  int sent = send_request(message, size);
+  free(message);
+  if (sent == -1) {
+    perror("Failed to send cas message");
+    return 1;
+  }
+
+  char response[2 + MAX_MGET_KEYS * sizeof(uint64_t)];
+  if (read_response(response, sizeof(response)) <= 0) {
+    perror("Failed to read cas response");
+    return 1;
+  }
+
+  printf("Server returned %d for operation: cas\n", response[1]);
+  if (response[1] != 0) {
+    return 1;
+  }
+
+  for (size_t i = 0; i < num_pairs; i++) {
+    uint64_t wire_version;
+    memcpy(&wire_version, response + 2 + i * sizeof(wire_version),
+           sizeof(wire_version));
+    new_versions[i] = (unsigned long)wire_version;
+  }
+  return 0;
+}
+
+int kvs_read_notification(char *key, char *value, size_t value_size) {
+  int result = read_notification(key, MAX_STRING_SIZE + 1);
+  if (result <= 0) {
+    return result;
+  }
+  key[MAX_STRING_SIZE] = '\0';
+  return read_value(read_notification, value, value_size);
+}
+
 int kvs_end(void) {
+  if (shm_session != NULL) {
+    shm_session_close(shm_session);
+    shm_session_unmap(shm_session);
+    shm_session = NULL;
+    shm_unlink(global_shm_name);
+    return 0;
+  }
+
+  if (sock_fd != -1) {
+    close(sock_fd);
+    sock_fd = -1;
+    for (; sock_notif_count > 0; sock_notif_count--) {
+      free(sock_notifs[sock_notif_head]);
+      sock_notif_head = (sock_notif_head + 1) % SOCK_NOTIF_QUEUE;
+    }
+    sock_notif_pos = 0;
+    return 0;
+  }
+
   // Fechar pipes
-  close(req_fd);
-  close(resp_fd);
-  close(notif_fd);
+  if (req_fd != -1) {
+    close(req_fd);
+    close(resp_fd);
+    close(notif_fd);
+    req_fd = -1;
+    resp_fd = -1;
+    notif_fd = -1;
+  }
 
   // Remover pipes
   unlink(global_req_pipe_path);
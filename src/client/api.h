@@ -13,6 +13,19 @@
 int kvs_connect(char const *req_pipe_path, char const *resp_pipe_path,
                 char const *server_pipe_path, char const *notif_pipe_path,
                 int *notif_pipe);
+/// Connects to a kvs server using a shared memory region instead of named
+/// pipes. Requests, responses and notifications keep the same format.
+/// @param shm_name Name of the shared memory object to be created.
+/// @param server_pipe_path Path to the name pipe where the server is listening.
+/// @return 0 if the connection was established successfully, 1 otherwise.
+int kvs_connect_shm(char const *shm_name, char const *server_pipe_path);
+
+/// Connects to a kvs server listening on a unix socket (SOCK_SEQPACKET). The
+/// connection carries requests, responses and notifications.
+/// @param server_socket_path Path of the socket where the server is listening.
+/// @return 0 if the connection was established successfully, 1 otherwise.
+int kvs_connect_socket(char const *server_socket_path);
+
 /// Disconnects from an KVS server.
 /// @return 0 in case of success, 1 otherwise.
 int kvs_disconnect(void);
@@ -30,6 +43,65 @@ int kvs_subscribe(const char *key);
 /// and was removed), 1 otherwise.
 
 int kvs_unsubscribe(const char *key);
+
+/// Reads the value of a key directly from the server.
+/// @param key Key to be read.
+/// @param value Buffer of MAX_VALUE_SIZE + 1 bytes where the value is stored.
+/// @return 0 if the key exists, 1 if it does not exist or on error.
+int kvs_get(const char *key, char *value);
+
+/// Writes a key value pair directly on the server. Subscribers of the key are
+/// notified as with a WRITE from a job file.
+/// @param key Key to be written.
+/// @param value Value to be written, up to MAX_VALUE_SIZE characters.
+/// @return 0 if the pair was written successfully, 1 otherwise.
+int kvs_put(const char *key, const char *value);
+
+/// Deletes a key directly on the server.
+/// @param key Key to be deleted.
+/// @return 0 if the key existed and was deleted, 1 otherwise.
+int kvs_del(const char *key);
+
+/// Reads up to MAX_MGET_KEYS values in a single request.
+/// @param num_keys Number of keys to read.
+/// @param keys Array of keys' strings.
+/// @param values Array where the values are stored.
+/// @param found found[i] is set to 1 if keys[i] exists, 0 otherwise.
+/// @return 0 in case of success, 1 otherwise.
+int kvs_mget(size_t num_keys, char keys[][MAX_STRING_SIZE],
+             char values[][MAX_VALUE_SIZE + 1], int *found);
+
+/// Reads the value of a key together with its version.
+/// @param key Key to be read.
+/// @param value Buffer of MAX_VALUE_SIZE + 1 bytes where the value is stored.
+/// @param version Set to the version of the key, 0 if it does not exist.
+/// @return 0 if the key exists, 1 if it does not exist or on error.
+int kvs_getv(const char *key, char *value, unsigned long *version);
+
+/// Writes up to MAX_MGET_KEYS pairs atomically, only if every key still has
+/// the version it was read with.
+/// @param num_pairs Number of pairs to write.
+/// @param keys Array of keys' strings.
+/// @param versions Expected version of each key, 0 if it must not exist.
+/// @param values Array of values' strings.
+/// @param new_versions Set to the version of each key after the commit.
+/// @return 0 if the pairs were written, 1 on a conflict or on error.
+int kvs_cas(size_t num_pairs, char keys[][MAX_STRING_SIZE],
+            const unsigned long *versions, char values[][MAX_VALUE_SIZE + 1],
+            unsigned long *new_versions);
+
+/// Reads one notification sent by the server, whatever the transport.
+/// @param key Buffer of MAX_STRING_SIZE + 1 bytes where the key is stored.
+/// @param value Buffer where the new value (or DELETED) is stored. A longer
+/// value is truncated.
+/// @param value_size Size of the value buffer.
+/// @return 1 on success, 0 if the session was closed, -1 on error.
+int kvs_read_notification(char *key, char *value, size_t value_size);
+
+/// Releases the resources of the session (pipes, shared memory or socket).
+/// Must only be called once no other thread is using the session, e.g. after
+/// the notification thread was joined.
+/// @return 0 in case of success.
 int kvs_end(void);
 
 #endif // CLIENT_API_H
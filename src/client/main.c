@@ -12,25 +12,30 @@
 #include "src/common/io.h"
 
 int interrompido = 0;
+int desconectando = 0; // DISCONNECT em curso: o fim das notificações é esperado
 
 void *notification_thread(void *arg) {
-  int notif_pipe = *(int *)arg;
-  char buffer[2 * (MAX_STRING_SIZE+1)];
+  (void)arg; // O transporte da sessao e escolhido pela API
+  char key[MAX_STRING_SIZE + 1];
+  char *value = malloc(MAX_VALUE_SIZE + 1);
+  if (value == NULL) {
+    fprintf(stderr, "Failed to allocate notification buffer\n");
+    interrompido = 1;
+    pthread_exit(NULL);
+  }
   while (1) {
     // Ler notificação do pipe
-    int result = read_all(notif_pipe, buffer, sizeof(buffer), NULL);
+    int result = kvs_read_notification(key, value, MAX_VALUE_SIZE + 1);
     if (result <= 0) {
-      interrompido = 1;
-      kvs_end();
-      fprintf(stderr,"Failed to read notification");
+      // A sessão é libertada pela tarefa principal, que ainda a pode estar
+      // a usar neste momento
+      if (!desconectando) {
+        interrompido = 1;
+        fprintf(stderr,"Failed to read notification");
+      }
+      free(value);
       pthread_exit(NULL);
     }
-    // Extrair chave e valor da notificação
-    char key[(MAX_STRING_SIZE+1)], value[(MAX_STRING_SIZE+1)];
-    strncpy(key, buffer, MAX_STRING_SIZE);
-    key[MAX_STRING_SIZE] = '\0';
-    strncpy(value, buffer + (MAX_STRING_SIZE+1), MAX_STRING_SIZE);
-    value[MAX_STRING_SIZE] = '\0';
     // Imprimir chave e valor
     printf("(%s,%s)\n", key, value);
   }
@@ -40,7 +45,7 @@ void *notification_thread(void *arg) {
 
 int main(int argc, char *argv[]) {
   if (argc < 3) {
-    fprintf(stderr, "Usage: %s <client_unique_id> <register_pipe_path>\n",
+    fprintf(stderr, "Usage: %s <client_unique_id> <register_pipe_path> [fifo|shm|socket]\n",
             argv[0]);
     return 1;
   }
@@ -55,12 +60,25 @@ int main(int argc, char *argv[]) {
   snprintf(notif_pipe_path, MAX_PIPE_PATH_LENGTH, "/tmp/notif_%s", argv[1]);
 
   char keys[MAX_NUMBER_SUB][MAX_STRING_SIZE] = {0};
+  static char values[MAX_NUMBER_SUB][MAX_VALUE_SIZE + 1]; // Valores longos
+  int found[MAX_NUMBER_SUB] = {0};
+  unsigned long versions[MAX_NUMBER_SUB] = {0};
+  unsigned long new_versions[MAX_NUMBER_SUB] = {0};
   unsigned int delay_ms;
   size_t num;
 
-  int notif_pipe;
+  int notif_pipe = -1;
+  int response_code;
   // Conectar ao servidor
-  int response_code = kvs_connect(req_pipe_path, resp_pipe_path, argv[2], notif_pipe_path, &notif_pipe);
+  if (argc > 3 && strcmp(argv[3], "shm") == 0) {
+    char shm_name[MAX_PIPE_PATH_LENGTH];
+    snprintf(shm_name, MAX_PIPE_PATH_LENGTH, "/kvs_%s", argv[1]);
+    response_code = kvs_connect_shm(shm_name, argv[2]);
+  } else if (argc > 3 && strcmp(argv[3], "socket") == 0) {
+    response_code = kvs_connect_socket(argv[2]);
+  } else {
+    response_code = kvs_connect(req_pipe_path, resp_pipe_path, argv[2], notif_pipe_path, &notif_pipe);
+  }
   if (response_code != 0) {
     fprintf(stderr, "Failed to connect to the server\n");
     return 1;
@@ -75,18 +93,22 @@ int main(int argc, char *argv[]) {
 
   while (1) {
     if (interrompido) {
+      pthread_join(notif_thread, NULL);
+      kvs_end();
       return 1;
     }
     switch (get_next(STDIN_FILENO)) {
     case CMD_DISCONNECT:
         // Desconectar do servidor
+        desconectando = 1;
         response_code = kvs_disconnect();
+        pthread_cancel(notif_thread);
+        pthread_join(notif_thread, NULL);
+        kvs_end();
         if (response_code != 0) {
             fprintf(stderr, "Failed to disconnect to the server\n");
             return 1;
         }
-        pthread_cancel(notif_thread);
-        pthread_join(notif_thread, NULL);
         return 0;
 
     case CMD_SUBSCRIBE:
@@ -113,6 +135,100 @@ int main(int argc, char *argv[]) {
         }
         break;
 
+    case CMD_GET:
+        // Ler o valor de uma chave diretamente do servidor
+        num = parse_list(STDIN_FILENO, keys, 1, MAX_STRING_SIZE);
+        if (num == 0) {
+            fprintf(stderr, "Invalid command. See HELP for usage\n");
+            continue;
+        }
+        if (kvs_get(keys[0], values[0]) == 0) {
+            printf("(%s,%s)\n", keys[0], values[0]);
+        } else {
+            printf("(%s,KVSERROR)\n", keys[0]);
+        }
+        break;
+
+    case CMD_PUT:
+        // Escrever pares diretamente no servidor
+        num = parse_pair_list(STDIN_FILENO, keys, values, MAX_NUMBER_SUB,
+                              MAX_STRING_SIZE);
+        if (num == 0) {
+            fprintf(stderr, "Invalid command. See HELP for usage\n");
+            continue;
+        }
+        for (size_t i = 0; i < num; i++) {
+            if (kvs_put(keys[i], values[i])) {
+                fprintf(stderr, "Command put failed\n");
+            }
+        }
+        break;
+
+    case CMD_DEL:
+        // Apagar chaves diretamente no servidor
+        num = parse_list(STDIN_FILENO, keys, MAX_NUMBER_SUB, MAX_STRING_SIZE);
+        if (num == 0) {
+            fprintf(stderr, "Invalid command. See HELP for usage\n");
+            continue;
+        }
+        for (size_t i = 0; i < num; i++) {
+            if (kvs_del(keys[i])) {
+                printf("(%s,KVSMISSING)\n", keys[i]);
+            }
+        }
+        break;
+
+    case CMD_MGET:
+        // Ler varias chaves num unico pedido
+        num = parse_list(STDIN_FILENO, keys, MAX_MGET_KEYS, MAX_STRING_SIZE);
+        if (num == 0) {
+            fprintf(stderr, "Invalid command. See HELP for usage\n");
+            continue;
+        }
+        if (kvs_mget(num, keys, values, found)) {
+            fprintf(stderr, "Command mget failed\n");
+            break;
+        }
+        printf("[");
+        for (size_t i = 0; i < num; i++) {
+            printf("(%s,%s)", keys[i], found[i] ? values[i] : "KVSERROR");
+        }
+        printf("]\n");
+        break;
+
+    case CMD_GETV:
+        // Ler o valor e a versao de uma chave
+        num = parse_list(STDIN_FILENO, keys, 1, MAX_STRING_SIZE);
+        if (num == 0) {
+            fprintf(stderr, "Invalid command. See HELP for usage\n");
+            continue;
+        }
+        if (kvs_getv(keys[0], values[0], &versions[0]) == 0) {
+            printf("(%s,%s,%lu)\n", keys[0], values[0], versions[0]);
+        } else {
+            printf("(%s,KVSERROR)\n", keys[0]);
+        }
+        break;
+
+    case CMD_CAS:
+        // Escrever pares de forma atomica se as versoes lidas se mantiverem
+        num = parse_cas_list(STDIN_FILENO, keys, versions, values,
+                             MAX_MGET_KEYS, MAX_STRING_SIZE);
+        if (num == 0) {
+            fprintf(stderr, "Invalid command. See HELP for usage\n");
+            continue;
+        }
+        if (kvs_cas(num, keys, versions, values, new_versions)) {
+            printf("KVSCONFLICT\n");
+            break;
+        }
+        printf("[");
+        for (size_t i = 0; i < num; i++) {
+            printf("(%s,%lu)", keys[i], new_versions[i]);
+        }
+        printf("]\n");
+        break;
+
     case CMD_DELAY:
         // Processar comando de atraso
         if (parse_delay(STDIN_FILENO, &delay_ms) == -1) {
@@ -116,19 +116,77 @@ enum Command get_next(int fd) {
     return CMD_UNSUBSCRIBE;
 
   case 'D':
-    if (read(fd, buf + 1, 5) != 5 || strncmp(buf, "DELAY ", 6) != 0) {
-      if (read(fd, buf + 6, 4) != 4 || strncmp(buf, "DISCONNECT", 10) != 0) {
+    if (read(fd, buf + 1, 3) != 3) {
+      cleanup(fd);
+      return CMD_INVALID;
+    }
+
+    if (strncmp(buf, "DEL ", 4) == 0) {
+      return CMD_DEL;
+    }
+
+    if (strncmp(buf, "DELA", 4) == 0) {
+      if (read(fd, buf + 4, 2) != 2 || strncmp(buf, "DELAY ", 6) != 0) {
         cleanup(fd);
         return CMD_INVALID;
       }
-      if (read(fd, buf + 10, 1) != 0 && buf[10] != '\n') {
+      return CMD_DELAY;
+    }
+
+    if (read(fd, buf + 4, 6) != 6 || strncmp(buf, "DISCONNECT", 10) != 0) {
+      cleanup(fd);
+      return CMD_INVALID;
+    }
+    if (read(fd, buf + 10, 1) != 0 && buf[10] != '\n') {
+      cleanup(fd);
+      return CMD_INVALID;
+    }
+    return CMD_DISCONNECT;
+
+  case 'G':
+    if (read(fd, buf + 1, 3) != 3) {
+      cleanup(fd);
+      return CMD_INVALID;
+    }
+
+    if (strncmp(buf, "GETV", 4) == 0) {
+      if (read(fd, buf + 4, 1) != 1 || buf[4] != ' ') {
         cleanup(fd);
         return CMD_INVALID;
       }
-      return CMD_DISCONNECT;
+      return CMD_GETV;
+    }
+
+    if (strncmp(buf, "GET ", 4) != 0) {
+      cleanup(fd);
+      return CMD_INVALID;
     }
 
-    return CMD_DELAY;
+    return CMD_GET;
+
+  case 'C':
+    if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "CAS ", 4) != 0) {
+      cleanup(fd);
+      return CMD_INVALID;
+    }
+
+    return CMD_CAS;
+
+  case 'P':
+    if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "PUT ", 4) != 0) {
+      cleanup(fd);
+      return CMD_INVALID;
+    }
+
+    return CMD_PUT;
+
+  case 'M':
+    if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "MGET ", 5) != 0) {
+      cleanup(fd);
+      return CMD_INVALID;
+    }
+
+    return CMD_MGET;
 
   case '#':
     cleanup(fd);
@@ -182,6 +240,114 @@ size_t parse_list(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
   return num_keys;
 }
 
+size_t parse_pair_list(int fd, char keys[][MAX_STRING_SIZE],
+                       char values[][MAX_VALUE_SIZE + 1], size_t max_pairs,
+                       size_t max_string_size) {
+  char ch;
+
+  if (read(fd, &ch, 1) != 1 || ch != '[') {
+    cleanup(fd);
+    return 0;
+  }
+
+  if (read(fd, &ch, 1) != 1 || ch != '(') {
+    cleanup(fd);
+    return 0;
+  }
+
+  size_t num_pairs = 0;
+  char key[max_string_size];
+  while (num_pairs < max_pairs) {
+    if (read_string(fd, key, max_string_size - 1) != 0 ||
+        read_string(fd, values[num_pairs], MAX_VALUE_SIZE) != 1) {
+      cleanup(fd);
+      return 0;
+    }
+
+    strcpy(keys[num_pairs++], key);
+
+    if (read(fd, &ch, 1) != 1 || (ch != '(' && ch != ']')) {
+      cleanup(fd);
+      return 0;
+    }
+
+    if (ch == ']') {
+      break;
+    }
+  }
+
+  if (num_pairs == max_pairs && ch != ']') {
+    cleanup(fd);
+    return 0;
+  }
+
+  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
+    cleanup(fd);
+    return 0;
+  }
+
+  return num_pairs;
+}
+
+size_t parse_cas_list(int fd, char keys[][MAX_STRING_SIZE],
+                      unsigned long *versions,
+                      char values[][MAX_VALUE_SIZE + 1], size_t max_pairs,
+                      size_t max_string_size) {
+  char ch;
+
+  if (read(fd, &ch, 1) != 1 || ch != '[') {
+    cleanup(fd);
+    return 0;
+  }
+
+  if (read(fd, &ch, 1) != 1 || ch != '(') {
+    cleanup(fd);
+    return 0;
+  }
+
+  size_t num_pairs = 0;
+  char key[max_string_size];
+  char version[max_string_size];
+  while (num_pairs < max_pairs) {
+    char *end;
+    if (read_string(fd, key, max_string_size - 1) != 0 ||
+        read_string(fd, version, max_string_size - 1) != 0 ||
+        version[0] == '\0' ||
+        read_string(fd, values[num_pairs], MAX_VALUE_SIZE) != 1) {
+      cleanup(fd);
+      return 0;
+    }
+
+    versions[num_pairs] = strtoul(version, &end, 10);
+    if (*end != '\0') {
+      cleanup(fd);
+      return 0;
+    }
+    strcpy(keys[num_pairs++], key);
+
+    if (read(fd, &ch, 1) != 1 || (ch != '(' && ch != ']')) {
+      cleanup(fd);
+      return 0;
+    }
+
+    if (ch == ']') {
+      break;
+    }
+  }
+
+  if (num_pairs == max_pairs && ch != ']') {
+    cleanup(fd);
+    return 0;
+  }
+
+  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
+    cleanup(fd);
+    return 0;
+  }
+
+  return num_pairs;
+}
+
 int parse_delay(int fd, unsigned int *delay) {
   char ch;
 
@@ -10,6 +10,12 @@ enum Command {
   CMD_SUBSCRIBE,
   CMD_UNSUBSCRIBE,
   CMD_DELAY,
+  CMD_GET,
+  CMD_PUT,
+  CMD_DEL,
+  CMD_MGET,
+  CMD_GETV,
+  CMD_CAS,
   CMD_EMPTY,
   CMD_INVALID,
   EOC // End of commands
@@ -31,6 +37,33 @@ enum Command get_next(int fd);
 size_t parse_list(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
                   size_t max_string_size);
 
+// Parses a list of key value pairs, in the format [(key,value)(key2,value2)]
+// @param fd File descriptor to read from.
+// @param keys Array to store the keys
+// @param values Array to store the values, up to MAX_VALUE_SIZE characters
+// @param max_pairs Maximum number of pairs it will write.
+// @param max_string_size Maximum key size allowed.
+// @return 0 if the command was not parsed successfully, otherwise return the
+//          of pairs parsed
+size_t parse_pair_list(int fd, char keys[][MAX_STRING_SIZE],
+                       char values[][MAX_VALUE_SIZE + 1], size_t max_pairs,
+                       size_t max_string_size);
+
+// Parses a list of compare-and-set entries, in the format
+// [(key,version,value)(key2,version2,value2)]
+// @param fd File descriptor to read from.
+// @param keys Array to store the keys
+// @param versions Array to store the expected versions
+// @param values Array to store the values, up to MAX_VALUE_SIZE characters
+// @param max_pairs Maximum number of entries it will write.
+// @param max_string_size Maximum key size allowed.
+// @return 0 if the command was not parsed successfully, otherwise return the
+//          of entries parsed
+size_t parse_cas_list(int fd, char keys[][MAX_STRING_SIZE],
+                      unsigned long *versions,
+                      char values[][MAX_VALUE_SIZE + 1], size_t max_pairs,
+                      size_t max_string_size);
+
 // Parses a DELAY command.
 // @param fd File descriptor to read from.
 // @param delay Pointer to the variable to store the wait delay in.
@@ -1,7 +1,11 @@
 // constantes partilhadas entre cliente e servidor
+#ifndef MAX_SESSION_COUNT // make SESSIONS=<n> para testes de carga
 #define MAX_SESSION_COUNT                                                      \
   2 // num max de sessoes no server, 1 default, necessario alterar mais tarde
+#endif
 #define STATE_ACCESS_DELAY_US   // delay a aplicar no server
 #define MAX_PIPE_PATH_LENGTH 40 // tamanho max do caminho do pipe
 #define MAX_STRING_SIZE 40
+#define MAX_VALUE_SIZE 16384 // tamanho max de um valor (as chaves ficam em 40)
 #define MAX_NUMBER_SUB 10
+#define MAX_MGET_KEYS 10 // num max de chaves num pedido MGET
@@ -1,6 +1,12 @@
 #ifndef COMMON_PROTOCOL_H
 #define COMMON_PROTOCOL_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "src/common/constants.h"
+
 // Opcodes for client-server communication
 // estes opcodes sao usados num switch case para determinar o que fazer com a
 // mensagem recebida no server usam estes opcodes tambem nos clientes quando
@@ -10,6 +16,103 @@ enum {
   OP_CODE_DISCONNECT,
   OP_CODE_SUBSCRIBE,
   OP_CODE_UNSUBSCRIBE,
+  OP_CODE_GET,
+  OP_CODE_PUT,
+  OP_CODE_DELETE,
+  OP_CODE_MGET,
+  OP_CODE_CONNECT_SHM,
+  OP_CODE_NOTIFY,
+  OP_CODE_GETV,
+  OP_CODE_CAS,
 };
 
+// OP_CODE_CONNECT_SHM usa o mesmo formato de OP_CODE_CONNECT, mas o primeiro
+// campo contem o nome da regiao de memoria partilhada (shm_open) criada pelo
+// cliente, o segundo um FIFO so para a resposta de conexao e o terceiro vai
+// vazio. A resposta segue por esse FIFO, para chegar ao cliente mesmo que o
+// servidor nao consiga abrir a regiao. Os pedidos, respostas e notificacoes
+// seguem depois pelos aneis da regiao com o mesmo formato que nos FIFOs.
+//
+// Com o transporte por socket (AF_UNIX, SOCK_SEQPACKET) o pedido de conexao e
+// o proprio connect() ao socket de registo, e a sessao usa essa unica ligacao
+// nos dois sentidos. Cada pedido e cada resposta seguem numa mensagem com o
+// formato abaixo; as notificacoes seguem em mensagens proprias, precedidas de
+// (char) OP_CODE_NOTIFY.
+//
+// Os valores tem tamanho variavel (ate MAX_VALUE_SIZE) e seguem como
+//   (value) = (uint32_t) len | (char[len]) bytes, sem o '\0'
+//
+// Notificacao:       (char[41]) key | (value) value
+
+// Formato das mensagens de acesso direto a KVS:
+//   GET    pedido:   (char) OP | (char[40]) key
+//          resposta: (char) OP | (char) result | (value) value
+//   PUT    pedido:   (char) OP | (char[40]) key | (value) value
+//          resposta: (char) OP | (char) result
+//   DELETE pedido:   (char) OP | (char[40]) key
+//          resposta: (char) OP | (char) result
+//   MGET   pedido:   (char) OP | (char) n | (char[40]) key * MAX_MGET_KEYS
+//          resposta: (char) OP | (char) result |
+//                    ((char) found | (value) value) * n
+//   GETV   pedido:   (char) OP | (char[40]) key
+//          resposta: (char) OP | (char) result | (uint64_t) version |
+//                    (value) value
+//   CAS    pedido:   (char) OP | (char) n |
+//                    ((char[40]) key | (uint64_t) version | (value) value) * n
+//          resposta: (char) OP | (char) result |
+//                    (uint64_t) new_version * MAX_MGET_KEYS
+// Em GET e DELETE, result e 0 se a chave existia e 1 caso contrario.
+// As versoes seguem na ordem de bytes do host (cliente e servidor partilham a
+// maquina); a versao 0 indica uma chave inexistente. Em CAS, result e 0 se
+// todas as chaves tinham a versao indicada e os pares foram escritos, e 1 se
+// houve conflito e nada foi escrito.
+
+// Tamanho do campo (value), sem os bytes do valor
+#define VALUE_HEADER_SIZE sizeof(uint32_t)
+#define MAX_VALUE_FIELD (VALUE_HEADER_SIZE + MAX_VALUE_SIZE)
+
+// Tamanho de cada entrada de um pedido CAS, sem os bytes do valor
+#define CAS_ENTRY_HEADER (MAX_STRING_SIZE + sizeof(uint64_t) + VALUE_HEADER_SIZE)
+
+// Maior parte fixa de um pedido (MGET), lida de uma vez apos o opcode
+#define MAX_FIXED_PAYLOAD (1 + MAX_MGET_KEYS * MAX_STRING_SIZE)
+
+// Maior payload de um pedido (CAS) e maior resposta (MGET)
+#define MAX_REQUEST_PAYLOAD (1 + MAX_MGET_KEYS * (CAS_ENTRY_HEADER + MAX_VALUE_SIZE))
+#define MAX_RESPONSE_SIZE (2 + MAX_MGET_KEYS * (1 + MAX_VALUE_FIELD))
+#define MAX_NOTIFICATION_SIZE (MAX_STRING_SIZE + 1 + MAX_VALUE_FIELD)
+
+/// Encodes a value as a (value) field.
+/// @param dst Buffer with room for VALUE_HEADER_SIZE + strlen(value) bytes.
+/// @param value Value to encode, at most MAX_VALUE_SIZE bytes long.
+/// @return Number of bytes written.
+static inline size_t encode_value(char *dst, const char *value) {
+  uint32_t len = (uint32_t)strlen(value);
+  memcpy(dst, &len, VALUE_HEADER_SIZE);
+  memcpy(dst + VALUE_HEADER_SIZE, value, len);
+  return VALUE_HEADER_SIZE + len;
+}
+
+/// Size of the fixed part of the payload (without the opcode) of a session
+/// request. Values, in PUT and CAS, are read after it.
+/// @param op_code Opcode of the request.
+/// @return Number of bytes that follow the opcode in the request pipe.
+static inline size_t request_payload_size(char op_code) {
+  switch (op_code) {
+  case OP_CODE_SUBSCRIBE:
+  case OP_CODE_UNSUBSCRIBE:
+  case OP_CODE_GET:
+  case OP_CODE_DELETE:
+  case OP_CODE_GETV:
+  case OP_CODE_PUT:
+    return MAX_STRING_SIZE;
+  case OP_CODE_MGET:
+    return MAX_FIXED_PAYLOAD;
+  case OP_CODE_CAS:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
 #endif // COMMON_PROTOCOL_H
@@ -0,0 +1,186 @@
+// syscall() e SYS_futex nao fazem parte de POSIX
+#define _GNU_SOURCE
+
+#include "shm_ring.h"
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Numero de verificacoes ativas antes de adormecer no futex; num pedido
+// curto a resposta chega normalmente antes de esgotar este limite. Com um
+// so CPU a espera ativa so atrasa o outro processo, por isso e desligada.
+#define SHM_RING_SPIN 1000
+
+static unsigned int spin_limit(void) {
+  static int limit = -1;
+  if (limit < 0) {
+    limit = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHM_RING_SPIN : 0;
+  }
+  return (unsigned int)limit;
+}
+
+/// Blocks while *word still holds the given value. The futex is not private
+/// because the word is shared between processes.
+static void futex_wait(_Atomic uint32_t *word, uint32_t value) {
+  syscall(SYS_futex, (uint32_t *)word, FUTEX_WAIT, value, NULL, NULL, 0);
+}
+
+/// Wakes every thread blocked on word.
+static void futex_wake(_Atomic uint32_t *word) {
+  syscall(SYS_futex, (uint32_t *)word, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
+
+static ShmSession *map_session(int fd) {
+  void *addr =
+      mmap(NULL, sizeof(ShmSession), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    perror("Failed to map shared memory");
+    return NULL;
+  }
+  return (ShmSession *)addr;
+}
+
+ShmSession *shm_session_create(const char *name) {
+  shm_unlink(name); // Remover regiao antiga com o mesmo nome
+
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0666);
+  if (fd == -1) {
+    perror("Failed to create shared memory");
+    return NULL;
+  }
+  if (ftruncate(fd, sizeof(ShmSession)) == -1) {
+    perror("Failed to size shared memory");
+    close(fd);
+    shm_unlink(name);
+    return NULL;
+  }
+
+  // ftruncate preenche a regiao com zeros, que e o estado inicial dos aneis
+  ShmSession *session = map_session(fd);
+  if (session == NULL) {
+    shm_unlink(name);
+  }
+  return session;
+}
+
+ShmSession *shm_session_open(const char *name) {
+  int fd = shm_open(name, O_RDWR, 0);
+  if (fd == -1) {
+    perror("Failed to open shared memory");
+    return NULL;
+  }
+  return map_session(fd);
+}
+
+void shm_session_close(ShmSession *session) {
+  atomic_store(&session->closed, 1);
+
+  ShmRing *rings[] = {&session->req, &session->resp, &session->notif};
+  for (size_t i = 0; i < sizeof(rings) / sizeof(rings[0]); i++) {
+    atomic_fetch_add(&rings[i]->data_seq, 1);
+    atomic_fetch_add(&rings[i]->space_seq, 1);
+    futex_wake(&rings[i]->data_seq);
+    futex_wake(&rings[i]->space_seq);
+  }
+}
+
+void shm_session_unmap(ShmSession *session) {
+  munmap(session, sizeof(ShmSession));
+}
+
+int shm_ring_write(ShmSession *session, ShmRing *ring, const void *buffer,
+                   size_t size) {
+  const char *src = buffer;
+  while (size > 0) {
+    uint32_t seq = atomic_load(&ring->space_seq);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t space = SHM_RING_CAPACITY - (head - atomic_load(&ring->tail));
+
+    if (atomic_load(&session->closed)) {
+      return -1;
+    }
+
+    if (space == 0) {
+      // Anunciar a espera antes de voltar a verificar, para nao perder o
+      // futex_wake do consumidor
+      atomic_fetch_add(&ring->space_waiters, 1);
+      if (head - atomic_load(&ring->tail) == SHM_RING_CAPACITY &&
+          !atomic_load(&session->closed)) {
+        futex_wait(&ring->space_seq, seq);
+      }
+      atomic_fetch_sub(&ring->space_waiters, 1);
+      continue;
+    }
+
+    size_t chunk = size < space ? size : space;
+    size_t offset = head & (SHM_RING_CAPACITY - 1);
+    size_t first = SHM_RING_CAPACITY - offset;
+    if (first > chunk) {
+      first = chunk;
+    }
+    memcpy(ring->data + offset, src, first);
+    memcpy(ring->data, src + first, chunk - first);
+
+    atomic_store(&ring->head, head + (uint32_t)chunk);
+    src += chunk;
+    size -= chunk;
+
+    atomic_fetch_add(&ring->data_seq, 1);
+    if (atomic_load(&ring->data_waiters) > 0) {
+      futex_wake(&ring->data_seq);
+    }
+  }
+  return 1;
+}
+
+int shm_ring_read(ShmSession *session, ShmRing *ring, void *buffer,
+                  size_t size) {
+  char *dst = buffer;
+  unsigned int spins = 0;
+  while (size > 0) {
+    uint32_t seq = atomic_load(&ring->data_seq);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t avail = atomic_load(&ring->head) - tail;
+
+    if (avail == 0) {
+      if (atomic_load(&session->closed)) {
+        return 0;
+      }
+      if (spins++ < spin_limit()) {
+        continue;
+      }
+      atomic_fetch_add(&ring->data_waiters, 1);
+      if (atomic_load(&ring->head) == tail &&
+          !atomic_load(&session->closed)) {
+        futex_wait(&ring->data_seq, seq);
+      }
+      atomic_fetch_sub(&ring->data_waiters, 1);
+      continue;
+    }
+
+    size_t chunk = size < avail ? size : avail;
+    size_t offset = tail & (SHM_RING_CAPACITY - 1);
+    size_t first = SHM_RING_CAPACITY - offset;
+    if (first > chunk) {
+      first = chunk;
+    }
+    memcpy(dst, ring->data + offset, first);
+    memcpy(dst + first, ring->data, chunk - first);
+
+    atomic_store(&ring->tail, tail + (uint32_t)chunk);
+    dst += chunk;
+    size -= chunk;
+
+    atomic_fetch_add(&ring->space_seq, 1);
+    if (atomic_load(&ring->space_waiters) > 0) {
+      futex_wake(&ring->space_seq);
+    }
+  }
+  return 1;
+}
@@ -0,0 +1,68 @@
+#ifndef COMMON_SHM_RING_H
+#define COMMON_SHM_RING_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHM_RING_CAPACITY 8192 // tem de ser potencia de 2
+
+/// Single-producer single-consumer byte ring living in shared memory. Bytes
+/// are exchanged with stream semantics, exactly like a named pipe.
+typedef struct ShmRing {
+  _Atomic uint32_t head;         // bytes produced so far
+  _Atomic uint32_t tail;         // bytes consumed so far
+  _Atomic uint32_t data_seq;     // futex word bumped by the producer
+  _Atomic uint32_t space_seq;    // futex word bumped by the consumer
+  _Atomic uint32_t data_waiters; // consumers sleeping on data_seq
+  _Atomic uint32_t space_waiters; // producers sleeping on space_seq
+  char data[SHM_RING_CAPACITY];
+} ShmRing;
+
+/// Shared region of a session: one ring per FIFO of the FIFO transport.
+typedef struct ShmSession {
+  _Atomic uint32_t closed;
+  ShmRing req;
+  ShmRing resp;
+  ShmRing notif;
+} ShmSession;
+
+/// Creates and maps a new session region (client side).
+/// @param name Name of the shared memory object (e.g. "/kvs_c1").
+/// @return Mapped region, NULL on failure.
+ShmSession *shm_session_create(const char *name);
+
+/// Maps an existing session region (server side).
+/// @param name Name of the shared memory object.
+/// @return Mapped region, NULL on failure.
+ShmSession *shm_session_open(const char *name);
+
+/// Marks the session as closed and wakes every thread blocked on its rings.
+/// @param session Session region.
+void shm_session_close(ShmSession *session);
+
+/// Unmaps a session region. The caller must be the last user of the mapping.
+/// @param session Session region.
+void shm_session_unmap(ShmSession *session);
+
+/// Writes a given number of bytes to a ring. Will block while the ring is
+/// full.
+/// @param session Session the ring belongs to.
+/// @param ring Ring to write to.
+/// @param buffer Buffer to write from.
+/// @param size Number of bytes to write.
+/// @return On success, returns 1, if the session was closed, returns -1
+int shm_ring_write(ShmSession *session, ShmRing *ring, const void *buffer,
+                   size_t size);
+
+/// Reads a given number of bytes from a ring. Will block until all bytes are
+/// read, or fail if the session is closed first.
+/// @param session Session the ring belongs to.
+/// @param ring Ring to read from.
+/// @param buffer Buffer to read into.
+/// @param size Number of bytes to read.
+/// @return On success, returns 1, if the session was closed, returns 0
+int shm_ring_read(ShmSession *session, ShmRing *ring, void *buffer,
+                  size_t size);
+
+#endif // COMMON_SHM_RING_H
@@ -0,0 +1,329 @@
+#include "backup.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "out_writer.h"
+
+/// One writer thread: a run of consecutive pairs, in bucket order, and the
+/// segment file it goes to through the thread's own OutWriter.
+typedef struct SegmentWriter {
+  pthread_t thread;
+  HashTable *table;
+  int first_bucket;
+  KeyNode *first_node; // In first_bucket; NULL if the run is empty
+  size_t count;        // Pairs in the run
+  char path[PATH_MAX];
+  int fd;
+  size_t pairs;
+  size_t bytes;
+  int failed;
+} SegmentWriter;
+
+/// Reader side: the segments of a manifest and the next one to parse.
+typedef struct SegmentList {
+  char paths[BACKUP_MAX_SEGMENTS][PATH_MAX];
+  size_t bytes[BACKUP_MAX_SEGMENTS];
+  size_t count;
+  atomic_size_t next;
+  atomic_size_t pairs;
+  atomic_int failed;
+  BackupStore store;
+} SegmentList;
+
+/// Appends to the segment through the calling thread's writer.
+static void segment_append(SegmentWriter *writer, const char *data,
+                           size_t len) {
+  if (out_writer_write(writer->fd, data, len) != 0) {
+    writer->failed = 1;
+  }
+  writer->bytes += len;
+}
+
+static void *segment_write(void *arg) {
+  SegmentWriter *writer = arg;
+  // Each thread has its own writer, so -o applies to every segment
+  OutWriter out;
+  if (out_writer_open_buffered(&out, writer->fd) != 0) {
+    writer->failed = 1;
+    return NULL;
+  }
+  char value_buf[MAX_VALUE_SIZE + 1];
+  char header[48];
+  int bucket = writer->first_bucket;
+  KeyNode *node = writer->first_node;
+  while (writer->pairs < writer->count) {
+    while (node == NULL) { // The run goes on in the next non-empty bucket
+      node = writer->table->table[++bucket];
+    }
+    const char *value = pair_value(writer->table, node, value_buf);
+    size_t key_len = strlen(node->key);
+    int len = snprintf(header, sizeof(header), "%zu %u\n", key_len,
+                       node->value_size);
+    segment_append(writer, header, (size_t)len);
+    segment_append(writer, node->key, key_len);
+    segment_append(writer, value, node->value_size);
+    segment_append(writer, "\n", 1);
+    writer->pairs++;
+    node = node->next;
+  }
+  writer->failed |= out_writer_close(&out);
+  return NULL;
+}
+
+/// Splits the pairs, in bucket order, into `count` runs of the same length
+/// (give or take one). Runs may start in the middle of a bucket, since keys
+/// are hashed by their first letter and a few buckets often hold most pairs.
+static void split_pairs(HashTable *table, SegmentWriter *writers,
+                        size_t count) {
+  size_t total = 0;
+  for (int i = 0; i < TABLE_SIZE; i++) {
+    for (KeyNode *node = table->table[i]; node != NULL; node = node->next) {
+      total++;
+    }
+  }
+
+  size_t s = 0;
+  size_t seen = 0;
+  for (size_t i = 0; i < count; i++) {
+    writers[i].first_bucket = 0;
+    writers[i].first_node = NULL;
+    writers[i].count = total * (i + 1) / count - total * i / count;
+  }
+  // Each run starts at pair total * s / count
+  for (int i = 0; i < TABLE_SIZE && s < count; i++) {
+    for (KeyNode *node = table->table[i]; node != NULL; node = node->next) {
+      while (s < count && seen == total * s / count) {
+        writers[s].first_bucket = i;
+        writers[s].first_node = node;
+        s++;
+      }
+      seen++;
+    }
+  }
+}
+
+int backup_write_segments(HashTable *table, const char *manifest_path,
+                          int manifest_fd, size_t threads) {
+  size_t count = threads > BACKUP_MAX_SEGMENTS ? BACKUP_MAX_SEGMENTS : threads;
+  SegmentWriter writers[BACKUP_MAX_SEGMENTS];
+  split_pairs(table, writers, count);
+
+  int failed = 0;
+  size_t started = 0;
+  for (; started < count; started++) {
+    SegmentWriter *writer = &writers[started];
+    writer->table = table;
+    writer->pairs = 0;
+    writer->bytes = 0;
+    writer->failed = 0;
+    snprintf(writer->path, sizeof(writer->path), "%s.%zu", manifest_path,
+             started);
+    writer->fd = open(writer->path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (writer->fd == -1 ||
+        pthread_create(&writer->thread, NULL, segment_write, writer) != 0) {
+      if (writer->fd != -1) {
+        close(writer->fd);
+      }
+      failed = 1;
+      break;
+    }
+  }
+
+  for (size_t s = 0; s < started; s++) {
+    pthread_join(writers[s].thread, NULL);
+    failed |= writers[s].failed || close(writers[s].fd) != 0;
+  }
+  if (failed) {
+    return 1;
+  }
+
+  // Segment names are stored relative to the manifest's directory
+  OutWriter out;
+  if (out_writer_open_buffered(&out, manifest_fd) != 0) {
+    return 1;
+  }
+  char line[PATH_MAX + 64];
+  int len = snprintf(line, sizeof(line), "%s 1 %zu\n", BACKUP_MAGIC, count);
+  failed |= out_writer_write(manifest_fd, line, (size_t)len);
+  for (size_t s = 0; s < count; s++) {
+    const char *name = strrchr(writers[s].path, '/');
+    name = name != NULL ? name + 1 : writers[s].path;
+    len = snprintf(line, sizeof(line), "%s %zu %zu\n", name, writers[s].pairs,
+                   writers[s].bytes);
+    failed |= out_writer_write(manifest_fd, line, (size_t)len);
+  }
+  failed |= out_writer_close(&out);
+  return failed;
+}
+
+/// Reads a whole segment and checks its size against the manifest.
+/// @return The contents, to be freed, or NULL on error.
+static char *segment_load(const char *path, size_t bytes) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return NULL;
+  }
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  char *data = malloc(bytes + 1);
+  size_t done = 0;
+  while (data != NULL && done <= bytes) {
+    ssize_t n = read(fd, data + done, bytes + 1 - done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    done += (size_t)n;
+  }
+  close(fd);
+  if (data != NULL && done != bytes) { // Truncated, or larger than recorded
+    free(data);
+    return NULL;
+  }
+  if (data != NULL) {
+    data[bytes] = '\0'; // Stops strtoul at the end of the last record
+  }
+  return data;
+}
+
+/// Parses the records of a segment and stores them in batches.
+/// @return Number of pairs, or -1 if the segment is malformed.
+static long segment_parse(char *data, size_t bytes, BackupStore store) {
+  char keys[BACKUP_RESTORE_BATCH][MAX_STRING_SIZE];
+  char *values[BACKUP_RESTORE_BATCH];
+  size_t batch = 0;
+  long pairs = 0;
+  char *ptr = data;
+  char *end = data + bytes;
+  while (ptr < end) {
+    char *next;
+    errno = 0;
+    size_t key_len = strtoul(ptr, &next, 10);
+    if (next == ptr || *next != ' ') {
+      return -1;
+    }
+    ptr = next + 1;
+    size_t value_len = strtoul(ptr, &next, 10);
+    if (next == ptr || *next != '\n' || errno != 0 ||
+        key_len >= MAX_STRING_SIZE || value_len > MAX_VALUE_SIZE ||
+        (size_t)(end - next - 1) < key_len + value_len + 1) {
+      return -1;
+    }
+    ptr = next + 1;
+    memcpy(keys[batch], ptr, key_len);
+    keys[batch][key_len] = '\0';
+    ptr += key_len;
+    values[batch] = ptr;
+    ptr += value_len;
+    if (*ptr != '\n') {
+      return -1;
+    }
+    *ptr++ = '\0'; // The record's newline ends the value in place
+    if (++batch == BACKUP_RESTORE_BATCH) {
+      store(batch, keys, values);
+      pairs += (long)batch;
+      batch = 0;
+    }
+  }
+  if (batch > 0) {
+    store(batch, keys, values);
+    pairs += (long)batch;
+  }
+  return pairs;
+}
+
+static void *segment_read(void *arg) {
+  SegmentList *list = arg;
+  size_t s;
+  while ((s = atomic_fetch_add(&list->next, 1)) < list->count) {
+    char *data = segment_load(list->paths[s], list->bytes[s]);
+    long pairs = data != NULL ? segment_parse(data, list->bytes[s], list->store)
+                              : -1;
+    free(data);
+    if (pairs < 0) {
+      fprintf(stderr, "Invalid backup segment: %s\n", list->paths[s]);
+      atomic_store(&list->failed, 1);
+      continue;
+    }
+    atomic_fetch_add(&list->pairs, (size_t)pairs);
+  }
+  return NULL;
+}
+
+/// Reads the manifest into the list of segments.
+/// @return 0 on success, 1 otherwise.
+static int manifest_read(const char *manifest_path, SegmentList *list) {
+  FILE *in = fopen(manifest_path, "r");
+  if (in == NULL) {
+    return 1;
+  }
+  char line[PATH_MAX + 64];
+  unsigned version;
+  if (fgets(line, sizeof(line), in) == NULL ||
+      sscanf(line, BACKUP_MAGIC " %u %zu", &version, &list->count) != 2 ||
+      version != 1 || list->count == 0 ||
+      list->count > BACKUP_MAX_SEGMENTS) {
+    fclose(in);
+    return 1;
+  }
+
+  // Segments are next to the manifest
+  const char *slash = strrchr(manifest_path, '/');
+  int dir_len = slash != NULL ? (int)(slash - manifest_path + 1) : 0;
+  for (size_t s = 0; s < list->count; s++) {
+    char name[PATH_MAX];
+    size_t pairs;
+    if (fgets(line, sizeof(line), in) == NULL ||
+        sscanf(line, "%4095s %zu %zu", name, &pairs, &list->bytes[s]) != 3 ||
+        strchr(name, '/') != NULL ||
+        (size_t)snprintf(list->paths[s], PATH_MAX, "%.*s%s", dir_len,
+                         manifest_path, name) >= PATH_MAX) {
+      fclose(in);
+      return 1;
+    }
+  }
+  fclose(in);
+  return 0;
+}
+
+int backup_restore(const char *manifest_path, size_t threads,
+                   BackupStore store, size_t *pairs) {
+  SegmentList *list = calloc(1, sizeof(SegmentList));
+  if (list == NULL) {
+    return 1;
+  }
+  if (manifest_read(manifest_path, list) != 0) {
+    free(list);
+    return 1;
+  }
+  list->store = store;
+
+  size_t count = threads < list->count ? threads : list->count;
+  pthread_t readers[BACKUP_MAX_SEGMENTS];
+  size_t started = 0;
+  for (; started < count; started++) {
+    if (pthread_create(&readers[started], NULL, segment_read, list) != 0) {
+      break;
+    }
+  }
+  if (started == 0) {
+    segment_read(list); // Without threads, parse them all here
+  }
+  for (size_t i = 0; i < started; i++) {
+    pthread_join(readers[i], NULL);
+  }
+
+  *pairs = atomic_load(&list->pairs);
+  int failed = atomic_load(&list->failed);
+  free(list);
+  return failed;
+}
@@ -0,0 +1,48 @@
+#ifndef KVS_BACKUP_H
+#define KVS_BACKUP_H
+
+#include <stddef.h>
+
+#include "constants.h"
+#include "kvs.h"
+
+#define BACKUP_MAX_SEGMENTS 64
+#define BACKUP_RESTORE_BATCH 64 // Pairs stored per call while restoring
+#define BACKUP_MAGIC "KVSBACKUP"
+
+// A parallel backup is a manifest plus one segment file per writer thread.
+// The manifest is the .bck file itself:
+//   KVSBACKUP 1 <segments>
+//   <segment file name> <pairs> <bytes>     (one line per segment)
+// and segment i, named "<manifest>.<i>", holds a run of pairs as records
+//   <key length> <value length>\n<key><value>\n
+// so that keys and values may contain any character. The manifest is written
+// last, so a backup without a complete manifest is incomplete.
+
+/// Writes a parallel backup of the table, splitting its pairs into runs of
+/// the same length, one per thread. Meant for the forked backup child, which
+/// owns a private copy of the table.
+/// @param table Table to back up.
+/// @param manifest_path Path of the manifest; segments are named after it.
+/// @param manifest_fd Open manifest file, written when every segment is done.
+/// @param threads Number of segments and writer threads.
+/// @return 0 on success, 1 otherwise.
+int backup_write_segments(HashTable *table, const char *manifest_path,
+                          int manifest_fd, size_t threads);
+
+/// Stores restored pairs, like kvs_write.
+typedef int (*BackupStore)(size_t num_pairs, char keys[][MAX_STRING_SIZE],
+                           char *values[]);
+
+/// Reads a parallel backup back, with up to `threads` segments parsed at
+/// once, handing the pairs to `store` in batches. Only the parsing is
+/// parallel when `store` serializes, as kvs_write does on the table lock.
+/// @param manifest_path Path of the manifest.
+/// @param threads Maximum number of reader threads.
+/// @param store Called with each batch of pairs, from the reader threads.
+/// @param pairs Number of pairs restored.
+/// @return 0 on success, 1 if the backup is missing, incomplete or invalid.
+int backup_restore(const char *manifest_path, size_t threads,
+                   BackupStore store, size_t *pairs);
+
+#endif // KVS_BACKUP_H
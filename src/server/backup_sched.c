@@ -0,0 +1,215 @@
+#define _GNU_SOURCE // MAP_ANONYMOUS, syscall()
+#include "backup_sched.h"
+
+#include <errno.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lock_profile.h" // Last: may wrap the pthread lock calls
+
+/// A backup child: reserved before the fork, then queued, then writing.
+typedef struct BackupSlot {
+  pid_t pid; // 0 until the child is queued
+  int reserved;
+  int admitted;
+  unsigned long seq; // Queue order
+} BackupSlot;
+
+static struct {
+  int enabled;
+  size_t max_writers;
+  size_t max_pending;
+  size_t slot_count;
+  size_t writers; // Admitted children not reaped yet
+  size_t pending; // Reserved or queued children not admitted yet
+  unsigned long next_seq;
+  BackupSlot *slots;
+  // One futex word per slot, shared with the children: set to 1 when the
+  // child is admitted. Reset before each fork, never while a child waits
+  _Atomic uint32_t *gates;
+  pid_t server; // Parent of every child
+  pthread_mutex_t lock;
+  pthread_cond_t changed; // A child was reserved, queued, admitted or reaped
+} sched = {.lock = PTHREAD_MUTEX_INITIALIZER,
+           .changed = PTHREAD_COND_INITIALIZER};
+
+/// Admits queued children, oldest first, while there are free writers.
+static void admit_next(void) {
+  while (sched.writers < sched.max_writers) {
+    BackupSlot *next = NULL;
+    size_t index = 0;
+    for (size_t i = 0; i < sched.slot_count; i++) {
+      BackupSlot *slot = &sched.slots[i];
+      if (slot->pid != 0 && !slot->admitted &&
+          (next == NULL || slot->seq < next->seq)) {
+        next = slot;
+        index = i;
+      }
+    }
+    if (next == NULL) {
+      return;
+    }
+    next->admitted = 1;
+    sched.pending--;
+    sched.writers++;
+    atomic_store(&sched.gates[index], 1);
+    syscall(SYS_futex, (uint32_t *)&sched.gates[index], FUTEX_WAKE, 1, NULL,
+            NULL, 0);
+  }
+}
+
+/// Forgets a reaped child and hands its writer to the next one.
+static void child_done(BackupSlot *slot) {
+  if (slot->admitted) {
+    sched.writers--;
+  } else {
+    sched.pending--; // Died before its turn
+  }
+  slot->pid = 0;
+  slot->admitted = 0;
+  admit_next();
+}
+
+/// Finds the slot of a queued child.
+/// @param pid Child's pid, or 0 for any queued child.
+/// @return The slot, NULL if there is none.
+static BackupSlot *find_child(pid_t pid) {
+  for (size_t i = 0; i < sched.slot_count; i++) {
+    if (sched.slots[i].pid != 0 && (pid == 0 || sched.slots[i].pid == pid)) {
+      return &sched.slots[i];
+    }
+  }
+  return NULL;
+}
+
+static void *reaper_task(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&sched.lock);
+  while (1) {
+    while (find_child(0) == NULL) {
+      pthread_cond_wait(&sched.changed, &sched.lock);
+    }
+    pthread_mutex_unlock(&sched.lock);
+    // Only look: a child that exits between its fork and backup_sched_submit
+    // is reaped once it is queued, so its slot is not lost
+    siginfo_t info;
+    info.si_pid = 0;
+    int result = waitid(P_ALL, 0, &info, WEXITED | WNOWAIT);
+    int error = errno;
+    pthread_mutex_lock(&sched.lock);
+    if (result == 0 && info.si_pid > 0) {
+      BackupSlot *slot = find_child(info.si_pid);
+      if (slot == NULL) {
+        pthread_cond_wait(&sched.changed, &sched.lock); // Not queued yet
+        continue;
+      }
+      waitpid(info.si_pid, NULL, 0);
+      child_done(slot);
+    } else if (result == -1 && error == ECHILD) {
+      // Nothing left to reap: whatever is still queued is gone
+      for (size_t i = 0; i < sched.slot_count; i++) {
+        if (sched.slots[i].pid != 0) {
+          child_done(&sched.slots[i]);
+        }
+      }
+    }
+    pthread_cond_broadcast(&sched.changed);
+  }
+  return NULL;
+}
+
+int backup_sched_init(size_t max_writers, size_t max_pending) {
+  if (max_writers == 0 || max_pending == 0) {
+    return 1;
+  }
+  sched.slot_count = max_writers + max_pending;
+  sched.slots = calloc(sched.slot_count, sizeof(BackupSlot));
+  sched.gates = mmap(NULL, sched.slot_count * sizeof(*sched.gates),
+                     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (sched.slots == NULL || sched.gates == MAP_FAILED) {
+    free(sched.slots);
+    if (sched.gates != MAP_FAILED) {
+      munmap(sched.gates, sched.slot_count * sizeof(*sched.gates));
+    }
+    return 1;
+  }
+  sched.max_writers = max_writers;
+  sched.max_pending = max_pending;
+  sched.server = getpid();
+  pthread_t reaper;
+  if (pthread_create(&reaper, NULL, reaper_task, NULL) != 0) {
+    return 1;
+  }
+  pthread_detach(reaper);
+  sched.enabled = 1;
+  return 0;
+}
+
+int backup_sched_prepare(BackupTicket *ticket) {
+  ticket->slot = -1;
+  if (!sched.enabled) {
+    return 0;
+  }
+  pthread_mutex_lock(&sched.lock);
+  while (sched.pending >= sched.max_pending) {
+    pthread_cond_wait(&sched.changed, &sched.lock);
+  }
+  // pending < max_pending and writers <= max_writers, so a slot is free
+  size_t i = 0;
+  while (sched.slots[i].pid != 0 || sched.slots[i].reserved) {
+    i++;
+  }
+  sched.slots[i].reserved = 1;
+  atomic_store(&sched.gates[i], 0);
+  sched.pending++;
+  pthread_mutex_unlock(&sched.lock);
+  ticket->slot = (long)i;
+  return 0;
+}
+
+void backup_sched_submit(BackupTicket *ticket, pid_t pid) {
+  if (ticket->slot < 0) {
+    return;
+  }
+  pthread_mutex_lock(&sched.lock);
+  BackupSlot *slot = &sched.slots[ticket->slot];
+  slot->reserved = 0;
+  if (pid > 0) {
+    slot->pid = pid;
+    slot->seq = sched.next_seq++;
+    admit_next();
+  } else {
+    sched.pending--;
+  }
+  pthread_cond_broadcast(&sched.changed);
+  pthread_mutex_unlock(&sched.lock);
+}
+
+void backup_sched_admit(BackupTicket *ticket) {
+  if (ticket->slot < 0) {
+    return;
+  }
+  _Atomic uint32_t *gate = &sched.gates[ticket->slot];
+  // The timeout only serves to notice a server that died: the child then
+  // writes its backup anyway
+  while (atomic_load(gate) == 0 && getppid() == sched.server) {
+    struct timespec timeout = {1, 0};
+    syscall(SYS_futex, (uint32_t *)gate, FUTEX_WAIT, 0, &timeout, NULL, 0);
+  }
+}
+
+void backup_sched_wait_all(void) {
+  pthread_mutex_lock(&sched.lock);
+  while (sched.writers + sched.pending > 0) {
+    pthread_cond_wait(&sched.changed, &sched.lock);
+  }
+  pthread_mutex_unlock(&sched.lock);
+}
@@ -0,0 +1,53 @@
+#ifndef KVS_BACKUP_SCHED_H
+#define KVS_BACKUP_SCHED_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// BACKUP does not wait for other backups to be written. The fork still
+// happens right away, since it is what takes the snapshot, but the child
+// then parks until the scheduler admits it. At most max_writers children are
+// admitted at a time, in the order they were queued; a reaper thread
+// collects finished children and admits the next ones.
+//
+// A parked child is a copy of the server: it shares the table's pages
+// copy-on-write, but every page the server writes while the child waits is
+// copied, so each parked child can grow to the resident size of the table.
+// That is why at most max_pending children are parked: once that many are
+// queued, BACKUP blocks before forking until one of them is admitted, and
+// the server never has more than max_writers + max_pending copies alive.
+
+/// A snapshot being forked: the scheduler slot of its child.
+typedef struct BackupTicket {
+  long slot; // -1 without a scheduler
+} BackupTicket;
+
+/// Starts the scheduler and its reaper thread. Must be called before the
+/// first backup, with the signals the reaper must not take already blocked.
+/// @param max_writers Maximum number of backup children writing at once.
+/// @param max_pending Maximum number of children parked, waiting to write.
+/// @return 0 on success, 1 otherwise.
+int backup_sched_init(size_t max_writers, size_t max_pending);
+
+/// Reserves a slot for a snapshot, blocking while max_pending children are
+/// already parked. No lock is held on return. Without backup_sched_init
+/// nothing is reserved and children run at once.
+/// @param ticket Ticket to initialize.
+/// @return 0 on success, 1 otherwise.
+int backup_sched_prepare(BackupTicket *ticket);
+
+/// Queues the forked child, admitting it at once if there is a free writer.
+/// Also to be called if fork failed, to release the slot.
+/// @param ticket Ticket given to backup_sched_prepare.
+/// @param pid Child's pid, or -1 if fork failed.
+void backup_sched_submit(BackupTicket *ticket, pid_t pid);
+
+/// Called by the child right after the fork: waits until it is admitted, or
+/// until the server is gone. Async-signal-safe.
+/// @param ticket Ticket given to backup_sched_prepare.
+void backup_sched_admit(BackupTicket *ticket);
+
+/// Waits until every queued backup has been written and reaped.
+void backup_sched_wait_all(void);
+
+#endif // KVS_BACKUP_SCHED_H
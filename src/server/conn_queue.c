@@ -0,0 +1,90 @@
+#include "conn_queue.h"
+
+#include <errno.h>
+
+#define CONN_QUEUE_MASK (CONN_QUEUE_CAPACITY - 1)
+
+// sem_wait que ignora interrupções por sinais.
+static void sem_wait_nointr(sem_t *sem) {
+  while (sem_wait(sem) == -1 && errno == EINTR)
+    ;
+}
+
+int conn_queue_init(ConnQueue *queue) {
+  for (size_t i = 0; i < CONN_QUEUE_CAPACITY; i++) {
+    atomic_init(&queue->cells[i].seq, i);
+  }
+  atomic_init(&queue->enqueue_pos, 0);
+  atomic_init(&queue->dequeue_pos, 0);
+  if (sem_init(&queue->items, 0, 0) == -1) {
+    return -1;
+  }
+  if (sem_init(&queue->slots, 0, CONN_QUEUE_CAPACITY) == -1) {
+    sem_destroy(&queue->items);
+    return -1;
+  }
+  return 0;
+}
+
+void conn_queue_destroy(ConnQueue *queue) {
+  sem_destroy(&queue->items);
+  sem_destroy(&queue->slots);
+}
+
+int conn_queue_push(ConnQueue *queue, const ConnectionRequest *request) {
+  // Garante que há uma célula livre. Ao contrário de pop, um sinal não é
+  // ignorado: a tarefa anfitriã tem de tratar o SIGUSR1 enquanto a fila
+  // está cheia
+  if (sem_wait(&queue->slots) == -1) {
+    return -1;
+  }
+
+  ConnCell *cell;
+  size_t pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+  while (1) {
+    cell = &queue->cells[pos & CONN_QUEUE_MASK];
+    size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    if (seq == pos) {
+      // Célula livre para esta volta: tentar reservá-la
+      if (atomic_compare_exchange_weak_explicit(&queue->enqueue_pos, &pos,
+                                                pos + 1, memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        break;
+      }
+    } else {
+      // Outro produtor ganhou a célula; tentar a seguinte
+      pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+    }
+  }
+
+  cell->request = *request;
+  atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+  sem_post(&queue->items);
+  return 0;
+}
+
+void conn_queue_pop(ConnQueue *queue, ConnectionRequest *request) {
+  sem_wait_nointr(&queue->items); // Garante que há um pedido publicado
+
+  ConnCell *cell;
+  size_t pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+  while (1) {
+    cell = &queue->cells[pos & CONN_QUEUE_MASK];
+    size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    if (seq == pos + 1) {
+      if (atomic_compare_exchange_weak_explicit(&queue->dequeue_pos, &pos,
+                                                pos + 1, memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        break;
+      }
+    } else {
+      pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+    }
+  }
+
+  *request = cell->request;
+  // Libertar a célula para a volta seguinte da fila
+  atomic_store_explicit(&cell->seq, pos + CONN_QUEUE_CAPACITY,
+                        memory_order_release);
+  sem_post(&queue->slots);
+}
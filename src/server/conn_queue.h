@@ -0,0 +1,60 @@
+#ifndef KVS_CONN_QUEUE_H
+#define KVS_CONN_QUEUE_H
+
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+#include "src/common/constants.h"
+
+#define CONN_QUEUE_CAPACITY 16 // tem de ser potencia de 2
+
+/// Connection request handed from the host thread to the session managers.
+typedef struct {
+  char op_code; // OP_CODE_CONNECT ou OP_CODE_CONNECT_SHM
+  int sock_fd;  // Ligação aceite no socket de registo, -1 se não houver
+  char req_pipe_path[MAX_PIPE_PATH_LENGTH];
+  char resp_pipe_path[MAX_PIPE_PATH_LENGTH];
+  char notif_pipe_path[MAX_PIPE_PATH_LENGTH];
+} ConnectionRequest;
+
+typedef struct {
+  _Atomic size_t seq;
+  ConnectionRequest request;
+} ConnCell;
+
+/// Bounded multi-producer multi-consumer queue of connection requests. Slots
+/// are claimed with a compare-and-swap on the enqueue/dequeue positions, so
+/// producers and consumers never share a lock; the two semaphores only put
+/// threads to sleep while the queue is full or empty.
+typedef struct {
+  ConnCell cells[CONN_QUEUE_CAPACITY];
+  _Atomic size_t enqueue_pos;
+  _Atomic size_t dequeue_pos;
+  sem_t items;
+  sem_t slots;
+} ConnQueue;
+
+/// Initializes an empty queue.
+/// @param queue Queue to initialize.
+/// @return 0 on success, -1 otherwise.
+int conn_queue_init(ConnQueue *queue);
+
+/// Destroys a queue.
+/// @param queue Queue to destroy.
+void conn_queue_destroy(ConnQueue *queue);
+
+/// Adds a request to the queue, blocking while the queue is full. A signal
+/// caught while waiting for a free cell makes it return without adding, so
+/// the caller can handle the signal and try again.
+/// @param queue Queue to add to.
+/// @param request Request to be copied into the queue.
+/// @return 0 on success, -1 if interrupted by a signal (errno is EINTR).
+int conn_queue_push(ConnQueue *queue, const ConnectionRequest *request);
+
+/// Removes the oldest request from the queue, blocking while it is empty.
+/// @param queue Queue to remove from.
+/// @param request Where the request is copied to.
+void conn_queue_pop(ConnQueue *queue, ConnectionRequest *request);
+
+#endif // KVS_CONN_QUEUE_H
@@ -1,3 +1,5 @@
+#include "src/common/constants.h" // MAX_VALUE_SIZE, shared with the client
+
 #define MAX_WRITE_SIZE 256
 #define MAX_STRING_SIZE 40
 #define MAX_JOB_FILE_NAME_SIZE 256
@@ -0,0 +1,208 @@
+#define _GNU_SOURCE // MAP_ANONYMOUS
+#include "image.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "constants.h"
+#include "out_writer.h"
+
+static int pwrite_all(int fd, const void *data, size_t len, off_t offset) {
+  const char *ptr = data;
+  while (len > 0) {
+    ssize_t written = pwrite(fd, ptr, len, offset);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return 1;
+    }
+    ptr += written;
+    len -= (size_t)written;
+    offset += written;
+  }
+  return 0;
+}
+
+/// Appends to the records through the calling thread's writer.
+static void image_append(int fd, const void *data, size_t len,
+                         uint64_t *offset, int *failed) {
+  *failed |= out_writer_write(fd, data, len);
+  *offset += len;
+}
+
+int image_write(HashTable *ht, const char *path) {
+  char tmp_path[PATH_MAX];
+  if ((size_t)snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >=
+      sizeof(tmp_path)) {
+    return 1;
+  }
+
+  ImageHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+  header.version = IMAGE_VERSION;
+  header.buckets = TABLE_SIZE;
+  for (int i = 0; i < TABLE_SIZE; i++) {
+    header.bucket_start[i] = header.pairs;
+    for (KeyNode *node = ht->table[i]; node != NULL; node = node->next) {
+      header.pairs++;
+    }
+  }
+  header.bucket_start[TABLE_SIZE] = header.pairs;
+
+  size_t entries_size = header.pairs * sizeof(uint64_t);
+  uint64_t *entries = mmap(NULL, entries_size + 1, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  // Records are written in key order through a writer, behind the header
+  // and the entries, which are only known at the end
+  uint64_t offset = sizeof(header) + entries_size;
+  int fd = -1;
+  int failed = 0;
+  OutWriter out;
+  out.fd = -1;
+  if (entries != MAP_FAILED) {
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  }
+  if (fd == -1 || lseek(fd, (off_t)offset, SEEK_SET) == -1 ||
+      out_writer_open_buffered(&out, fd) != 0) {
+    failed = 1;
+  }
+
+  // The index gives the keys in order, so each bucket's entries come out
+  // sorted; the records follow the same order
+  uint64_t fill[TABLE_SIZE];
+  memcpy(fill, header.bucket_start, sizeof(fill));
+  char value_buf[MAX_VALUE_SIZE + 1];
+  static const char padding[8] = {0};
+  for (KeyNode *node = ht->index[0]; node != NULL && !failed;
+       node = node->forward[0]) {
+    int bucket = hash(node->key);
+    if (bucket < 0 || fill[bucket] == header.bucket_start[bucket + 1]) {
+      failed = 1; // The index and the buckets disagree
+      break;
+    }
+    entries[fill[bucket]++] = offset;
+    const char *value = pair_value(ht, node, value_buf);
+    uint32_t lengths[2] = {(uint32_t)strlen(node->key), node->value_size};
+    image_append(fd, lengths, sizeof(lengths), &offset, &failed);
+    image_append(fd, node->key, lengths[0] + 1, &offset, &failed);
+    image_append(fd, value, lengths[1] + 1, &offset, &failed);
+    image_append(fd, padding, (8 - offset % 8) % 8, &offset, &failed);
+  }
+  failed |= out_writer_close(&out);
+
+  if (!failed) {
+    header.file_size = offset;
+    failed |= pwrite_all(fd, &header, sizeof(header), 0) != 0 ||
+              pwrite_all(fd, entries, entries_size, sizeof(header)) != 0 ||
+              fsync(fd) != 0;
+  }
+  if (fd != -1) {
+    failed |= close(fd) != 0;
+  }
+  if (!failed && rename(tmp_path, path) != 0) {
+    failed = 1;
+  }
+  if (failed && fd != -1) {
+    unlink(tmp_path);
+  }
+  if (entries != MAP_FAILED) {
+    munmap(entries, entries_size + 1);
+  }
+  return failed;
+}
+
+int image_open(TableImage *image, const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return 1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ImageHeader)) {
+    close(fd);
+    return 1;
+  }
+  void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return 1;
+  }
+
+  image->data = data;
+  image->size = (size_t)st.st_size;
+  image->header = data;
+  image->entries = (const uint64_t *)(image->header + 1);
+  image->pairs = image->header->pairs;
+  const ImageHeader *header = image->header;
+  int valid = memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) == 0 &&
+              header->version == IMAGE_VERSION &&
+              header->buckets == TABLE_SIZE &&
+              header->file_size == image->size &&
+              header->pairs <=
+                  (image->size - sizeof(ImageHeader)) / sizeof(uint64_t) &&
+              header->bucket_start[0] == 0 &&
+              header->bucket_start[TABLE_SIZE] == header->pairs;
+  for (int i = 0; valid && i < TABLE_SIZE; i++) {
+    valid = header->bucket_start[i] <= header->bucket_start[i + 1];
+  }
+  if (!valid) {
+    munmap(data, image->size);
+    return 1;
+  }
+  return 0;
+}
+
+void image_close(TableImage *image) {
+  munmap((void *)image->data, image->size);
+  image->data = NULL;
+}
+
+int image_pair(const TableImage *image, size_t index, const char **key,
+               const char **value) {
+  uint64_t offset = image->entries[index];
+  if (offset % 8 != 0 || offset > image->size - 8) {
+    return 1;
+  }
+  const uint32_t *lengths = (const uint32_t *)(image->data + offset);
+  if (lengths[0] >= MAX_STRING_SIZE || lengths[1] > MAX_VALUE_SIZE ||
+      8 + (uint64_t)lengths[0] + lengths[1] + 2 > image->size - offset) {
+    return 1;
+  }
+  *key = image->data + offset + 8;
+  *value = *key + lengths[0] + 1;
+  return (*key)[lengths[0]] != '\0' || (*value)[lengths[1]] != '\0';
+}
+
+long image_find(const TableImage *image, const char *key) {
+  int bucket = hash(key);
+  if (bucket < 0) {
+    return -1;
+  }
+  size_t low = image->header->bucket_start[bucket];
+  size_t high = image->header->bucket_start[bucket + 1];
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    const char *mid_key;
+    const char *value;
+    if (image_pair(image, mid, &mid_key, &value) != 0) {
+      return -1; // Corrupt record: the image does not have the key
+    }
+    int cmp = strcmp(mid_key, key);
+    if (cmp == 0) {
+      return (long)mid;
+    }
+    if (cmp < 0) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return -1;
+}
@@ -0,0 +1,77 @@
+#ifndef KVS_IMAGE_H
+#define KVS_IMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kvs.h"
+
+#define IMAGE_MAGIC "KVSIMG01" // 8 bytes, without the '\0'
+#define IMAGE_VERSION 1
+#define IMAGE_MERGE_BATCH 256 // Pairs merged per table write lock hold
+
+// A table image is a file meant to be mapped read-only and used in place.
+// Nothing in it is a pointer; everything is an offset from the start of the
+// file, so it works wherever it is mapped:
+//   ImageHeader
+//   uint64_t entries[pairs]  offset of each record, grouped by bucket (see
+//                            bucket_start) and sorted by key within a bucket
+//   records                  uint32_t key length, uint32_t value length, the
+//                            key and the value, each followed by a '\0', and
+//                            padding to 8 bytes
+// Opening an image only checks the header, so it takes the same time for any
+// number of pairs; records are checked against the file size when used.
+
+typedef struct ImageHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t buckets; // TABLE_SIZE of the server that wrote it
+  uint64_t pairs;
+  uint64_t file_size;
+  uint64_t bucket_start[TABLE_SIZE + 1]; // First entry of each bucket
+} ImageHeader;
+
+/// An image mapped in memory.
+typedef struct TableImage {
+  const char *data;
+  size_t size;
+  const ImageHeader *header;
+  const uint64_t *entries;
+  size_t pairs;
+} TableImage;
+
+/// Writes an image of the table to "<path>.tmp" and renames it to path, so
+/// an existing image is only replaced by a complete one. Meant for a forked
+/// child: it allocates with mmap, not malloc, and takes no lock. The records
+/// go through an OutWriter, so -o applies to them.
+/// @param ht Table to write.
+/// @param path Path of the image.
+/// @return 0 on success, 1 otherwise.
+int image_write(HashTable *ht, const char *path);
+
+/// Maps an image read-only and checks its header.
+/// @param image Image to initialize.
+/// @param path Path of the image.
+/// @return 0 on success, 1 if it cannot be read or is not a valid image.
+int image_open(TableImage *image, const char *path);
+
+/// Unmaps an image.
+/// @param image Image opened with image_open.
+void image_close(TableImage *image);
+
+/// Finds a key with a binary search of its bucket.
+/// @param image Image to search.
+/// @param key The key.
+/// @return Index of the pair, or -1 if the image does not have the key.
+long image_find(const TableImage *image, const char *key);
+
+/// Gets a pair of the image; both strings are '\0' terminated, in the mapping.
+/// @param image Image to read.
+/// @param index Index of the pair, below image->pairs.
+/// @param key Set to the key.
+/// @param value Set to the value.
+/// @return 0 on success, 1 if the record does not fit in the file.
+int image_pair(const TableImage *image, size_t index, const char **key,
+               const char **value);
+
+#endif // KVS_IMAGE_H
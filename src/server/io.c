@@ -3,9 +3,14 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "out_writer.h"
+
 void write_str(int fd, const char *str) {
   size_t len = strlen(str);
   const char *ptr = str;
+  if (out_writer_write(fd, str, len) == 0) {
+    return; // Buffered by the thread's output writer
+  }
 
   while (len > 0) {
     ssize_t written = write(fd, ptr, len);
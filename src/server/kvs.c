@@ -1,10 +1,18 @@
 #include "kvs.h"
 
 #include <ctype.h>
+#include <stddef.h>
 #include <stdlib.h>
 
 #include "string.h"
 
+#include "constants.h"
+#include "lz.h"
+
+#define DICT_TRAIN_SIZE (32 * 1024) // Sampled bytes the dictionary is built from
+#define DICT_SAMPLE_MAX 1024        // Bytes sampled from a single value
+#define POOL_INITIAL_BUCKETS 64
+
 // Hash function based on key initial.
 // @param key Lowercase alphabetical string.
 // @return hash.
@@ -20,6 +28,332 @@ int hash(const char *key) {
   return -1; // Invalid index for non-alphabetic or number strings
 }
 
+// Draws the level of a new index node: level l + 1 is reached with
+// probability 1/4 from level l.
+// @param ht The hash table.
+// @return level, between 1 and INDEX_MAX_LEVEL.
+static int random_level(HashTable *ht) {
+  int level = 1;
+  while (level < INDEX_MAX_LEVEL && (rand_r(&ht->index_seed) & 3) == 0) {
+    level++;
+  }
+  return level;
+}
+
+// Finds, for every level of the index, the link that points to the first node
+// whose key is not smaller than key.
+// @param ht The hash table.
+// @param key The key.
+// @param links Array of INDEX_MAX_LEVEL where the links are stored.
+static void index_find(HashTable *ht, const char *key, KeyNode ***links) {
+  KeyNode **forward = ht->index;
+  for (int level = INDEX_MAX_LEVEL - 1; level >= 0; level--) {
+    while (forward[level] != NULL && strcmp(forward[level]->key, key) < 0) {
+      forward = forward[level]->forward;
+    }
+    links[level] = &forward[level];
+  }
+}
+
+KeyNode *index_seek(HashTable *ht, const char *key) {
+  KeyNode **links[INDEX_MAX_LEVEL];
+  index_find(ht, key, links);
+  return *links[0];
+}
+
+// Keeps a prefix of a large value for the dictionary, and trains it once
+// enough bytes were sampled. Values written before that are compressed
+// without it.
+// @param ht The hash table.
+// @param value The value.
+// @param len Length of the value.
+static void sample_value(HashTable *ht, const char *value, size_t len) {
+  ValueCompression *c = &ht->compression;
+  if (c->samples == NULL) {
+    c->samples = malloc(DICT_TRAIN_SIZE);
+    if (c->samples == NULL) {
+      c->samples_size = DICT_TRAIN_SIZE; // Give up on the dictionary
+      return;
+    }
+  }
+
+  size_t take = len < DICT_SAMPLE_MAX ? len : DICT_SAMPLE_MAX;
+  if (take > DICT_TRAIN_SIZE - c->samples_size) {
+    take = DICT_TRAIN_SIZE - c->samples_size;
+  }
+  memcpy(c->samples + c->samples_size, value, take);
+  c->samples_size += take;
+  if (c->samples_size < DICT_TRAIN_SIZE) {
+    return;
+  }
+
+  char *dict = malloc(LZ_DICT_SIZE);
+  size_t dict_size = dict != NULL ? lz_train(c->samples, DICT_TRAIN_SIZE, dict) : 0;
+  if (dict_size > 0) {
+    c->dict = dict;
+    c->dict_size = dict_size;
+  } else {
+    free(dict);
+  }
+  free(c->samples);
+  c->samples = NULL;
+}
+
+// Stores a large value compressed, if compression is enabled and the value
+// gets smaller.
+// @param ht The hash table.
+// @param keyNode The node, without a value.
+// @param value The value.
+// @param len Length of the value.
+// @return 0 if the value was stored compressed, 1 otherwise.
+static int compress_value(HashTable *ht, KeyNode *keyNode, const char *value,
+                          size_t len) {
+  ValueCompression *c = &ht->compression;
+  if (c->threshold == 0 || len < c->threshold || len > MAX_VALUE_SIZE) {
+    return 1;
+  }
+  if (c->samples_size < DICT_TRAIN_SIZE) {
+    sample_value(ht, value, len);
+  }
+
+  char packed[MAX_VALUE_SIZE];
+  size_t size = lz_compress(value, len, c->dict, c->dict_size, packed);
+  if (size == 0 || (keyNode->value = malloc(size)) == NULL) {
+    return 1;
+  }
+  memcpy(keyNode->value, packed, size);
+  keyNode->packed_size = (unsigned int)size;
+  keyNode->packed_dict = c->dict != NULL;
+  c->packed_values++;
+  c->raw_bytes += len;
+  c->packed_bytes += size;
+  return 0;
+}
+
+// FNV-1a hash of a value, used to index the pool.
+// @param value The value.
+// @param len Length of the value.
+// @return hash.
+static unsigned int value_hash(const char *value, size_t len) {
+  unsigned int h = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char)value[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// Doubles the buckets of the pool. Called with the pool lock held.
+// @param pool The pool.
+static void pool_grow(ValuePool *pool) {
+  size_t num_buckets = pool->num_buckets * 2;
+  InternedValue **buckets = calloc(num_buckets, sizeof(InternedValue *));
+  if (buckets == NULL) {
+    return; // Keep the longer chains
+  }
+  for (size_t i = 0; i < pool->num_buckets; i++) {
+    InternedValue *entry = pool->buckets[i];
+    while (entry != NULL) {
+      InternedValue *next = entry->next;
+      size_t bucket = entry->hash & (num_buckets - 1);
+      entry->next = buckets[bucket];
+      buckets[bucket] = entry;
+      entry = next;
+    }
+  }
+  free(pool->buckets);
+  pool->buckets = buckets;
+  pool->num_buckets = num_buckets;
+}
+
+// Takes a reference to the pooled copy of a value, adding the copy if there is
+// none yet.
+// @param pool The pool.
+// @param value The value.
+// @param len Length of the value.
+// @param created Set to 1 if the copy was added, 0 otherwise.
+// @return the entry, NULL if out of memory.
+static InternedValue *intern_acquire(ValuePool *pool, const char *value,
+                                     size_t len, int *created) {
+  unsigned int h = value_hash(value, len);
+  *created = 0;
+
+  pthread_mutex_lock(&pool->lock);
+  InternedValue *entry = pool->buckets[h & (pool->num_buckets - 1)];
+  for (; entry != NULL; entry = entry->next) {
+    if (entry->hash != h || entry->size != len ||
+        memcmp(entry->data, value, len) != 0) {
+      continue;
+    }
+    // An entry whose last reference is being dropped is not revived; its
+    // owner is waiting for the lock to unlink it
+    unsigned int refs = atomic_load_explicit(&entry->refs, memory_order_relaxed);
+    while (refs > 0 && !atomic_compare_exchange_weak_explicit(
+                           &entry->refs, &refs, refs + 1, memory_order_relaxed,
+                           memory_order_relaxed))
+      ;
+    if (refs > 0) {
+      break;
+    }
+  }
+
+  if (entry == NULL) {
+    entry = malloc(sizeof(InternedValue) + len + 1);
+    if (entry != NULL) {
+      size_t bucket = h & (pool->num_buckets - 1);
+      atomic_init(&entry->refs, 1);
+      entry->hash = h;
+      entry->size = (unsigned int)len;
+      memcpy(entry->data, value, len);
+      entry->data[len] = '\0';
+      entry->next = pool->buckets[bucket];
+      pool->buckets[bucket] = entry;
+      pool->entries++;
+      pool->bytes += len;
+      if (pool->entries > pool->num_buckets) {
+        pool_grow(pool);
+      }
+      *created = 1;
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  if (entry != NULL) {
+    atomic_fetch_add_explicit(&pool->refs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&pool->shared_bytes, len, memory_order_relaxed);
+  }
+  return entry;
+}
+
+// Drops a reference to a pooled value, and frees the value with the last one.
+// @param pool The pool.
+// @param entry The entry.
+// @return 1 if the value was freed, 0 otherwise.
+static int intern_release(ValuePool *pool, InternedValue *entry) {
+  atomic_fetch_sub_explicit(&pool->refs, 1, memory_order_relaxed);
+  atomic_fetch_sub_explicit(&pool->shared_bytes, entry->size,
+                            memory_order_relaxed);
+  if (atomic_fetch_sub_explicit(&entry->refs, 1, memory_order_acq_rel) > 1) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  InternedValue **link = &pool->buckets[entry->hash & (pool->num_buckets - 1)];
+  while (*link != entry) {
+    link = &(*link)->next;
+  }
+  *link = entry->next;
+  pool->entries--;
+  pool->bytes -= entry->size;
+  pthread_mutex_unlock(&pool->lock);
+  free(entry);
+  return 1;
+}
+
+// Points a node at the pooled copy of a value, if interning is enabled and
+// the value is short enough. The copy is accounted once, when it is added.
+// @param ht The hash table.
+// @param keyNode The node, without a value.
+// @param value The value.
+// @param len Length of the value.
+// @return 0 if the value was interned, 1 otherwise.
+static int intern_value(HashTable *ht, KeyNode *keyNode, const char *value,
+                        size_t len) {
+  if (ht->pool.buckets == NULL || len > INTERN_MAX_SIZE) {
+    return 1;
+  }
+  int created;
+  InternedValue *entry = intern_acquire(&ht->pool, value, len, &created);
+  if (entry == NULL) {
+    return 1;
+  }
+  keyNode->value = entry->data;
+  keyNode->interned = 1;
+  if (created) {
+    ht->memory_used += sizeof(InternedValue) + len + 1;
+  }
+  return 0;
+}
+
+// Stores a value in a node: inside the node when it is small, so the common
+// case costs no extra allocation, shared with the nodes that hold the same
+// value if interning is enabled, and in its own heap block otherwise,
+// compressed if it is large enough.
+// @param ht The hash table.
+// @param keyNode The node, without a value.
+// @param value The value.
+// @return 0 if successful, 1 if there is no memory for the value (the node is
+// then left with an empty value).
+static int set_value(HashTable *ht, KeyNode *keyNode, const char *value) {
+  size_t len = strlen(value);
+  keyNode->value_size = (unsigned int)len;
+  keyNode->packed_size = 0;
+  keyNode->packed_dict = 0;
+  keyNode->interned = 0;
+  if (len < INLINE_VALUE_SIZE) {
+    keyNode->value = keyNode->inline_value;
+  } else if (intern_value(ht, keyNode, value, len) == 0 ||
+             compress_value(ht, keyNode, value, len) == 0) {
+    return 0;
+  } else {
+    keyNode->value = malloc(len + 1);
+    if (keyNode->value == NULL) {
+      keyNode->value = keyNode->inline_value;
+      keyNode->value_size = 0;
+      keyNode->inline_value[0] = '\0';
+      return 1;
+    }
+  }
+  memcpy(keyNode->value, value, len + 1);
+  return 0;
+}
+
+// Frees the heap block of a large value, without decompressing it, or drops
+// the node's reference to an interned one.
+// @param ht The hash table.
+// @param keyNode The node.
+static void free_value(HashTable *ht, KeyNode *keyNode) {
+  if (keyNode->interned) {
+    InternedValue *entry = (InternedValue *)(void *)(keyNode->value -
+                                             offsetof(InternedValue, data));
+    size_t size = sizeof(InternedValue) + entry->size + 1;
+    if (intern_release(&ht->pool, entry)) {
+      ht->memory_used -= size;
+    }
+    return;
+  }
+  if (keyNode->packed_size > 0) {
+    ht->compression.packed_values--;
+    ht->compression.raw_bytes -= keyNode->value_size;
+    ht->compression.packed_bytes -= keyNode->packed_size;
+  }
+  if (keyNode->value != keyNode->inline_value) {
+    free(keyNode->value);
+  }
+}
+
+// Bytes taken by a value outside of its node.
+// @param keyNode The node.
+// @return size in bytes.
+static size_t value_heap_size(KeyNode *keyNode) {
+  if (keyNode->interned) {
+    return 0; // Accounted once, by the pool
+  }
+  if (keyNode->packed_size > 0) {
+    return keyNode->packed_size;
+  }
+  return keyNode->value != keyNode->inline_value ? keyNode->value_size + 1 : 0;
+}
+
+// Memory accounted for a node: the node with its index links and the key and
+// value copies (allocator overhead is not included).
+// @param keyNode The node.
+// @return size in bytes.
+static size_t node_size(KeyNode *keyNode) {
+  return sizeof(KeyNode) + (size_t)keyNode->level * sizeof(KeyNode *) +
+         strlen(keyNode->key) + 1 + value_heap_size(keyNode);
+}
+
 struct HashTable *create_hash_table() {
   HashTable *ht = malloc(sizeof(HashTable));
   if (!ht)
@@ -27,12 +361,30 @@ struct HashTable *create_hash_table() {
   for (int i = 0; i < TABLE_SIZE; i++) {
     ht->table[i] = NULL;
   }
+  for (int i = 0; i < INDEX_MAX_LEVEL; i++) {
+    ht->index[i] = NULL;
+  }
+  ht->index_seed = 1;
+  ht->version_clock = 0;
+  timer_wheel_init(&ht->expiry_wheel, timer_wheel_now());
+  ht->memory_used = 0;
+  ht->clock_hand = NULL;
+  memset(&ht->compression, 0, sizeof(ht->compression));
+  ht->pool.buckets = NULL;
+  ht->pool.num_buckets = 0;
+  ht->pool.entries = 0;
+  ht->pool.bytes = 0;
+  atomic_init(&ht->pool.refs, 0);
+  atomic_init(&ht->pool.shared_bytes, 0);
+  pthread_mutex_init(&ht->pool.lock, NULL);
   pthread_rwlock_init(&ht->tablelock, NULL);
   return ht;
 }
 
 int write_pair(HashTable *ht, const char *key, const char *value) {
   int index = hash(key);
+  if (index < 0)
+    return 1;
 
   // Search for the key node
   KeyNode *keyNode = ht->table[index];
@@ -41,43 +393,222 @@ int write_pair(HashTable *ht, const char *key, const char *value) {
   while (keyNode != NULL) {
     if (strcmp(keyNode->key, key) == 0) {
       // overwrite value
-      free(keyNode->value);
-      keyNode->value = strdup(value);
+      ht->memory_used -= value_heap_size(keyNode);
+      free_value(ht, keyNode);
+      if (set_value(ht, keyNode, value) != 0) {
+        // The old value is already gone: drop the pair rather than keep it
+        // with an empty value
+        delete_pair(ht, key);
+        return 1;
+      }
+      ht->memory_used += value_heap_size(keyNode);
+      atomic_store_explicit(&keyNode->referenced, 1, memory_order_relaxed);
+      keyNode->version = ++ht->version_clock;
+      timer_wheel_cancel(&ht->expiry_wheel, &keyNode->expiry);
       return 0;
     }
     previousNode = keyNode;
     keyNode = previousNode->next; // Move to the next node
   }
   // Key not found, create a new key node
-  keyNode = malloc(sizeof(KeyNode));
-  keyNode->key = strdup(key);       // Allocate memory for the key
-  keyNode->value = strdup(value);   // Allocate memory for the value
+  int level = random_level(ht);
+  keyNode = malloc(sizeof(KeyNode) + (size_t)level * sizeof(KeyNode *));
+  if (keyNode == NULL) {
+    return 1;
+  }
+  keyNode->key = strdup(key); // Allocate memory for the key
+  if (keyNode->key == NULL || set_value(ht, keyNode, value) != 0) {
+    free(keyNode->key);
+    free(keyNode);
+    return 1;
+  }
   keyNode->next = ht->table[index]; // Link to existing nodes
+  keyNode->version = ++ht->version_clock;
+  timer_init(&keyNode->expiry);
+  atomic_init(&keyNode->referenced, 1);
   ht->table[index] = keyNode; // Place new key node at the start of the list
+
+  // Link it in the ordered index, right before the first greater key
+  KeyNode **links[INDEX_MAX_LEVEL];
+  index_find(ht, key, links);
+  keyNode->level = level;
+  for (int i = 0; i < level; i++) {
+    keyNode->forward[i] = *links[i];
+    *links[i] = keyNode;
+  }
+  ht->memory_used += node_size(keyNode);
   return 0;
 }
 
-char *read_pair(HashTable *ht, const char *key) {
+KeyNode *lookup_pair(HashTable *ht, const char *key) {
   int index = hash(key);
+  if (index < 0)
+    return NULL;
 
   KeyNode *keyNode = ht->table[index];
-  KeyNode *previousNode;
-  char *value;
-
   while (keyNode != NULL) {
     if (strcmp(keyNode->key, key) == 0) {
-      value = strdup(keyNode->value);
-      return value; // Return the value if found
+      // Readers only share the read lock, hence the atomic store
+      atomic_store_explicit(&keyNode->referenced, 1, memory_order_relaxed);
+      return keyNode;
     }
-    previousNode = keyNode;
-    keyNode = previousNode->next; // Move to the next node
+    keyNode = keyNode->next; // Move to the next node
   }
 
   return NULL; // Key not found
 }
 
+char *read_pair(HashTable *ht, const char *key) {
+  KeyNode *keyNode = lookup_pair(ht, key);
+  if (keyNode == NULL)
+    return NULL;
+
+  char *value = malloc(keyNode->value_size + 1);
+  if (value != NULL) {
+    const char *stored = pair_value(ht, keyNode, value);
+    if (stored != value) {
+      memcpy(value, stored, keyNode->value_size + 1);
+    }
+  }
+  return value; // Return the value if found
+}
+
+void enable_compression(HashTable *ht, size_t threshold) {
+  ht->compression.threshold =
+      threshold > INLINE_VALUE_SIZE ? threshold : INLINE_VALUE_SIZE;
+}
+
+int enable_interning(HashTable *ht) {
+  if (ht->pool.buckets != NULL) {
+    return 0;
+  }
+  ht->pool.buckets = calloc(POOL_INITIAL_BUCKETS, sizeof(InternedValue *));
+  if (ht->pool.buckets == NULL) {
+    return 1;
+  }
+  ht->pool.num_buckets = POOL_INITIAL_BUCKETS;
+  return 0;
+}
+
+const char *pair_value(HashTable *ht, const KeyNode *keyNode, char *buf) {
+  if (keyNode->packed_size == 0) {
+    return keyNode->value;
+  }
+  const ValueCompression *c = &ht->compression;
+  if (lz_decompress(keyNode->value, keyNode->packed_size,
+                    keyNode->packed_dict ? c->dict : NULL, c->dict_size, buf,
+                    keyNode->value_size) != 0) {
+    buf[0] = '\0'; // Not expected: the value was compressed in-process
+    return buf;
+  }
+  buf[keyNode->value_size] = '\0';
+  return buf;
+}
+
+unsigned long read_version(HashTable *ht, const char *key) {
+  int index = hash(key);
+  if (index < 0)
+    return 0;
+
+  for (KeyNode *keyNode = ht->table[index]; keyNode != NULL;
+       keyNode = keyNode->next) {
+    if (strcmp(keyNode->key, key) == 0) {
+      return keyNode->version;
+    }
+  }
+  return 0;
+}
+
+// Finds the node of a key.
+// @param ht The hash table.
+// @param key The key.
+// @return the node if found, NULL otherwise.
+static KeyNode *find_node(HashTable *ht, const char *key) {
+  int index = hash(key);
+  if (index < 0)
+    return NULL;
+
+  for (KeyNode *keyNode = ht->table[index]; keyNode != NULL;
+       keyNode = keyNode->next) {
+    if (strcmp(keyNode->key, key) == 0) {
+      return keyNode;
+    }
+  }
+  return NULL;
+}
+
+int set_expiry(HashTable *ht, const char *key, unsigned long expires) {
+  KeyNode *keyNode = find_node(ht, key);
+  if (keyNode == NULL)
+    return 1;
+
+  timer_wheel_cancel(&ht->expiry_wheel, &keyNode->expiry);
+  timer_wheel_add(&ht->expiry_wheel, &keyNode->expiry, expires);
+  return 0;
+}
+
+size_t expire_pairs(HashTable *ht, unsigned long now, char ***expired) {
+  TimerEntry *fired = timer_wheel_advance(&ht->expiry_wheel, now);
+  *expired = NULL;
+
+  size_t count = 0;
+  for (TimerEntry *timer = fired; timer != NULL; timer = timer->next) {
+    count++;
+  }
+  if (count == 0)
+    return 0;
+
+  *expired = malloc(count * sizeof(char *));
+  size_t i = 0;
+  while (fired != NULL) {
+    // The timer is embedded in the node, which delete_pair frees
+    KeyNode *keyNode =
+        (KeyNode *)(void *)((char *)fired - offsetof(KeyNode, expiry));
+    fired = fired->next;
+    char *key = strdup(keyNode->key);
+    delete_pair(ht, key);
+    if (*expired != NULL) {
+      (*expired)[i++] = key;
+    } else {
+      free(key);
+    }
+  }
+  return *expired != NULL ? count : 0;
+}
+
+size_t evict_pairs(HashTable *ht, size_t max_memory, char ***evicted) {
+  size_t count = 0;
+  size_t capacity = 0;
+  *evicted = NULL;
+
+  while (ht->memory_used > max_memory && ht->index[0] != NULL) {
+    KeyNode *keyNode = ht->clock_hand != NULL ? ht->clock_hand : ht->index[0];
+    ht->clock_hand = keyNode->forward[0]; // NULL wraps around to the start
+
+    if (atomic_exchange_explicit(&keyNode->referenced, 0,
+                                 memory_order_relaxed)) {
+      continue; // Second chance
+    }
+
+    if (count == capacity) {
+      capacity = capacity * 2 + 8;
+      char **keys = realloc(*evicted, capacity * sizeof(char *));
+      if (keys == NULL) {
+        break;
+      }
+      *evicted = keys;
+    }
+    char *key = strdup(keyNode->key);
+    delete_pair(ht, key);
+    (*evicted)[count++] = key;
+  }
+  return count;
+}
+
 int delete_pair(HashTable *ht, const char *key) {
   int index = hash(key);
+  if (index < 0)
+    return 1;
 
   // Search for the key node
   KeyNode *keyNode = ht->table[index];
@@ -95,9 +626,20 @@ int delete_pair(HashTable *ht, const char *key) {
         prevNode->next =
             keyNode->next; // Link the previous node to the next node
       }
+      timer_wheel_cancel(&ht->expiry_wheel, &keyNode->expiry);
+      ht->memory_used -= node_size(keyNode);
+      if (ht->clock_hand == keyNode) {
+        ht->clock_hand = keyNode->forward[0];
+      }
+      // Unlink it from the ordered index
+      KeyNode **links[INDEX_MAX_LEVEL];
+      index_find(ht, key, links);
+      for (int i = 0; i < keyNode->level; i++) {
+        *links[i] = keyNode->forward[i];
+      }
       // Free the memory allocated for the key and value
       free(keyNode->key);
-      free(keyNode->value);
+      free_value(ht, keyNode);
       free(keyNode); // Free the key node itself
       return 0;      // Exit the function
     }
@@ -115,10 +657,14 @@ void free_table(HashTable *ht) {
       KeyNode *temp = keyNode;
       keyNode = keyNode->next;
       free(temp->key);
-      free(temp->value);
+      free_value(ht, temp);
       free(temp);
     }
   }
+  free(ht->compression.dict);
+  free(ht->compression.samples);
+  free(ht->pool.buckets); // Emptied by freeing the nodes
+  pthread_mutex_destroy(&ht->pool.lock);
   pthread_rwlock_destroy(&ht->tablelock);
   free(ht);
 }
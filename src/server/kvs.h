@@ -1,18 +1,80 @@
 #ifndef KEY_VALUE_STORE_H
 #define KEY_VALUE_STORE_H
 #define TABLE_SIZE 26
+#define INDEX_MAX_LEVEL 16 // Levels of the ordered index (skip list)
+#define INLINE_VALUE_SIZE 24 // Values shorter than this live inside the node
+#define INTERN_MAX_SIZE 256  // Longer values are never interned
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stddef.h>
 
+#include "timer_wheel.h"
+
 typedef struct KeyNode {
   char *key;
-  char *value;
+  char *value; // Points to inline_value or to a heap block for large values
   struct KeyNode *next;
+  unsigned long version;     // Value of the version clock at the last write
+  TimerEntry expiry;         // Armed while the key has a TTL
+  atomic_int referenced;     // CLOCK bit, set by reads under the read lock
+  unsigned int value_size;   // Length of the value, without the '\0'
+  unsigned int packed_size;  // Bytes of the compressed value, 0 if plain
+  unsigned char packed_dict; // Compressed against the table dictionary
+  unsigned char interned;    // value points into the table's ValuePool
+  char inline_value[INLINE_VALUE_SIZE];
+  int level;                 // Number of index levels this node is linked in
+  struct KeyNode *forward[]; // Next node in key order, one per level
 } KeyNode;
 
+/// Optional compression of large values. The dictionary is trained once, from
+/// the first large values written, and never changes afterwards, so readers
+/// can use it under the read lock.
+typedef struct ValueCompression {
+  size_t threshold;    // Values at least this long are compressed, 0 disables
+  char *dict;          // NULL until trained
+  size_t dict_size;
+  char *samples;       // Prefixes of large values kept to train the dictionary
+  size_t samples_size; // Stops growing once the dictionary is trained
+  size_t packed_values;
+  size_t raw_bytes;    // Length of the compressed values
+  size_t packed_bytes; // Bytes they take compressed
+} ValueCompression;
+
+/// Value shared by every node that holds the same bytes. Nodes point at data.
+typedef struct InternedValue {
+  struct InternedValue *next; // Next entry of the pool bucket
+  atomic_uint refs;           // Nodes holding the value, unlinked at 0
+  unsigned int hash;
+  unsigned int size;          // Length of the value, without the '\0'
+  char data[];
+} InternedValue;
+
+/// Optional pool of interned values: identical values of up to
+/// INTERN_MAX_SIZE bytes that do not fit inside the node share one
+/// refcounted copy. The buckets are guarded by their own mutex and a
+/// reference is dropped with an atomic decrement, so only the last one
+/// takes the mutex.
+typedef struct ValuePool {
+  InternedValue **buckets;    // NULL while interning is disabled
+  size_t num_buckets;         // Power of two
+  size_t entries;             // Distinct values
+  size_t bytes;               // Length of the distinct values
+  atomic_size_t refs;         // Nodes that hold an interned value
+  atomic_size_t shared_bytes; // Length of the values those nodes hold
+  pthread_mutex_t lock;
+} ValuePool;
+
 typedef struct HashTable {
   KeyNode *table[TABLE_SIZE];
+  KeyNode *index[INDEX_MAX_LEVEL]; // Heads of the skip list over all keys
+  unsigned int index_seed;         // Seed for the node levels
+  unsigned long version_clock;     // Bumped by every write, never reused
+  TimerWheel expiry_wheel;         // Expiry of the keys with a TTL
+  size_t memory_used;              // Bytes taken by the nodes and strings
+  KeyNode *clock_hand;             // Next eviction candidate, in key order
+  ValueCompression compression;
+  ValuePool pool;
   pthread_rwlock_t tablelock;
 } HashTable;
 
@@ -26,21 +88,91 @@ int hash(const char *key);
 // @param ht The hash table.
 // @param key The key.
 // @param value The value.
-// @return 0 if successful.
+// @return 0 if successful, 1 if the key is invalid or there is no memory for
+// the pair (an existing pair is then removed).
 int write_pair(HashTable *ht, const char *key, const char *value);
 
+/// Compresses, from now on, every value that is at least threshold bytes
+/// long and gets smaller. Compressed values are only decompressed when read.
+/// @param ht Hash table.
+/// @param threshold Minimum value length, raised to INLINE_VALUE_SIZE.
+void enable_compression(HashTable *ht, size_t threshold);
+
+/// Interns, from now on, the values that are too long to live inside the node
+/// and at most INTERN_MAX_SIZE bytes long, so that identical ones share a
+/// single copy. Takes precedence over compression for those values.
+/// @param ht Hash table.
+/// @return 0 if interning was enabled, 1 if out of memory.
+int enable_interning(HashTable *ht);
+
+/// Gets the value of a node, decompressing it if it is compressed. Async
+/// signal safe, so it can be used after fork.
+/// @param ht Hash table of the node.
+/// @param keyNode The node.
+/// @param buf Buffer of MAX_VALUE_SIZE + 1 bytes, only used for a compressed
+/// value.
+/// @return The value, either in the node or in buf.
+const char *pair_value(HashTable *ht, const KeyNode *keyNode, char *buf);
+
+/// Finds the node of a key and marks it as recently used. The node is only
+/// valid while the table lock is held.
+/// @param ht Hash table to read from.
+/// @param key The key.
+/// @return The node if found, NULL otherwise.
+KeyNode *lookup_pair(HashTable *ht, const char *key);
+
 // Reads the value of a given key.
 // @param ht The hash table.
 // @param key The key.
 // return the value if found, NULL otherwise.
 char *read_pair(HashTable *ht, const char *key);
 
+/// Gets the version of a key, which changes every time the key is written.
+/// @param ht Hash table to read from.
+/// @param key The key.
+/// @return The version, 0 if the key does not exist.
+unsigned long read_version(HashTable *ht, const char *key);
+
+/// Sets the expiry of a key, replacing the previous one. Writing the key again
+/// with write_pair clears it.
+/// @param ht Hash table.
+/// @param key The key.
+/// @param expires Tick (see timer_wheel_now) at which the key expires.
+/// @return 0 if the expiry was set, 1 if the key does not exist.
+int set_expiry(HashTable *ht, const char *key, unsigned long expires);
+
+/// Deletes every pair whose expiry is due.
+/// @param ht Hash table.
+/// @param now Current tick.
+/// @param expired Set to a malloc'ed array with a malloc'ed copy of each
+/// deleted key, NULL if none. The caller frees both.
+/// @return Number of deleted pairs.
+size_t expire_pairs(HashTable *ht, unsigned long now, char ***expired);
+
+/// Deletes pairs that were not used recently until the table takes at most
+/// max_memory bytes. The candidates are visited with CLOCK along the ordered
+/// index, so a pair that was read or written since the hand last passed it
+/// gets a second chance.
+/// @param ht Hash table.
+/// @param max_memory Memory limit in bytes.
+/// @param evicted Set to a malloc'ed array with a malloc'ed copy of each
+/// deleted key, NULL if none. The caller frees both.
+/// @return Number of deleted pairs.
+size_t evict_pairs(HashTable *ht, size_t max_memory, char ***evicted);
+
 /// Deletes a pair from the table.
 /// @param ht Hash table to read from.
 /// @param key Key of the pair to be deleted.
 /// @return 0 if the node was deleted successfully, 1 otherwise.
 int delete_pair(HashTable *ht, const char *key);
 
+/// Finds the first key, in strcmp order, that is not smaller than a given key.
+/// Iterate from it with node->forward[0].
+/// @param ht Hash table to search.
+/// @param key Lower bound.
+/// @return First node with node->key >= key, NULL if there is none.
+KeyNode *index_seek(HashTable *ht, const char *key);
+
 /// Frees the hashtable.
 /// @param ht Hash table to be deleted.
 void free_table(HashTable *ht);
@@ -0,0 +1,252 @@
+#define LOCK_PROFILE_NO_WRAP
+#include "lock_profile.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "io.h"
+#include "metrics.h"
+
+/// Counters of one call site. Every thread updates them, with relaxed atomics.
+typedef struct LockSite {
+  atomic_int state; // 0 free, 1 being claimed, 2 ready
+  const char *file;
+  int line;
+  const char *name;
+  atomic_ulong acquired;
+  atomic_ulong contended; // Acquisitions that had to wait
+  atomic_ulong wait_ns;
+  atomic_ulong wait_max_ns;
+  atomic_ulong hold_ns;
+  atomic_ulong hold_max_ns;
+} LockSite;
+
+/// A lock the calling thread holds, to time the hold when it is released.
+typedef struct HeldLock {
+  const void *lock;
+  LockSite *site;
+  unsigned long since;
+} HeldLock;
+
+static LockSite sites[LOCK_PROFILE_SITES];
+static pthread_once_t report_once = PTHREAD_ONCE_INIT;
+static _Thread_local HeldLock held[LOCK_PROFILE_DEPTH];
+static _Thread_local int num_held = 0;
+
+static pid_t report_pid; // Backup children exit too, but do not report
+
+static void report_at_exit(void) {
+  if (getpid() == report_pid) {
+    lock_profile_report(STDERR_FILENO);
+  }
+}
+
+static void register_report(void) {
+  report_pid = getpid();
+  atexit(report_at_exit);
+}
+
+/// Finds the counters of a call site, claiming a free slot the first time the
+/// site is seen. Sites are never removed, so lookups take no lock.
+/// @return The site, or NULL if the table is full.
+static LockSite *site_get(const char *name, const char *file, int line) {
+  size_t start =
+      ((size_t)line * 2654435761u + strlen(file)) % LOCK_PROFILE_SITES;
+  for (size_t probe = 0; probe < LOCK_PROFILE_SITES; probe++) {
+    LockSite *site = &sites[(start + probe) % LOCK_PROFILE_SITES];
+    int state = atomic_load_explicit(&site->state, memory_order_acquire);
+    if (state == 0) {
+      int expected = 0;
+      if (atomic_compare_exchange_strong(&site->state, &expected, 1)) {
+        site->file = file;
+        site->line = line;
+        site->name = name;
+        atomic_store_explicit(&site->state, 2, memory_order_release);
+        pthread_once(&report_once, register_report);
+        return site;
+      }
+      state = expected;
+    }
+    while (state == 1) { // Another thread is filling this slot in
+      state = atomic_load_explicit(&site->state, memory_order_acquire);
+    }
+    if (site->line == line && strcmp(site->file, file) == 0) {
+      return site;
+    }
+  }
+  return NULL;
+}
+
+static void counter_max(atomic_ulong *counter, unsigned long value) {
+  unsigned long current = atomic_load_explicit(counter, memory_order_relaxed);
+  while (value > current &&
+         !atomic_compare_exchange_weak_explicit(counter, &current, value,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+  }
+}
+
+/// Counts an acquisition and starts timing its hold.
+/// @param start Time the lock call started, 0 if it did not wait.
+static void acquired(const void *lock, LockSite *site, unsigned long start) {
+  unsigned long now = metrics_now();
+  if (site != NULL) {
+    atomic_fetch_add_explicit(&site->acquired, 1, memory_order_relaxed);
+    if (start != 0) {
+      atomic_fetch_add_explicit(&site->contended, 1, memory_order_relaxed);
+      atomic_fetch_add_explicit(&site->wait_ns, now - start,
+                                memory_order_relaxed);
+      counter_max(&site->wait_max_ns, now - start);
+    }
+  }
+  if (num_held < LOCK_PROFILE_DEPTH) {
+    held[num_held++] = (HeldLock){lock, site, now};
+  }
+}
+
+/// Ends the hold of the most recent acquisition of a lock by this thread.
+/// @return Site of that acquisition, NULL if it was not tracked.
+static LockSite *released(const void *lock) {
+  for (int i = num_held - 1; i >= 0; i--) {
+    if (held[i].lock != lock) {
+      continue;
+    }
+    LockSite *site = held[i].site;
+    if (site != NULL) {
+      unsigned long hold = metrics_now() - held[i].since;
+      atomic_fetch_add_explicit(&site->hold_ns, hold, memory_order_relaxed);
+      counter_max(&site->hold_max_ns, hold);
+    }
+    memmove(&held[i], &held[i + 1],
+            (size_t)(num_held - i - 1) * sizeof(HeldLock));
+    num_held--;
+    return site;
+  }
+  return NULL;
+}
+
+int lock_profile_mutex_lock(pthread_mutex_t *mutex, const char *name,
+                            const char *file, int line) {
+  LockSite *site = site_get(name, file, line);
+  unsigned long start = 0;
+  int result = pthread_mutex_trylock(mutex);
+  if (result == EBUSY) {
+    start = metrics_now();
+    result = pthread_mutex_lock(mutex);
+  }
+  if (result == 0) {
+    acquired(mutex, site, start);
+  }
+  return result;
+}
+
+int lock_profile_mutex_unlock(pthread_mutex_t *mutex) {
+  released(mutex);
+  return pthread_mutex_unlock(mutex);
+}
+
+int lock_profile_rwlock_rdlock(pthread_rwlock_t *rwlock, const char *name,
+                               const char *file, int line) {
+  LockSite *site = site_get(name, file, line);
+  unsigned long start = 0;
+  int result = pthread_rwlock_tryrdlock(rwlock);
+  if (result == EBUSY) {
+    start = metrics_now();
+    result = pthread_rwlock_rdlock(rwlock);
+  }
+  if (result == 0) {
+    acquired(rwlock, site, start);
+  }
+  return result;
+}
+
+int lock_profile_rwlock_wrlock(pthread_rwlock_t *rwlock, const char *name,
+                               const char *file, int line) {
+  LockSite *site = site_get(name, file, line);
+  unsigned long start = 0;
+  int result = pthread_rwlock_trywrlock(rwlock);
+  if (result == EBUSY) {
+    start = metrics_now();
+    result = pthread_rwlock_wrlock(rwlock);
+  }
+  if (result == 0) {
+    acquired(rwlock, site, start);
+  }
+  return result;
+}
+
+int lock_profile_rwlock_unlock(pthread_rwlock_t *rwlock) {
+  released(rwlock);
+  return pthread_rwlock_unlock(rwlock);
+}
+
+// The mutex is not held while waiting on the condition: the hold ends before
+// the wait and a new one, charged to the same site but not counted as an
+// acquisition, starts after it.
+
+int lock_profile_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex) {
+  LockSite *site = released(mutex);
+  int result = pthread_cond_wait(cond, mutex);
+  if (num_held < LOCK_PROFILE_DEPTH) {
+    held[num_held++] = (HeldLock){mutex, site, metrics_now()};
+  }
+  return result;
+}
+
+int lock_profile_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                                const struct timespec *deadline) {
+  LockSite *site = released(mutex);
+  int result = pthread_cond_timedwait(cond, mutex, deadline);
+  if (num_held < LOCK_PROFILE_DEPTH) {
+    held[num_held++] = (HeldLock){mutex, site, metrics_now()};
+  }
+  return result;
+}
+
+static int compare_wait(const void *a, const void *b) {
+  unsigned long x = atomic_load(&(*(LockSite *const *)a)->wait_ns);
+  unsigned long y = atomic_load(&(*(LockSite *const *)b)->wait_ns);
+  return (x < y) - (x > y);
+}
+
+void lock_profile_report(int fd) {
+  LockSite *ranked[LOCK_PROFILE_SITES];
+  size_t count = 0;
+  for (size_t i = 0; i < LOCK_PROFILE_SITES; i++) {
+    if (atomic_load_explicit(&sites[i].state, memory_order_acquire) == 2) {
+      ranked[count++] = &sites[i];
+    }
+  }
+  if (count == 0) {
+    return;
+  }
+  qsort(ranked, count, sizeof(LockSite *), compare_wait);
+
+  char line[512];
+  snprintf(line, sizeof(line),
+           "Lock contention, by total wait:\n"
+           "%-22s %-36s %10s %10s %10s %10s %10s %10s\n",
+           "site", "lock", "acquired", "contended", "wait_ms", "wait_max_us",
+           "hold_ms", "hold_max_us");
+  write_str(fd, line);
+  for (size_t i = 0; i < count; i++) {
+    LockSite *site = ranked[i];
+    const char *base = strrchr(site->file, '/');
+    char where[64];
+    snprintf(where, sizeof(where), "%s:%d",
+             base != NULL ? base + 1 : site->file, site->line);
+    snprintf(line, sizeof(line),
+             "%-22s %-36s %10lu %10lu %10.3f %10.2f %10.3f %10.2f\n", where,
+             site->name, atomic_load(&site->acquired),
+             atomic_load(&site->contended),
+             (double)atomic_load(&site->wait_ns) / 1e6,
+             (double)atomic_load(&site->wait_max_ns) / 1e3,
+             (double)atomic_load(&site->hold_ns) / 1e6,
+             (double)atomic_load(&site->hold_max_ns) / 1e3);
+    write_str(fd, line);
+  }
+}
@@ -0,0 +1,49 @@
+#ifndef KVS_LOCK_PROFILE_H
+#define KVS_LOCK_PROFILE_H
+
+#include <pthread.h>
+#include <time.h>
+
+#define LOCK_PROFILE_SITES 256 // Distinct lock/unlock call sites
+#define LOCK_PROFILE_DEPTH 16  // Locks a thread may hold at once
+
+// Lock contention profiler. Built with LOCK_PROFILE (make LOCK_PROFILE=1),
+// every pthread lock call in a file that includes this header last is routed
+// through the wrappers below, which count acquisitions, contended
+// acquisitions, wait time and hold time per call site. The ranked report is
+// written at exit. Without LOCK_PROFILE the calls are left untouched.
+
+/// Wrapped pthread calls. `name` is the lock expression as written at the
+/// call site, `file` and `line` identify the site.
+int lock_profile_mutex_lock(pthread_mutex_t *mutex, const char *name,
+                            const char *file, int line);
+int lock_profile_mutex_unlock(pthread_mutex_t *mutex);
+int lock_profile_rwlock_rdlock(pthread_rwlock_t *rwlock, const char *name,
+                               const char *file, int line);
+int lock_profile_rwlock_wrlock(pthread_rwlock_t *rwlock, const char *name,
+                               const char *file, int line);
+int lock_profile_rwlock_unlock(pthread_rwlock_t *rwlock);
+int lock_profile_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex);
+int lock_profile_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                                const struct timespec *deadline);
+
+/// Writes the call sites ranked by total wait time, one per line. Writes
+/// nothing if no profiled lock was taken.
+/// @param fd File descriptor to write to.
+void lock_profile_report(int fd);
+
+#if defined(LOCK_PROFILE) && !defined(LOCK_PROFILE_NO_WRAP)
+#define pthread_mutex_lock(m)                                                  \
+  lock_profile_mutex_lock((m), #m, __FILE__, __LINE__)
+#define pthread_mutex_unlock(m) lock_profile_mutex_unlock(m)
+#define pthread_rwlock_rdlock(l)                                               \
+  lock_profile_rwlock_rdlock((l), #l, __FILE__, __LINE__)
+#define pthread_rwlock_wrlock(l)                                               \
+  lock_profile_rwlock_wrlock((l), #l, __FILE__, __LINE__)
+#define pthread_rwlock_unlock(l) lock_profile_rwlock_unlock(l)
+#define pthread_cond_wait(c, m) lock_profile_cond_wait((c), (m))
+#define pthread_cond_timedwait(c, m, t)                                        \
+  lock_profile_cond_timedwait((c), (m), (t))
+#endif
+
+#endif // KVS_LOCK_PROFILE_H
@@ -0,0 +1,280 @@
+#include "lz.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+#define LZ_HASH_SIZE (1 << LZ_HASH_BITS)
+
+#define LZ_TRAIN_SEGMENT 64 // Bytes copied into the dictionary at a time
+#define LZ_TRAIN_STEP 16    // Distance between candidate segments
+#define LZ_TRAIN_GRAM 8     // Bytes of the substrings that are counted
+#define LZ_TRAIN_BITS 16
+
+/// Bytes to compress: the dictionary followed by the input, addressed as one
+/// buffer so that matches can cross from one into the other.
+typedef struct LzWindow {
+  const unsigned char *dict;
+  size_t dict_len;
+  const unsigned char *src;
+  size_t total; // dict_len + input length
+} LzWindow;
+
+static uint32_t read32(const unsigned char *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static size_t lz_hash(uint32_t v) {
+  return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static const unsigned char *window_ptr(const LzWindow *w, size_t pos) {
+  return pos < w->dict_len ? w->dict + pos : w->src + (pos - w->dict_len);
+}
+
+/// Length of the common run of bytes at two positions, ref < cur.
+static size_t match_length(const LzWindow *w, size_t ref, size_t cur) {
+  size_t n = 0;
+  while (cur + n < w->total && *window_ptr(w, ref + n) == *window_ptr(w, cur + n)) {
+    n++;
+  }
+  return n;
+}
+
+/// Writes a length that did not fit in its token nibble.
+static void write_length(unsigned char *dst, size_t *op, size_t len) {
+  for (; len >= 255; len -= 255) {
+    dst[(*op)++] = 255;
+  }
+  dst[(*op)++] = (unsigned char)len;
+}
+
+/// Writes one sequence: literals followed by a match, or only literals when
+/// match_len is 0 (the last sequence).
+/// @return 0 on success, -1 if it does not fit in cap bytes.
+static int write_sequence(unsigned char *dst, size_t cap, size_t *op,
+                          const unsigned char *literals, size_t num_literals,
+                          size_t offset, size_t match_len) {
+  size_t need = 1 + num_literals / 255 + 1 + num_literals;
+  if (match_len > 0) {
+    need += 2 + (match_len - LZ_MIN_MATCH) / 255 + 1;
+  }
+  if (*op + need > cap) {
+    return -1;
+  }
+
+  size_t lit_code = num_literals < 15 ? num_literals : 15;
+  size_t match_code = 0;
+  if (match_len > 0) {
+    match_code = match_len - LZ_MIN_MATCH < 15 ? match_len - LZ_MIN_MATCH : 15;
+  }
+  dst[(*op)++] = (unsigned char)(lit_code << 4 | match_code);
+  if (lit_code == 15) {
+    write_length(dst, op, num_literals - 15);
+  }
+  memcpy(dst + *op, literals, num_literals);
+  *op += num_literals;
+
+  if (match_len > 0) {
+    dst[(*op)++] = (unsigned char)(offset & 0xff);
+    dst[(*op)++] = (unsigned char)(offset >> 8);
+    if (match_code == 15) {
+      write_length(dst, op, match_len - LZ_MIN_MATCH - 15);
+    }
+  }
+  return 0;
+}
+
+size_t lz_compress(const char *src, size_t len, const char *dict,
+                   size_t dict_len, char *dst) {
+  if (dict == NULL) {
+    dict_len = 0;
+  }
+  if (len <= LZ_MIN_MATCH || dict_len + len > LZ_MAX_INPUT) {
+    return 0;
+  }
+
+  LzWindow w = {(const unsigned char *)dict, dict_len,
+                (const unsigned char *)src, dict_len + len};
+  unsigned char *out = (unsigned char *)dst;
+  size_t cap = len - 1; // Only worth keeping if it saves a byte
+
+  int32_t table[LZ_HASH_SIZE];
+  for (size_t i = 0; i < LZ_HASH_SIZE; i++) {
+    table[i] = -1;
+  }
+  for (size_t pos = 0; pos + LZ_MIN_MATCH <= dict_len; pos++) {
+    table[lz_hash(read32(w.dict + pos))] = (int32_t)pos;
+  }
+
+  size_t op = 0;
+  size_t anchor = dict_len; // First byte not yet written
+  size_t cur = dict_len;
+  while (cur + LZ_MIN_MATCH <= w.total) {
+    uint32_t seq = read32(w.src + (cur - dict_len));
+    size_t h = lz_hash(seq);
+    int32_t ref = table[h];
+    table[h] = (int32_t)cur;
+    if (ref < 0 || cur - (size_t)ref > LZ_MAX_OFFSET ||
+        read32(window_ptr(&w, (size_t)ref)) != seq) {
+      cur++;
+      continue;
+    }
+
+    size_t match_len = LZ_MIN_MATCH +
+                       match_length(&w, (size_t)ref + LZ_MIN_MATCH,
+                                    cur + LZ_MIN_MATCH);
+    if (write_sequence(out, cap, &op, w.src + (anchor - dict_len),
+                       cur - anchor, cur - (size_t)ref, match_len) != 0) {
+      return 0;
+    }
+    cur += match_len;
+    anchor = cur;
+    if (cur + LZ_MIN_MATCH <= w.total && cur >= dict_len + 2) {
+      // Keep the table useful for the bytes the match skipped
+      table[lz_hash(read32(w.src + (cur - 2 - dict_len)))] = (int32_t)(cur - 2);
+    }
+  }
+
+  if (anchor < w.total &&
+      write_sequence(out, cap, &op, w.src + (anchor - dict_len),
+                     w.total - anchor, 0, 0) != 0) {
+    return 0;
+  }
+  return op;
+}
+
+/// Reads a length that did not fit in its token nibble.
+/// @return 0 on success, -1 if the input ends first.
+static int read_length(const unsigned char *src, size_t src_len, size_t *ip,
+                       size_t *len) {
+  unsigned char b;
+  do {
+    if (*ip >= src_len) {
+      return -1;
+    }
+    b = src[(*ip)++];
+    *len += b;
+  } while (b == 255);
+  return 0;
+}
+
+int lz_decompress(const char *src, size_t src_len, const char *dict,
+                  size_t dict_len, char *dst, size_t raw_len) {
+  const unsigned char *in = (const unsigned char *)src;
+  if (dict == NULL) {
+    dict_len = 0;
+  }
+
+  size_t ip = 0;
+  size_t op = 0;
+  while (op < raw_len) {
+    if (ip >= src_len) {
+      return -1;
+    }
+    unsigned char token = in[ip++];
+
+    size_t num_literals = token >> 4;
+    if (num_literals == 15 && read_length(in, src_len, &ip, &num_literals)) {
+      return -1;
+    }
+    if (num_literals > src_len - ip || num_literals > raw_len - op) {
+      return -1;
+    }
+    memcpy(dst + op, in + ip, num_literals);
+    ip += num_literals;
+    op += num_literals;
+    if (op == raw_len) {
+      break; // The last sequence has no match
+    }
+
+    if (src_len - ip < 2) {
+      return -1;
+    }
+    size_t offset = (size_t)in[ip] | (size_t)in[ip + 1] << 8;
+    ip += 2;
+    size_t match_len = token & 15;
+    if (match_len == 15 && read_length(in, src_len, &ip, &match_len)) {
+      return -1;
+    }
+    match_len += LZ_MIN_MATCH;
+    if (offset == 0 || offset > op + dict_len || match_len > raw_len - op) {
+      return -1;
+    }
+
+    if (offset <= op && offset >= match_len) {
+      memcpy(dst + op, dst + op - offset, match_len);
+      op += match_len;
+      continue;
+    }
+    // Overlapping match, or one that starts in the dictionary
+    for (size_t i = 0; i < match_len; i++, op++) {
+      dst[op] = offset > op ? dict[dict_len - (offset - op)]
+                            : dst[op - offset];
+    }
+  }
+  return 0;
+}
+
+static size_t gram_hash(const unsigned char *p) {
+  uint32_t h = read32(p) * 2654435761u ^ read32(p + 4) * 2246822519u;
+  return h >> (32 - LZ_TRAIN_BITS);
+}
+
+size_t lz_train(const char *samples, size_t len, char *dict) {
+  if (len < 2 * LZ_TRAIN_SEGMENT) {
+    return 0;
+  }
+  const unsigned char *in = (const unsigned char *)samples;
+  size_t num_grams = len - LZ_TRAIN_GRAM + 1;
+  uint32_t *counts = calloc(1 << LZ_TRAIN_BITS, sizeof(uint32_t));
+  uint16_t *grams = malloc(num_grams * sizeof(uint16_t));
+  if (counts == NULL || grams == NULL) {
+    free(counts);
+    free(grams);
+    return 0;
+  }
+  for (size_t pos = 0; pos < num_grams; pos++) {
+    grams[pos] = (uint16_t)gram_hash(in + pos);
+    counts[grams[pos]]++;
+  }
+
+  // Greedily take the segment whose substrings repeat the most, then forget
+  // those substrings so the next pick covers something else
+  size_t filled = 0;
+  size_t grams_per_segment = LZ_TRAIN_SEGMENT - LZ_TRAIN_GRAM + 1;
+  while (filled + LZ_TRAIN_SEGMENT <= LZ_DICT_SIZE) {
+    size_t best = 0;
+    unsigned long best_score = 0;
+    for (size_t seg = 0; seg + LZ_TRAIN_SEGMENT <= len; seg += LZ_TRAIN_STEP) {
+      unsigned long score = 0;
+      for (size_t g = 0; g < grams_per_segment; g++) {
+        uint32_t count = counts[grams[seg + g]];
+        score += count > 1 ? count : 0;
+      }
+      if (score > best_score) {
+        best = seg;
+        best_score = score;
+      }
+    }
+    if (best_score == 0) {
+      break;
+    }
+
+    filled += LZ_TRAIN_SEGMENT;
+    memcpy(dict + LZ_DICT_SIZE - filled, in + best, LZ_TRAIN_SEGMENT);
+    for (size_t g = 0; g < grams_per_segment; g++) {
+      counts[grams[best + g]] = 0;
+    }
+  }
+
+  memmove(dict, dict + LZ_DICT_SIZE - filled, filled);
+  free(counts);
+  free(grams);
+  return filled;
+}
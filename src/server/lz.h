@@ -0,0 +1,42 @@
+#ifndef KVS_LZ_H
+#define KVS_LZ_H
+
+#include <stddef.h>
+
+#define LZ_DICT_SIZE 4096  // Size of a trained dictionary
+#define LZ_MAX_INPUT 65535 // Dictionary plus input must fit 16 bit offsets
+
+/// Compresses a buffer with an LZ77 codec in the LZ4 block format: sequences
+/// of (token, literals, 16 bit offset, match length), greedy matching with a
+/// hash of 4 byte prefixes. Matches may reach back into the dictionary.
+/// @param src Bytes to compress.
+/// @param len Number of bytes, dict_len + len at most LZ_MAX_INPUT.
+/// @param dict Dictionary the decompression will use too, NULL for none.
+/// @param dict_len Size of the dictionary.
+/// @param dst Buffer of at least len bytes.
+/// @return Compressed size, 0 if the output would not be smaller than len.
+size_t lz_compress(const char *src, size_t len, const char *dict,
+                   size_t dict_len, char *dst);
+
+/// Decompresses a buffer produced by lz_compress.
+/// @param src Compressed bytes.
+/// @param src_len Number of compressed bytes.
+/// @param dict Dictionary used to compress, NULL for none.
+/// @param dict_len Size of the dictionary.
+/// @param dst Buffer of raw_len bytes.
+/// @param raw_len Size of the original buffer.
+/// @return 0 on success, -1 if the input is malformed.
+int lz_decompress(const char *src, size_t src_len, const char *dict,
+                  size_t dict_len, char *dst, size_t raw_len);
+
+/// Builds a dictionary out of the segments that repeat the most across a
+/// sample of values (a simplified form of zstd's COVER training). The most
+/// useful segments are placed at the end, where offsets are the shortest.
+/// @param samples Values to train on, concatenated.
+/// @param len Size of the samples.
+/// @param dict Buffer of LZ_DICT_SIZE bytes.
+/// @return Size of the dictionary, 0 if the samples are too small or on
+/// error.
+size_t lz_train(const char *samples, size_t len, char *dict);
+
+#endif // KVS_LZ_H
@@ -7,36 +7,59 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/inotify.h>
 #include <pthread.h>
-#include <semaphore.h>
 #include <errno.h>
 
 #include "src/common/protocol.h"
 #include "src/common/constants.h"
-#include "src/client/api.h"
+#include "src/common/io.h"
+#include "src/common/shm_ring.h"
 #include "constants.h"
+#include "backup_sched.h"
+#include "conn_queue.h"
 #include "io.h"
+#include "metrics.h"
 #include "operations.h"
+#include "out_writer.h"
 #include "parser.h"
+#include "trace.h"
+#include "lock_profile.h" // Por ultimo: pode envolver as chamadas de lock
 
 // Variável global para indicar se SIGUSR1 foi recebido
 volatile sig_atomic_t sigusr1_received = 0;
 
-typedef struct {
-    char req_pipe_path[MAX_PIPE_PATH_LENGTH];
-    char resp_pipe_path[MAX_PIPE_PATH_LENGTH];
-    char notif_pipe_path[MAX_PIPE_PATH_LENGTH];
-} ConnectionRequest;
 
-ConnectionRequest buffer[MAX_SESSION_COUNT];
+// Pedidos de conexão passados da tarefa anfitriã às tarefas gestoras
+static ConnQueue conn_queue;
 static pthread_t job_thread;
 
+// Ficheiro .job encontrado na leitura inicial da diretoria
+struct JobFile {
+  char in_path[MAX_JOB_FILE_NAME_SIZE];
+  char out_path[MAX_JOB_FILE_NAME_SIZE];
+  char name[MAX_JOB_FILE_NAME_SIZE]; // kvs_backup corta-o no '.'
+};
+
 struct SharedData {
-  DIR *dir;
-  char *dir_name;
-  pthread_mutex_t directory_mutex;
+  struct JobFile *jobs; // Lidos da diretoria antes de as tarefas começarem
+  size_t num_jobs;
+  size_t capacity;
+  size_t next_job;   // Próximo job a executar
+  size_t prefetched; // Jobs já pedidos ao kernel com posix_fadvise
+  int watching;      // Modo -w: chegam mais jobs, as tarefas esperam por eles
+  char (*running)[MAX_JOB_FILE_NAME_SIZE]; // in_path de cada job a correr, ""
+                                           // nas max_threads posições livres
+  pthread_mutex_t directory_mutex; // Protege a lista de jobs e os índices
+  pthread_cond_t prefetch_cond;    // Sinalizada quando next_job avança
+  pthread_cond_t job_cond;         // Sinalizada quando chega um job novo
+  pthread_cond_t done_cond;        // Sinalizada quando um job acaba
 };
 
 struct SessionData {
@@ -46,22 +69,32 @@ struct SessionData {
   int req_fd;
   int resp_fd;
   int notif_fd;
+  ShmSession *shm; // Regiao partilhada, NULL se a sessao usa FIFOs
+  int sock; // 1 se req_fd, resp_fd e notif_fd são a mesma ligação por socket
+  char sock_buf[1 + MAX_REQUEST_PAYLOAD]; // Última mensagem recebida
+  size_t sock_len;
+  size_t sock_pos;
+  pthread_mutex_t notif_lock; // Serializa notificacoes e o fecho da sessao
   int active;
   char subscribed_keys[MAX_NUMBER_SUB][MAX_STRING_SIZE];
   int num_subscribed_keys;
 };
 
 pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t n_current_backups_lock = PTHREAD_MUTEX_INITIALIZER;
 
-size_t active_backups = 0; // Number of active backups
 size_t max_backups;        // Maximum allowed simultaneous backups
 size_t max_threads;        // Maximum allowed simultaneous threads
+int use_socket = 0;        // Registo por socket AF_UNIX em vez de FIFO
+int exit_after_jobs = 0;   // Terminar quando todos os jobs forem executados
 char *jobs_directory = NULL;
+char *register_pipe_path = NULL;
+char *stats_path = NULL;   // Ficheiro das metricas (SIGUSR2), NULL = stderr
+char *trace_path = NULL;   // Ficheiro do trace (-t), NULL = sem trace
+char *image_path = NULL;   // Imagem da tabela (-i), NULL = sem imagem
+size_t prefetch_depth = 8; // Jobs lidos para a cache à frente das tarefas
+int watch_jobs = 0;        // Continuar a executar os .job que forem chegando
 struct SessionData sessions[MAX_SESSION_COUNT];
-sem_t semEmpty;
-sem_t semFull;
-pthread_mutex_t buffer_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t buffer_mutex = PTHREAD_MUTEX_INITIALIZER; // Protege o estado das sessões
 
 int filter_job_files(const struct dirent *entry) {
   const char *dot = strrchr(entry->d_name, '.');
@@ -71,22 +104,21 @@ int filter_job_files(const struct dirent *entry) {
   return 0;
 }
 
-static int entry_files(const char *dir, struct dirent *entry, char *in_path,
+static int entry_files(const char *dir, const char *name, char *in_path,
                        char *out_path) {
-  const char *dot = strrchr(entry->d_name, '.');
-  if (dot == NULL || dot == entry->d_name || strlen(dot) != 4 ||
-      strcmp(dot, ".job")) {
+  const char *dot = strrchr(name, '.');
+  if (dot == NULL || dot == name || strlen(dot) != 4 || strcmp(dot, ".job")) {
     return 1;
   }
 
-  if (strlen(entry->d_name) + strlen(dir) + 2 > MAX_JOB_FILE_NAME_SIZE) {
-    fprintf(stderr, "%s/%s\n", dir, entry->d_name);
+  if (strlen(name) + strlen(dir) + 2 > MAX_JOB_FILE_NAME_SIZE) {
+    fprintf(stderr, "%s/%s\n", dir, name);
     return 1;
   }
 
   strcpy(in_path, dir);
   strcat(in_path, "/");
-  strcat(in_path, entry->d_name);
+  strcat(in_path, name);
 
   strcpy(out_path, in_path);
   strcpy(strrchr(out_path, '.'), ".out");
@@ -99,47 +131,228 @@ void handle_sigusr1(int sig) {
   sigusr1_received = 1; // Indicar que SIGUSR1 foi recebido
 }
 
+// Le um pedido do cliente, pelo FIFO de pedidos ou pelo anel partilhado.
+// @return 1 em caso de sucesso, 0 se o cliente fechou a sessao, -1 em erro.
+static int session_recv(struct SessionData *session, void *buf, size_t size) {
+  if (size == 0) {
+    return 1;
+  }
+  if (session->shm != NULL) {
+    return shm_ring_read(session->shm, &session->shm->req, buf, size);
+  }
+  if (session->sock) {
+    // Num SOCK_SEQPACKET cada pedido chega numa só mensagem, que tem de ser
+    // lida de uma vez; o opcode e o payload são depois servidos deste buffer
+    if (session->sock_pos == session->sock_len) {
+      ssize_t n = recv(session->req_fd, session->sock_buf,
+                       sizeof(session->sock_buf), 0);
+      if (n <= 0) {
+        return n == 0 ? 0 : -1;
+      }
+      session->sock_len = (size_t)n;
+      session->sock_pos = 0;
+    }
+    if (session->sock_len - session->sock_pos < size) {
+      session->sock_pos = session->sock_len;
+      return -1; // Mensagem truncada
+    }
+    memcpy(buf, session->sock_buf + session->sock_pos, size);
+    session->sock_pos += size;
+    return 1;
+  }
+  return read_all(session->req_fd, buf, size, NULL);
+}
+
+// Le um campo (value) de um pedido para um buffer alocado, que o chamador
+// liberta com free.
+// @return 1 em caso de sucesso, 0 se o cliente fechou a sessao, -1 em erro.
+static int session_recv_value(struct SessionData *session, char **value) {
+  uint32_t len;
+  int result = session_recv(session, &len, sizeof(len));
+  if (result <= 0) {
+    return result;
+  }
+  if (len > MAX_VALUE_SIZE || (*value = malloc(len + 1)) == NULL) {
+    return -1;
+  }
+  result = session_recv(session, *value, len);
+  if (result <= 0) {
+    free(*value);
+    return result;
+  }
+  (*value)[len] = '\0';
+  return 1;
+}
+
+// Envia uma resposta ao cliente.
+// @return 1 em caso de sucesso, -1 em erro.
+static int session_reply(struct SessionData *session, const void *buf,
+                         size_t size) {
+  if (session->shm != NULL) {
+    return shm_ring_write(session->shm, &session->shm->resp, buf, size);
+  }
+  if (session->sock) {
+    return send(session->resp_fd, buf, size, MSG_NOSIGNAL) == (ssize_t)size
+               ? 1
+               : -1;
+  }
+  return write_all(session->resp_fd, buf, size);
+}
+
+// Envia uma notificação ao cliente. Várias tarefas de jobs podem notificar a
+// mesma sessão ao mesmo tempo, por isso o envio é feito com notif_lock.
+static void session_notify(struct SessionData *session, const void *buf,
+                           size_t size) {
+  unsigned long start = metrics_now(); // Inclui a espera por notif_lock
+  pthread_mutex_lock(&session->notif_lock);
+  if (session->shm != NULL) {
+    if (shm_ring_write(session->shm, &session->shm->notif, buf, size) == -1) {
+      fprintf(stderr, "Failed to write notification\n");
+    }
+  } else if (session->sock && session->notif_fd != -1) {
+    // Na ligação por socket a notificação leva um opcode para o cliente a
+    // distinguir das respostas; segue numa só mensagem, sem copiar o valor
+    char op_code = OP_CODE_NOTIFY;
+    struct iovec iov[2] = {{&op_code, 1}, {(void *)buf, size}};
+    struct msghdr msg = {0};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    if (sendmsg(session->notif_fd, &msg, MSG_NOSIGNAL) == -1) {
+      perror("Failed to write notification");
+    }
+  } else if (session->notif_fd != -1) {
+    // Um valor longo passa de PIPE_BUF e pode ser escrito em várias partes
+    if (write_all(session->notif_fd, buf, size) == -1) {
+      perror("Failed to write notification");
+    }
+  } else {
+    perror("Failed to open notification pipe");
+  }
+  pthread_mutex_unlock(&session->notif_lock);
+  metrics_record(METRIC_NOTIFY, start);
+}
+
+// Liberta os recursos de transporte de uma sessão.
+static void session_close(struct SessionData *session) {
+  pthread_mutex_lock(&session->notif_lock);
+  if (session->shm != NULL) {
+    shm_session_close(session->shm);
+    shm_session_unmap(session->shm);
+    session->shm = NULL;
+  }
+  if (session->sock && session->notif_fd != -1) {
+    close(session->notif_fd); // Uma só ligação para os três sentidos
+    session->req_fd = -1;
+    session->resp_fd = -1;
+    session->notif_fd = -1;
+  } else if (session->notif_fd != -1) {
+    close(session->req_fd);
+    close(session->resp_fd);
+    close(session->notif_fd);
+    session->req_fd = -1;
+    session->resp_fd = -1;
+    session->notif_fd = -1;
+  }
+  pthread_mutex_unlock(&session->notif_lock);
+}
+
 void notify_clients(const char *key, const char *value) {
+  unsigned long start = trace_now();
+  char message[MAX_NOTIFICATION_SIZE];
+  size_t size = 0; // Mensagem só é preparada quando há um subscritor
   for (int i = 0; i < MAX_SESSION_COUNT; i++) {
     if (sessions[i].active) {
       for (int j = 0; j < sessions[i].num_subscribed_keys; j++) {
         if (strcmp(sessions[i].subscribed_keys[j], key) == 0) {
-          if (sessions[i].notif_fd != -1) {
-            // Preparar mensagem de notificação
-            char message[2 * (MAX_STRING_SIZE+1)];
-            snprintf(message, (MAX_STRING_SIZE+1), "%s", key);
-            snprintf(message + (MAX_STRING_SIZE+1), (MAX_STRING_SIZE+1), "%s", value);
-            // Enviar notificação ao cliente
-            if (write(sessions[i].notif_fd, message, sizeof(message)) == -1) {
-              perror("Failed to write notification");
-            }
-          } else {
-            perror("Failed to open notification pipe");
+          // Preparar mensagem de notificação
+          if (size == 0) {
+            strncpy(message, key, MAX_STRING_SIZE + 1);
+            message[MAX_STRING_SIZE] = '\0';
+            size = MAX_STRING_SIZE + 1 +
+                   encode_value(message + MAX_STRING_SIZE + 1, value);
           }
+          // Enviar notificação ao cliente
+          session_notify(&sessions[i], message, size);
         }
       }
     }
   }
+  if (size > 0) {
+    trace_span("notify", "notify", start, key); // Envio a todos os subscritores
+  }
+}
+
+/// Notifica os subscritores de uma chave cujo TTL expirou.
+static void notify_expired(const char *key) { notify_clients(key, "DELETED"); }
+
+/// Notifica os subscritores de uma chave removida pelo limite de memoria.
+static void notify_evicted(const char *key) { notify_clients(key, "EVICTED"); }
+
+// Nome de um comando nos spans do trace.
+static const char *command_name(enum Command cmd) {
+  switch (cmd) {
+  case CMD_WRITE:
+    return "WRITE";
+  case CMD_READ:
+    return "READ";
+  case CMD_DELETE:
+    return "DELETE";
+  case CMD_CAS:
+    return "CAS";
+  case CMD_VERSION:
+    return "VERSION";
+  case CMD_SHOW:
+    return "SHOW";
+  case CMD_SHOW_SNAPSHOT:
+    return "SHOW SNAPSHOT";
+  case CMD_SCAN:
+    return "SCAN";
+  case CMD_PREFIX:
+    return "PREFIX";
+  case CMD_WAIT:
+    return "WAIT";
+  case CMD_BACKUP:
+    return "BACKUP";
+  case CMD_HELP:
+    return "HELP";
+  case CMD_EMPTY:
+  case CMD_INVALID:
+  case EOC:
+    break;
+  }
+  return NULL;
 }
 
 static int run_job(int in_fd, int out_fd, char *filename) {
   size_t file_backups = 0;
+  const char *traced = NULL; // Comando anterior, fechado no inicio do ciclo
+  unsigned long traced_start = 0;
   while (1) {
     char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
-    char values[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
+    char *values[MAX_WRITE_SIZE]; // Alocados pelo parser
+    unsigned int ttls[MAX_WRITE_SIZE];
     unsigned int delay;
     size_t num_pairs;
 
-    switch (get_next(in_fd)) {
+    // Os casos saem com break ou continue, por isso o span de um comando
+    // termina quando o seguinte comeca a ser lido
+    if (traced != NULL) {
+      trace_span(traced, "command", traced_start, filename);
+    }
+    traced_start = trace_now();
+    enum Command cmd = get_next(in_fd);
+    traced = command_name(cmd);
+
+    switch (cmd) {
     case CMD_WRITE:
       num_pairs =
-          parse_write(in_fd, keys, values, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+          parse_write(in_fd, keys, values, ttls, MAX_WRITE_SIZE, MAX_STRING_SIZE);
       if (num_pairs == 0) {
         write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
         continue;
       }
 
-      if (kvs_write(num_pairs, keys, values)) {
+      if (kvs_write_ttl(num_pairs, keys, values, ttls)) {
         write_str(STDERR_FILENO, "Failed to write pair\n");
       } else {
         // Notificar clientes após a escrita bem-sucedida
@@ -147,6 +360,9 @@ static int run_job(int in_fd, int out_fd, char *filename) {
           notify_clients(keys[i], values[i]);
         }
       }
+      for (size_t i = 0; i < num_pairs; i++) {
+        free(values[i]);
+      }
       break;
 
     case CMD_READ:
@@ -182,8 +398,100 @@ static int run_job(int in_fd, int out_fd, char *filename) {
       }
       break;
 
+    case CMD_CAS: {
+      unsigned long versions[MAX_WRITE_SIZE];
+      unsigned long new_versions[MAX_WRITE_SIZE];
+      int conflicts[MAX_WRITE_SIZE];
+      num_pairs = parse_cas(in_fd, keys, versions, values, MAX_WRITE_SIZE,
+                            MAX_STRING_SIZE);
+      if (num_pairs == 0) {
+        write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
+        continue;
+      }
+
+      int result = kvs_cas(num_pairs, keys, versions, values, new_versions,
+                           conflicts);
+      if (result < 0) {
+        write_str(STDERR_FILENO, "Failed to write pair\n");
+        for (size_t i = 0; i < num_pairs; i++) {
+          free(values[i]);
+        }
+        break;
+      }
+
+      // Commit: novas versoes de todas as chaves; conflito: chaves em conflito
+      write_str(out_fd, "[");
+      for (size_t i = 0; i < num_pairs; i++) {
+        char aux[2 * MAX_STRING_SIZE];
+        if (result == 0) {
+          snprintf(aux, sizeof(aux), "(%s,%lu)", keys[i], new_versions[i]);
+        } else if (conflicts[i]) {
+          snprintf(aux, sizeof(aux), "(%s,KVSCONFLICT)", keys[i]);
+        } else {
+          continue;
+        }
+        write_str(out_fd, aux);
+      }
+      write_str(out_fd, "]\n");
+
+      if (result == 0) {
+        for (size_t i = 0; i < num_pairs; i++) {
+          notify_clients(keys[i], values[i]);
+        }
+      }
+      for (size_t i = 0; i < num_pairs; i++) {
+        free(values[i]);
+      }
+      break;
+    }
+
+    case CMD_VERSION:
+      num_pairs =
+          parse_read_delete(in_fd, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+
+      if (num_pairs == 0) {
+        write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
+        continue;
+      }
+
+      if (kvs_version(num_pairs, keys, out_fd)) {
+        write_str(STDERR_FILENO, "Failed to read versions\n");
+      }
+      break;
+
     case CMD_SHOW:
-      kvs_show(out_fd);
+      kvs_show(out_fd, 0);
+      break;
+
+    case CMD_SHOW_SNAPSHOT:
+      kvs_show(out_fd, 1);
+      break;
+
+    case CMD_SCAN:
+      // Os limites sao lidos como uma lista de exatamente duas chaves
+      num_pairs = parse_read_delete(in_fd, keys, 3, MAX_STRING_SIZE);
+
+      if (num_pairs != 2) {
+        write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
+        continue;
+      }
+
+      if (kvs_scan(keys[0], keys[1], out_fd)) {
+        write_str(STDERR_FILENO, "Failed to scan pairs\n");
+      }
+      break;
+
+    case CMD_PREFIX:
+      num_pairs = parse_read_delete(in_fd, keys, 2, MAX_STRING_SIZE);
+
+      if (num_pairs != 1) {
+        write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
+        continue;
+      }
+
+      if (kvs_prefix(keys[0], out_fd)) {
+        write_str(STDERR_FILENO, "Failed to read prefix\n");
+      }
       break;
 
     case CMD_WAIT:
@@ -198,14 +506,8 @@ static int run_job(int in_fd, int out_fd, char *filename) {
       }
       break;
 
-    case CMD_BACKUP:
-      pthread_mutex_lock(&n_current_backups_lock);
-      if (active_backups >= max_backups) {
-        wait(NULL);
-      } else {
-        active_backups++;
-      }
-      pthread_mutex_unlock(&n_current_backups_lock);
+    case CMD_BACKUP: {
+      // Tira o snapshot e volta logo; a escrita fica na fila do escalonador
       int aux = kvs_backup(++file_backups, filename, jobs_directory);
 
       if (aux < 0) {
@@ -214,6 +516,7 @@ static int run_job(int in_fd, int out_fd, char *filename) {
         return 1;
       }
       break;
+    }
 
     case CMD_INVALID:
       write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
@@ -222,10 +525,14 @@ static int run_job(int in_fd, int out_fd, char *filename) {
     case CMD_HELP:
       write_str(STDOUT_FILENO,
                 "Available commands:\n"
-                "  WRITE [(key,value)(key2,value2),...]\n"
+                "  WRITE [(key,value[,ttl_ms])(key2,value2),...]\n"
                 "  READ [key,key2,...]\n"
                 "  DELETE [key,key2,...]\n"
-                "  SHOW\n"
+                "  CAS [(key,version,value)(key2,version2,value2),...]\n"
+                "  VERSION [key,key2,...]\n"
+                "  SHOW [SNAPSHOT]\n"
+                "  SCAN [start,end]\n"
+                "  PREFIX [prefix]\n"
                 "  WAIT <delay_ms>\n"
                 "  BACKUP\n" // Not implemented
                 "  HELP\n");
@@ -251,63 +558,88 @@ static void handle_session(void *arg) {
     sigaddset(&set, SIGUSR1);
     pthread_sigmask(SIG_BLOCK, &set, NULL);
 
-    // Abrir pipes da sessão
-    session->req_fd = open(session->req_pipe_path, O_RDONLY);
-    session->resp_fd = open(session->resp_pipe_path, O_WRONLY);
-    session->notif_fd = open(session->notif_pipe_path, O_WRONLY);
-
-    if (session->req_fd == -1 || session->resp_fd == -1 || session->notif_fd == -1) {
-        perror("Failed to open session pipes");
-        session->active = 0;
-        return;
+    if (session->shm != NULL) {
+        // Sessão em memória partilhada: os aneis substituem os pipes
+        session->req_fd = -1;
+        session->resp_fd = -1;
+        session->notif_fd = -1;
+    } else if (session->sock) {
+        // Sessão por socket: a ligação já foi aceite pela tarefa anfitriã
+        session->sock_len = 0;
+        session->sock_pos = 0;
+    } else {
+        // Abrir pipes da sessão
+        session->req_fd = open(session->req_pipe_path, O_RDONLY);
+        session->resp_fd = open(session->resp_pipe_path, O_WRONLY);
+        session->notif_fd = open(session->notif_pipe_path, O_WRONLY);
+
+        if (session->req_fd == -1 || session->resp_fd == -1 || session->notif_fd == -1) {
+            perror("Failed to open session pipes");
+            session->active = 0;
+            return;
+        }
     }
 
-    // Enviar resposta de conexão
+    // Enviar resposta de conexão; a de uma sessão em memória partilhada já
+    // seguiu pelo FIFO de conexão
     char response[2];
     response[0] = OP_CODE_CONNECT;
     response[1] = 0; // Sucesso
-    if (write(session->resp_fd, response, sizeof(response)) == -1) {
+    if (session->shm == NULL &&
+        session_reply(session, response, sizeof(response)) == -1) {
         perror("Failed to write connection response");
+        session_close(session);
         session->active = 0;
         return;
     }
 
     session->num_subscribed_keys = 0;
 
-    char local_buffer[MAX_PIPE_PATH_LENGTH+1]; // Renomear para evitar sombreamento
+    // Parte fixa maxima de um pedido (MGET); a maior resposta (MGET com
+    // valores longos) e alocada uma vez por sessao
+    char local_buffer[MAX_FIXED_PAYLOAD]; // Renomear para evitar sombreamento
+    char *reply = malloc(MAX_RESPONSE_SIZE);
+    if (reply == NULL) {
+        fprintf(stderr, "Failed to allocate session buffer\n");
+        session->active = 0;
+    }
     while (session->active) {
-        ssize_t bytes_read = read(session->req_fd, local_buffer, sizeof(local_buffer));
-        if (bytes_read == -1) {
-            perror("Failed to read from request pipe");
-            break;
+        char op_code;
+        // Ler o opcode e depois a parte fixa do payload desse opcode
+        if (session_recv(session, &op_code, 1) <= 0 ||
+            session_recv(session, local_buffer,
+                         request_payload_size(op_code)) <= 0) {
+            break; // Cliente fechou o pipe ou erro de leitura
         }
+        int lost = 0; // Pedido incompleto: a sessao termina sem resposta
 
-        response[0] = local_buffer[0];
-        response[1] = 1;
+        reply[0] = op_code;
+        reply[1] = 1;
+        size_t reply_size = 2;
 
-        switch (local_buffer[0]) {
+        switch (op_code) {
         case OP_CODE_SUBSCRIBE: {
             char key[MAX_STRING_SIZE];
-            strncpy(key, local_buffer + 1, MAX_STRING_SIZE - 1);
+            strncpy(key, local_buffer, MAX_STRING_SIZE - 1);
             key[MAX_STRING_SIZE - 1] = '\0';
 
             if (kvs_key_exists(key)) {
                 if (session->num_subscribed_keys < MAX_NUMBER_SUB) {
                     strncpy(session->subscribed_keys[session->num_subscribed_keys], key, MAX_STRING_SIZE);
                     session->num_subscribed_keys++;
-                    response[1] = 1; // Key exists
+                    reply[1] = 1; // Key exists
                 } else {
                     fprintf(stderr, "Maximum number of subscriptions reached\n");
                 }
             } else {
-                response[1] = 0; // Key does not exist
+                reply[1] = 0; // Key does not exist
             }
 
             break;
         }
         case OP_CODE_UNSUBSCRIBE: {
             char key[MAX_STRING_SIZE];
-            strncpy(key, local_buffer + 1, MAX_STRING_SIZE - 1);
+            strncpy(key, local_buffer, MAX_STRING_SIZE - 1);
             key[MAX_STRING_SIZE - 1] = '\0';
 
             int found = 0;
@@ -317,154 +649,578 @@ static void handle_session(void *arg) {
                         strncpy(session->subscribed_keys[j], session->subscribed_keys[j + 1], MAX_STRING_SIZE);
                     }
                     session->num_subscribed_keys--;
-                    response[1] = 0; // Success
+                    reply[1] = 0; // Success
                     found = 1;
                     break;
                 }
             }
             if (!found) {
-                response[1] = 1;
+                reply[1] = 1;
+            }
+            break;
+        }
+        case OP_CODE_GET: {
+            char keys[1][MAX_STRING_SIZE];
+            char *values[1] = {NULL};
+            strncpy(keys[0], local_buffer, MAX_STRING_SIZE - 1);
+            keys[0][MAX_STRING_SIZE - 1] = '\0';
+
+            kvs_read_values(1, keys, values, NULL);
+            reply[1] = values[0] != NULL ? 0 : 1;
+            reply_size += encode_value(reply + 2, values[0] != NULL ? values[0] : "");
+            free(values[0]);
+            break;
+        }
+        case OP_CODE_PUT: {
+            char keys[1][MAX_STRING_SIZE];
+            char *values[1];
+            strncpy(keys[0], local_buffer, MAX_STRING_SIZE - 1);
+            keys[0][MAX_STRING_SIZE - 1] = '\0';
+            if (session_recv_value(session, &values[0]) <= 0) {
+                lost = 1;
+                break;
+            }
+
+            if (kvs_write(1, keys, values) == 0) {
+                notify_clients(keys[0], values[0]);
+                reply[1] = 0; // Success
+            }
+            free(values[0]);
+            break;
+        }
+        case OP_CODE_DELETE: {
+            char key[MAX_STRING_SIZE];
+            strncpy(key, local_buffer, MAX_STRING_SIZE - 1);
+            key[MAX_STRING_SIZE - 1] = '\0';
+
+            if (kvs_remove(key) == 0) {
+                notify_clients(key, "DELETED");
+                reply[1] = 0; // Key existed and was deleted
+            }
+            break;
+        }
+        case OP_CODE_MGET: {
+            char keys[MAX_MGET_KEYS][MAX_STRING_SIZE];
+            char *values[MAX_MGET_KEYS] = {NULL};
+            size_t num_keys = (unsigned char)local_buffer[0];
+            if (num_keys > MAX_MGET_KEYS) {
+                num_keys = MAX_MGET_KEYS;
+            }
+            for (size_t i = 0; i < num_keys; i++) {
+                strncpy(keys[i], local_buffer + 1 + i * MAX_STRING_SIZE, MAX_STRING_SIZE - 1);
+                keys[i][MAX_STRING_SIZE - 1] = '\0';
+            }
+
+            if (kvs_read_values(num_keys, keys, values, NULL) == 0) {
+                reply[1] = 0;
             }
+            for (size_t i = 0; i < num_keys; i++) {
+                reply[reply_size++] = values[i] != NULL;
+                reply_size += encode_value(reply + reply_size,
+                                           values[i] != NULL ? values[i] : "");
+                free(values[i]);
+            }
+            break;
+        }
+        case OP_CODE_GETV: {
+            char keys[1][MAX_STRING_SIZE];
+            char *values[1] = {NULL};
+            unsigned long version;
+            strncpy(keys[0], local_buffer, MAX_STRING_SIZE - 1);
+            keys[0][MAX_STRING_SIZE - 1] = '\0';
+
+            kvs_read_values(1, keys, values, &version);
+            reply[1] = values[0] != NULL ? 0 : 1;
+            uint64_t wire_version = version;
+            memcpy(reply + 2, &wire_version, sizeof(wire_version));
+            reply_size += sizeof(wire_version);
+            reply_size += encode_value(reply + reply_size,
+                                       values[0] != NULL ? values[0] : "");
+            free(values[0]);
+            break;
+        }
+        case OP_CODE_CAS: {
+            char keys[MAX_MGET_KEYS][MAX_STRING_SIZE];
+            char *values[MAX_MGET_KEYS];
+            unsigned long versions[MAX_MGET_KEYS];
+            unsigned long new_versions[MAX_MGET_KEYS] = {0};
+            int conflicts[MAX_MGET_KEYS];
+            size_t num_pairs = (unsigned char)local_buffer[0];
+            if (num_pairs > MAX_MGET_KEYS) {
+                num_pairs = MAX_MGET_KEYS;
+            }
+            // Cada entrada: chave e versao de tamanho fixo, depois o valor
+            size_t num_read = 0;
+            while (num_read < num_pairs && !lost) {
+                char entry[MAX_STRING_SIZE + sizeof(uint64_t)];
+                uint64_t wire_version;
+                if (session_recv(session, entry, sizeof(entry)) <= 0 ||
+                    session_recv_value(session, &values[num_read]) <= 0) {
+                    lost = 1;
+                    break;
+                }
+                strncpy(keys[num_read], entry, MAX_STRING_SIZE - 1);
+                keys[num_read][MAX_STRING_SIZE - 1] = '\0';
+                memcpy(&wire_version, entry + MAX_STRING_SIZE, sizeof(wire_version));
+                versions[num_read++] = (unsigned long)wire_version;
+            }
+
+            if (!lost && num_pairs > 0 &&
+                kvs_cas(num_pairs, keys, versions, values, new_versions, conflicts) == 0) {
+                for (size_t i = 0; i < num_pairs; i++) {
+                    notify_clients(keys[i], values[i]);
+                }
+                reply[1] = 0; // Commit
+            }
+            for (size_t i = 0; i < num_read; i++) {
+                free(values[i]);
+            }
+            for (size_t i = 0; i < MAX_MGET_KEYS; i++) {
+                uint64_t wire_version = new_versions[i];
+                memcpy(reply + 2 + i * sizeof(wire_version), &wire_version,
+                       sizeof(wire_version));
+            }
+            reply_size += MAX_MGET_KEYS * sizeof(uint64_t);
             break;
         }
         case OP_CODE_DISCONNECT:
             session->active = 0;
             session->num_subscribed_keys = 0; // Remover todas as subscrições
-            response[1] = 0; // Success
+            reply[1] = 0; // Success
             break;
         default:
             fprintf(stderr, "Unknown operation code\n");
             break;
         }
 
-        if (write(session->resp_fd, response, sizeof(response)) == -1) {
+        if (lost) {
+            break;
+        }
+        if (session_reply(session, reply, reply_size) == -1) {
             perror("Failed to write response to response pipe");
             break;
         }
     }
+    free(reply);
 
     // Marcar a sessão como inativa e notificar a thread gestora
     pthread_mutex_lock(&buffer_mutex);
     session->active = 0;
+    session_close(session);
     pthread_mutex_unlock(&buffer_mutex);
-    sem_post(&semEmpty);
 
     return;
 }
 
 
+// Regista o job como a correr. Um .job reescrito enquanto corre volta à
+// lista: a tarefa que o tira espera que a execução anterior acabe, para as
+// duas não escreverem no mesmo .out. Chamada com directory_mutex.
+// @return Posição de running onde o job fica registado.
+static size_t claim_job(struct SharedData *thread_data, const char *in_path) {
+  while (1) {
+    size_t slot = max_threads;
+    int busy = 0;
+    for (size_t i = 0; i < max_threads; i++) {
+      if (thread_data->running[i][0] == '\0') {
+        slot = slot == max_threads ? i : slot;
+      } else if (strcmp(thread_data->running[i], in_path) == 0) {
+        busy = 1;
+      }
+    }
+    // Cada tarefa ocupa no máximo uma posição, por isso há sempre uma livre
+    if (!busy) {
+      strcpy(thread_data->running[slot], in_path);
+      return slot;
+    }
+    pthread_cond_wait(&thread_data->done_cond, &thread_data->directory_mutex);
+  }
+}
+
+static void release_job(struct SharedData *thread_data, size_t slot) {
+  pthread_mutex_lock(&thread_data->directory_mutex);
+  thread_data->running[slot][0] = '\0';
+  pthread_cond_broadcast(&thread_data->done_cond);
+  pthread_mutex_unlock(&thread_data->directory_mutex);
+}
+
 static void *get_file(void *arguments) {
   struct SharedData *thread_data = (struct SharedData *)arguments;
-  DIR *dir = thread_data->dir;
-  char *dir_name = thread_data->dir_name;
-
-  if (pthread_mutex_lock(&thread_data->directory_mutex) != 0) {
-    fprintf(stderr, "Thread failed to lock directory_mutex\n");
-    return NULL;
-  }
 
-  struct dirent *entry;
-  char in_path[MAX_JOB_FILE_NAME_SIZE], out_path[MAX_JOB_FILE_NAME_SIZE];
-  while ((entry = readdir(dir)) != NULL) {
-    if (entry_files(dir_name, entry, in_path, out_path)) {
-      continue;
+  while (1) {
+    if (pthread_mutex_lock(&thread_data->directory_mutex) != 0) {
+      fprintf(stderr, "Thread failed to lock directory_mutex\n");
+      return NULL;
     }
-
+    while (thread_data->next_job == thread_data->num_jobs &&
+           thread_data->watching) {
+      pthread_cond_wait(&thread_data->job_cond, &thread_data->directory_mutex);
+    }
+    if (thread_data->next_job == thread_data->num_jobs) {
+      pthread_mutex_unlock(&thread_data->directory_mutex);
+      break;
+    }
+    // Cópia: a lista pode ser realocada quando chegam jobs novos
+    struct JobFile job = thread_data->jobs[thread_data->next_job++];
+    pthread_cond_signal(&thread_data->prefetch_cond);
+    size_t slot = claim_job(thread_data, job.in_path);
     if (pthread_mutex_unlock(&thread_data->directory_mutex) != 0) {
       fprintf(stderr, "Thread failed to unlock directory_mutex\n");
       return NULL;
     }
 
-    int in_fd = open(in_path, O_RDONLY);
+    int in_fd = open(job.in_path, O_RDONLY);
     if (in_fd == -1) {
       write_str(STDERR_FILENO, "Failed to open input file: ");
-      write_str(STDERR_FILENO, in_path);
+      write_str(STDERR_FILENO, job.in_path);
       write_str(STDERR_FILENO, "\n");
+      release_job(thread_data, slot);
+      if (watch_jobs) {
+        continue; // Um job apagado antes de ser lido não para a tarefa
+      }
       pthread_exit(NULL);
     }
+    // O job é lido do início ao fim: pedir uma janela de readahead maior
+    posix_fadvise(in_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
 
-    int out_fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    int out_fd = open(job.out_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
     if (out_fd == -1) {
       write_str(STDERR_FILENO, "Failed to open output file: ");
-      write_str(STDERR_FILENO, out_path);
+      write_str(STDERR_FILENO, job.out_path);
       write_str(STDERR_FILENO, "\n");
+      close(in_fd);
+      release_job(thread_data, slot);
+      if (watch_jobs) {
+        continue;
+      }
       pthread_exit(NULL);
     }
 
-    int result = run_job(in_fd, out_fd, entry->d_name); // Renomear para evitar sombreamento
+    // kvs_backup corta o nome no '.', por isso o trace guarda uma copia
+    char job_name[TRACE_DETAIL_SIZE];
+    job_name[strn_memcpy(job_name, job.name, sizeof(job_name) - 1)] = '\0';
+    unsigned long job_start = trace_now();
+    OutWriter writer; // Com -o, o output do job é escrito por buffers
+    out_writer_open(&writer, out_fd);
+    int result = run_job(in_fd, out_fd, job.name);
+    out_writer_close(&writer);
+    trace_span("job", "job", job_start, job_name);
 
     close(in_fd);
     close(out_fd);
+    release_job(thread_data, slot);
 
     if (result) {
-      if (closedir(dir) == -1) {
-        fprintf(stderr, "Failed to close directory\n");
-        return 0;
-      }
-
       exit(0);
     }
+  }
 
-    if (pthread_mutex_lock(&thread_data->directory_mutex) != 0) {
-      fprintf(stderr, "Thread failed to lock directory_mutex\n");
-      return NULL;
+  pthread_exit(NULL);
+}
+
+// Pede ao kernel que leia para a cache os próximos prefetch_depth jobs
+// enquanto as tarefas executam os atuais, para que cada tarefa encontre o
+// seu ficheiro já em memória (discos lentos, sistemas de ficheiros de rede).
+static void *prefetch_task(void *arguments) {
+  struct SharedData *thread_data = (struct SharedData *)arguments;
+
+  pthread_mutex_lock(&thread_data->directory_mutex);
+  while (1) {
+    // Jobs que uma tarefa já abriu não precisam de prefetch
+    if (thread_data->prefetched < thread_data->next_job) {
+      thread_data->prefetched = thread_data->next_job;
     }
+    if (thread_data->prefetched == thread_data->num_jobs &&
+        !thread_data->watching) {
+      break;
+    }
+    if (thread_data->prefetched == thread_data->num_jobs ||
+        thread_data->prefetched >= thread_data->next_job + prefetch_depth) {
+      pthread_cond_wait(&thread_data->prefetch_cond,
+                        &thread_data->directory_mutex);
+      continue;
+    }
+    char in_path[MAX_JOB_FILE_NAME_SIZE];
+    strcpy(in_path, thread_data->jobs[thread_data->prefetched++].in_path);
+    pthread_mutex_unlock(&thread_data->directory_mutex);
+
+    int fd = open(in_path, O_RDONLY);
+    if (fd != -1) {
+      posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+      close(fd);
+    }
+
+    pthread_mutex_lock(&thread_data->directory_mutex);
   }
+  pthread_mutex_unlock(&thread_data->directory_mutex);
+  return NULL;
+}
 
-  if (pthread_mutex_unlock(&thread_data->directory_mutex) != 0) {
-    fprintf(stderr, "Thread failed to unlock directory_mutex\n");
-    return NULL;
+// Acrescenta um ficheiro à lista de jobs, se for um .job. Chamada com
+// directory_mutex, ou antes de as tarefas começarem.
+// @return 0 em caso de sucesso ou se o ficheiro não for um job, 1 se faltar
+// memória.
+static int add_job(struct SharedData *thread_data, const char *name) {
+  struct JobFile job;
+  if (entry_files(jobs_directory, name, job.in_path, job.out_path)) {
+    return 0;
+  }
+  if (thread_data->num_jobs == thread_data->capacity) {
+    size_t capacity = thread_data->capacity * 2 + 16;
+    struct JobFile *jobs =
+        realloc(thread_data->jobs, capacity * sizeof(struct JobFile));
+    if (jobs == NULL) {
+      return 1;
+    }
+    thread_data->jobs = jobs;
+    thread_data->capacity = capacity;
   }
+  strcpy(job.name, name);
+  thread_data->jobs[thread_data->num_jobs++] = job;
+  return 0;
+}
 
-  pthread_exit(NULL);
+// Indica se um job está na lista e ainda não começou: quando começar lê o
+// ficheiro como estiver nessa altura. Chamada com directory_mutex.
+static int job_queued(struct SharedData *thread_data, const char *name) {
+  for (size_t i = thread_data->next_job; i < thread_data->num_jobs; i++) {
+    if (strcmp(thread_data->jobs[i].name, name) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Lê a diretoria toda antes de as tarefas começarem, para que o prefetch
+// saiba que ficheiros vêm a seguir.
+// @return 0 em caso de sucesso, 1 se faltar memória.
+static int scan_jobs(DIR *dir, struct SharedData *thread_data) {
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (add_job(thread_data, entry->d_name) != 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Modo -w: acrescenta à lista os .job que são fechados depois de escritos, ou
+// movidos para a diretoria, até a leitura do inotify falhar. Um job que já
+// está à espera na lista não é acrescentado outra vez.
+static void watch_directory(int watch_fd, struct SharedData *thread_data) {
+  // Alinhado como struct inotify_event, que é lida diretamente do buffer
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t len;
+  while ((len = read(watch_fd, buf, sizeof(buf))) > 0 ||
+         (len == -1 && errno == EINTR)) {
+    for (char *ptr = buf; ptr < buf + len;) {
+      const struct inotify_event *event = (const struct inotify_event *)ptr;
+      ptr += sizeof(struct inotify_event) + event->len;
+      if (event->len == 0 || (event->mask & IN_ISDIR)) {
+        continue;
+      }
+      pthread_mutex_lock(&thread_data->directory_mutex);
+      if (!job_queued(thread_data, event->name) &&
+          add_job(thread_data, event->name) != 0) {
+        fprintf(stderr, "Failed to queue job %s\n", event->name);
+      }
+      pthread_cond_signal(&thread_data->job_cond);
+      pthread_cond_signal(&thread_data->prefetch_cond);
+      pthread_mutex_unlock(&thread_data->directory_mutex);
+    }
+  }
+  perror("Failed to watch jobs directory");
 }
 
 static void dispatch_threads(DIR *dir) {
-  pthread_t *threads = malloc(max_threads * sizeof(pthread_t));
+  struct SharedData thread_data = {NULL, 0, 0, 0, 0, watch_jobs, NULL,
+                                   PTHREAD_MUTEX_INITIALIZER,
+                                   PTHREAD_COND_INITIALIZER,
+                                   PTHREAD_COND_INITIALIZER,
+                                   PTHREAD_COND_INITIALIZER};
+
+  // O inotify começa antes da leitura da diretoria, para não perder um job
+  // que chegue entre as duas (um job a ser escrito nesse momento pode voltar
+  // a ser executado, depois da primeira execução)
+  int watch_fd = -1;
+  if (watch_jobs) {
+    watch_fd = inotify_init();
+    if (watch_fd == -1 ||
+        inotify_add_watch(watch_fd, jobs_directory,
+                          IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+      perror("Failed to watch jobs directory");
+      thread_data.watching = 0;
+    }
+  }
 
-  if (threads == NULL) {
+  pthread_t *threads = malloc(max_threads * sizeof(pthread_t));
+  thread_data.running = calloc(max_threads, MAX_JOB_FILE_NAME_SIZE);
+  if (threads == NULL || thread_data.running == NULL ||
+      scan_jobs(dir, &thread_data) != 0) {
     fprintf(stderr, "Failed to allocate memory for threads\n");
+    free(thread_data.jobs);
+    free(thread_data.running);
+    free(threads);
     return;
   }
 
-  struct SharedData thread_data = {dir, jobs_directory,
-                                   PTHREAD_MUTEX_INITIALIZER};
+  pthread_t prefetch_thread;
+  int prefetching = prefetch_depth > 0 &&
+                    (thread_data.num_jobs > 0 || thread_data.watching) &&
+                    pthread_create(&prefetch_thread, NULL, prefetch_task,
+                                   (void *)&thread_data) == 0;
+
+  size_t created = 0;
+  for (; created < max_threads; created++) {
+    if (pthread_create(&threads[created], NULL, get_file,
+                       (void *)&thread_data) != 0) {
+      fprintf(stderr, "Failed to create thread %zu\n", created);
+      break;
+    }
+  }
 
-  for (size_t i = 0; i < max_threads; i++) {
-    if (pthread_create(&threads[i], NULL, get_file, (void *)&thread_data) !=
-        0) {
-      fprintf(stderr, "Failed to create thread %zu\n", i);
-      pthread_mutex_destroy(&thread_data.directory_mutex);
-      free(threads);
-      return;
+  if (thread_data.watching) {
+    if (created > 0) {
+      watch_directory(watch_fd, &thread_data);
     }
+    // Só termina se o inotify falhar: as tarefas acabam os jobs em lista
+    pthread_mutex_lock(&thread_data.directory_mutex);
+    thread_data.watching = 0;
+    pthread_cond_broadcast(&thread_data.job_cond);
+    pthread_cond_signal(&thread_data.prefetch_cond);
+    pthread_mutex_unlock(&thread_data.directory_mutex);
+  }
+  if (watch_fd != -1) {
+    close(watch_fd);
   }
 
-  for (unsigned int i = 0; i < max_threads; i++) {
+  for (size_t i = 0; i < created; i++) {
     if (pthread_join(threads[i], NULL) != 0) {
-      fprintf(stderr, "Failed to join thread %u\n", i);
-      pthread_mutex_destroy(&thread_data.directory_mutex);
-      free(threads);
-      return;
+      fprintf(stderr, "Failed to join thread %zu\n", i);
     }
   }
 
+  if (created == 0) {
+    // Sem tarefas os jobs não avançam: deixar o prefetch terminar
+    pthread_mutex_lock(&thread_data.directory_mutex);
+    thread_data.next_job = thread_data.num_jobs;
+    pthread_cond_signal(&thread_data.prefetch_cond);
+    pthread_mutex_unlock(&thread_data.directory_mutex);
+  }
+  if (prefetching) {
+    pthread_join(prefetch_thread, NULL);
+  }
+
   if (pthread_mutex_destroy(&thread_data.directory_mutex) != 0) {
     fprintf(stderr, "Failed to destroy directory_mutex\n");
   }
+  pthread_cond_destroy(&thread_data.prefetch_cond);
+  pthread_cond_destroy(&thread_data.job_cond);
+  pthread_cond_destroy(&thread_data.done_cond);
 
+  free(thread_data.jobs);
+  free(thread_data.running);
   free(threads);
 }
 
+// Escreve a imagem da tabela (-i) e espera que o processo que a escreve
+// termine, junto com os backups que ainda estejam na fila
+static void save_image(void) {
+    if (kvs_image_save(image_path) != 0) {
+        fprintf(stderr, "Failed to save image: %s\n", image_path);
+    }
+    backup_sched_wait_all();
+}
+
 static void *job_dispatcher(void *arg) {
     DIR *dir = (DIR *)arg;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
     dispatch_threads(dir); // Despachar threads para processar jobs
-    return NULL;
+    if (!exit_after_jobs) {
+        return NULL;
+    }
+
+    // Modo -e: esperar pelos backups e terminar sem esperar por clientes
+    backup_sched_wait_all();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fprintf(stderr, "Jobs done in %.3f s\n",
+            (double)(end.tv_sec - start.tv_sec) +
+                (double)(end.tv_nsec - start.tv_nsec) / 1e9);
+    unlink(register_pipe_path);
+    if (stats_path != NULL && metrics_dump_file(stats_path) != 0) {
+        perror("Failed to write stats file");
+    }
+    if (image_path != NULL) {
+        save_image();
+    }
+    kvs_terminate();
+    exit(0);
+}
+
+// Escreve as metricas sempre que o servidor recebe SIGUSR2. O sinal fica
+// bloqueado em todas as tarefas e e recebido aqui com sigwait, por isso o
+// dump nao corre dentro de um handler.
+static void *metrics_task(void *arg) {
+  (void)arg;
+  sigset_t usr2_set;
+  sigemptyset(&usr2_set);
+  sigaddset(&usr2_set, SIGUSR2);
+  int sig;
+  while (sigwait(&usr2_set, &sig) == 0) {
+    if (stats_path == NULL) {
+      metrics_dump(STDERR_FILENO);
+    } else if (metrics_dump_file(stats_path) != 0) {
+      perror("Failed to write stats file");
+    }
+    if (trace_write() != 0) {
+      perror("Failed to write trace");
+    }
+    lock_profile_report(STDERR_FILENO); // Vazio sem LOCK_PROFILE
+    // A imagem e escrita por um processo filho, o servidor nao para
+    if (image_path != NULL && kvs_image_save(image_path) != 0) {
+      fprintf(stderr, "Failed to save image: %s\n", image_path);
+    }
+  }
+  return NULL;
+}
+
+// Desliga todos os clientes depois de um SIGUSR1. Só a tarefa anfitriã a
+// chama.
+static void disconnect_sessions(void) {
+  if (!sigusr1_received) {
+    return;
+  }
+  pthread_mutex_lock(&buffer_mutex); // Bloquear o mutex para proteger a seção crítica
+  for (int i = 0; i < MAX_SESSION_COUNT; i++) {
+    if (sessions[i].active) {
+      if (sessions[i].shm != NULL) {
+        // Acordar a tarefa da sessão, que liberta a regiao partilhada
+        shm_session_close(sessions[i].shm);
+      } else if (sessions[i].sock) {
+        // Acordar a tarefa da sessão, que fecha a ligação
+        shutdown(sessions[i].req_fd, SHUT_RDWR);
+      } else {
+        // Fechar pipes da sessão ativa
+        pthread_mutex_lock(&sessions[i].notif_lock);
+        close(sessions[i].req_fd);
+        close(sessions[i].resp_fd);
+        close(sessions[i].notif_fd);
+        sessions[i].req_fd = -1;
+        sessions[i].resp_fd = -1;
+        sessions[i].notif_fd = -1;
+        pthread_mutex_unlock(&sessions[i].notif_lock);
+      }
+      sessions[i].active = 0;
+      sessions[i].num_subscribed_keys = 0; // Remover todas as subscrições
+    }
+  }
+  pthread_mutex_unlock(&buffer_mutex); // Desbloquear o mutex
+  sigusr1_received = 0; // Resetar a variável global
 }
 
 void *host_task(void *arg) {
   int register_fd = *(int *)arg;
-  int index;
 
   // Configurar o tratamento de sinal
   struct sigaction sa;
@@ -473,21 +1229,31 @@ void *host_task(void *arg) {
   sa.sa_flags = 0;
   sigaction(SIGUSR1, &sa, NULL);
 
+  // Só esta tarefa recebe SIGUSR1, para que accept/read sejam interrompidos
+  sigset_t usr1_set;
+  sigemptyset(&usr1_set);
+  sigaddset(&usr1_set, SIGUSR1);
+  pthread_sigmask(SIG_UNBLOCK, &usr1_set, NULL);
+
   while (1) {
-    if (sigusr1_received) {
-      pthread_mutex_lock(&buffer_mutex); // Bloquear o mutex para proteger a seção crítica
-      for (int i = 0; i < MAX_SESSION_COUNT; i++) {
-        if (sessions[i].active) {
-          // Fechar pipes da sessão ativa
-          close(sessions[i].req_fd);
-          close(sessions[i].resp_fd);
-          close(sessions[i].notif_fd);
-          sessions[i].active = 0;
-          sessions[i].num_subscribed_keys = 0; // Remover todas as subscrições
+    disconnect_sessions();
+
+    if (use_socket) {
+        // Cada ligação aceite no socket de registo é um pedido de sessão
+        int conn_fd = accept(register_fd, NULL, NULL);
+        if (conn_fd == -1) {
+            if (errno != EINTR) {
+                perror("Failed to accept connection");
+            }
+            continue;
         }
-      }
-      pthread_mutex_unlock(&buffer_mutex); // Desbloquear o mutex
-      sigusr1_received = 0; // Resetar a variável global
+        ConnectionRequest request = {.op_code = OP_CODE_CONNECT, .sock_fd = conn_fd};
+        // Bloqueia se a fila estiver cheia; um SIGUSR1 entretanto é tratado
+        // antes de voltar a tentar
+        while (conn_queue_push(&conn_queue, &request) != 0) {
+            disconnect_sessions();
+        }
+        continue;
     }
 
     // Lógica existente do host_task
@@ -500,64 +1266,254 @@ void *host_task(void *arg) {
             continue;
         }
 
-        if (read_buffer[0] == OP_CODE_CONNECT) {
-            sem_wait(&semEmpty); // Esperar por espaço no buffer
-            pthread_mutex_lock(&buffer_mutex); // Bloquear o mutex para proteger o buffer
-            sem_getvalue(&semFull, &index);
-            strncpy(buffer[index].req_pipe_path, read_buffer + 1, MAX_PIPE_PATH_LENGTH);
-            strncpy(buffer[index].resp_pipe_path, read_buffer + (MAX_PIPE_PATH_LENGTH+1), MAX_PIPE_PATH_LENGTH);
-            strncpy(buffer[index].notif_pipe_path, read_buffer + (2*MAX_PIPE_PATH_LENGTH+1), MAX_PIPE_PATH_LENGTH);
-            pthread_mutex_unlock(&buffer_mutex); // Desbloquear o mutex
-            sem_post(&semFull); // Sinalizar que há um item no buffer
+        if (read_buffer[0] == OP_CODE_CONNECT || read_buffer[0] == OP_CODE_CONNECT_SHM) {
+            ConnectionRequest request;
+            request.op_code = read_buffer[0];
+            request.sock_fd = -1;
+            strncpy(request.req_pipe_path, read_buffer + 1, MAX_PIPE_PATH_LENGTH);
+            strncpy(request.resp_pipe_path, read_buffer + (MAX_PIPE_PATH_LENGTH+1), MAX_PIPE_PATH_LENGTH);
+            strncpy(request.notif_pipe_path, read_buffer + (2*MAX_PIPE_PATH_LENGTH+1), MAX_PIPE_PATH_LENGTH);
+            while (conn_queue_push(&conn_queue, &request) != 0) {
+                disconnect_sessions(); // SIGUSR1 com a fila cheia
+            }
         }
     }
 }
 
+// Envia a resposta a um pedido OP_CODE_CONNECT_SHM pelo FIFO de conexão
+// criado pelo cliente.
+// @param path Caminho do FIFO.
+// @param result 0 se a sessão foi aceite, 1 caso contrário.
+// @return 0 em caso de sucesso, 1 se a resposta não foi entregue.
+static int reply_connect_fifo(const char *path, char result) {
+    int fd = open(path, O_WRONLY);
+    if (fd == -1) {
+        perror("Failed to open connect pipe");
+        return 1;
+    }
+    char response[2] = {OP_CODE_CONNECT, result};
+    int written = write_all(fd, response, sizeof(response));
+    close(fd);
+    if (written != 1) {
+        perror("Failed to write connection response");
+        return 1;
+    }
+    return 0;
+}
+
 void *manager_task(void *arg) {
-    (void)arg; // Ignorar o parâmetro não utilizado
-    int index;
+    // Cada tarefa gestora serve sempre a mesma entrada de sessions, por isso
+    // não há disputa na escolha da sessão livre
+    int session_index = (int)(size_t)arg;
     while (1) {
-        sem_wait(&semFull); // Esperar por um item no buffer
-        pthread_mutex_lock(&buffer_mutex); // Bloquear o mutex para proteger o buffer
-        sem_getvalue(&semFull, &index);
-        ConnectionRequest request = buffer[index];
-        pthread_mutex_unlock(&buffer_mutex); // Desbloquear o mutex
-        sem_post(&semEmpty); // Sinalizar que há espaço no buffer
-
-        // Lidar com o pedido de conexão
-        int session_index = -1;
-        for (int i = 0; i < MAX_SESSION_COUNT; i++) {
-            if (!sessions[i].active) {
-                session_index = i;
-                break;
+        ConnectionRequest request;
+        conn_queue_pop(&conn_queue, &request); // Esperar por um pedido
+
+        // Configurar a sessão com os caminhos dos pipes
+        strncpy(sessions[session_index].req_pipe_path, request.req_pipe_path, MAX_PIPE_PATH_LENGTH);
+        strncpy(sessions[session_index].resp_pipe_path, request.resp_pipe_path, MAX_PIPE_PATH_LENGTH);
+        strncpy(sessions[session_index].notif_pipe_path, request.notif_pipe_path, MAX_PIPE_PATH_LENGTH);
+        sessions[session_index].shm = NULL;
+        sessions[session_index].sock = request.sock_fd != -1;
+        sessions[session_index].req_fd = request.sock_fd;
+        sessions[session_index].resp_fd = request.sock_fd;
+        sessions[session_index].notif_fd = request.sock_fd;
+        if (request.op_code == OP_CODE_CONNECT_SHM) {
+            ShmSession *shm = shm_session_open(request.req_pipe_path);
+            // A resposta de conexão segue pelo FIFO do cliente, também quando
+            // a região não abre, para o cliente não ficar à espera
+            char result = shm == NULL;
+            if (reply_connect_fifo(request.resp_pipe_path, result) != 0 || result) {
+                if (shm != NULL) {
+                    shm_session_unmap(shm);
+                }
+                continue; // Sem sessão: esperar pelo próximo pedido
             }
+            sessions[session_index].shm = shm;
         }
+        sessions[session_index].active = 1;
 
-        if (session_index != -1) {
-            // Configurar a sessão com os caminhos dos pipes
-            strncpy(sessions[session_index].req_pipe_path, request.req_pipe_path, MAX_PIPE_PATH_LENGTH);
-            strncpy(sessions[session_index].resp_pipe_path, request.resp_pipe_path, MAX_PIPE_PATH_LENGTH);
-            strncpy(sessions[session_index].notif_pipe_path, request.notif_pipe_path, MAX_PIPE_PATH_LENGTH);
-            sessions[session_index].active = 1;
-
-            handle_session(&sessions[session_index]); // Iniciar a sessão
-        }
+        handle_session(&sessions[session_index]); // Iniciar a sessão
     }
     return NULL;
 }
 
+// Cria o socket AF_UNIX de registo, que substitui o FIFO de registo.
+// @return Descritor do socket à escuta, -1 em caso de erro.
+static int create_register_socket(const char *path) {
+  struct sockaddr_un addr;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Register socket path too long\n");
+    return -1;
+  }
+
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  if (fd == -1) {
+    perror("Failed to create register socket");
+    return -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(fd, MAX_SESSION_COUNT) == -1) {
+    perror("Failed to bind register socket");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void usage(const char *name) {
+  write_str(STDERR_FILENO, "Usage: ");
+  write_str(STDERR_FILENO, name);
+  write_str(STDERR_FILENO, " [-u] [-c cache_entries] [-m max_memory] [-z threshold] [-d] [-e] [-s stats_file] [-t trace_file] [-p prefetch_depth] [-w] [-o sync|uring] [-b backup_threads] [-r backup_file] [-i image_file] <jobs_dir> <max_threads> <max_backups> <register_pipe_path>\n"
+                           "  -u  register path is a unix socket (SOCK_SEQPACKET)\n"
+                           "  -c  cache the READ output of up to cache_entries hot keys\n"
+                           "  -m  evict cold keys to keep the pairs under max_memory bytes (K, M or G suffix)\n"
+                           "  -z  compress values of at least threshold bytes (K suffix)\n"
+                           "  -d  share one copy of identical values between keys\n"
+                           "  -e  exit once every job file has been run\n"
+                           "  -s  write the latency metrics to stats_file on SIGUSR2 (default stderr)\n"
+                           "  -t  trace jobs, commands, lock waits, backups and notifications to trace_file (Chrome trace JSON, written at exit and on SIGUSR2)\n"
+                           "  -p  read the next prefetch_depth job files ahead of the threads (default 8, 0 disables)\n"
+                           "  -w  keep watching jobs_dir and run each .job file written or moved into it\n"
+                           "  -o  write job output and backups through 64 KiB buffers, with write() (sync) or io_uring (uring)\n"
+                           "  -b  write each backup with backup_threads threads, as that many segment files plus a manifest\n"
+                           "  -r  load a backup written with -b before running the jobs, reading its segments in parallel\n"
+                           "  -i  serve the pairs of image_file at once, merging it into the table in the background; the image is written again at exit and on SIGUSR2\n");
+}
+
+/// Converte um tamanho com sufixo opcional K, M ou G em bytes.
+/// @return 0 se o valor for invalido.
+static size_t parse_size(const char *str) {
+  char *endptr;
+  size_t size = strtoul(str, &endptr, 10);
+  switch (*endptr) {
+  case 'K':
+    size <<= 10;
+    endptr++;
+    break;
+  case 'M':
+    size <<= 20;
+    endptr++;
+    break;
+  case 'G':
+    size <<= 30;
+    endptr++;
+    break;
+  default:
+    break;
+  }
+  return *endptr == '\0' ? size : 0;
+}
+
 int main(int argc, char **argv) {
-  if (argc < 5) {
-    write_str(STDERR_FILENO, "Usage: ");
-    write_str(STDERR_FILENO, argv[0]);
-    write_str(STDERR_FILENO, " <jobs_dir> <max_threads> <max_backups> <register_pipe_path>\n");
+  int opt;
+  size_t cache_entries = 0;
+  size_t max_memory = 0;
+  size_t compress_threshold = 0;
+  int intern_values = 0;
+  OutBackend out_backend = OUT_DIRECT;
+  const char *restore_path = NULL;
+  char *endptr;
+  while ((opt = getopt(argc, argv, "uc:m:z:des:t:p:wo:b:r:i:")) != -1) {
+    switch (opt) {
+    case 'u':
+      use_socket = 1;
+      break;
+    case 'c':
+      cache_entries = strtoul(optarg, &endptr, 10);
+      if (*endptr != '\0' || cache_entries == 0) {
+        fprintf(stderr, "Invalid cache_entries value\n");
+        return 1;
+      }
+      break;
+    case 'm':
+      max_memory = parse_size(optarg);
+      if (max_memory == 0) {
+        fprintf(stderr, "Invalid max_memory value\n");
+        return 1;
+      }
+      break;
+    case 'z':
+      compress_threshold = parse_size(optarg);
+      if (compress_threshold == 0) {
+        fprintf(stderr, "Invalid threshold value\n");
+        return 1;
+      }
+      break;
+    case 'd':
+      intern_values = 1;
+      break;
+    case 'e':
+      exit_after_jobs = 1;
+      break;
+    case 's':
+      stats_path = optarg;
+      break;
+    case 't':
+      trace_path = optarg;
+      break;
+    case 'w':
+      watch_jobs = 1;
+      break;
+    case 'o':
+      if (strcmp(optarg, "sync") == 0) {
+        out_backend = OUT_SYNC;
+      } else if (strcmp(optarg, "uring") == 0) {
+        out_backend = OUT_URING;
+      } else {
+        fprintf(stderr, "Invalid output backend\n");
+        return 1;
+      }
+      break;
+    case 'p':
+      prefetch_depth = strtoul(optarg, &endptr, 10);
+      if (*endptr != '\0') {
+        fprintf(stderr, "Invalid prefetch_depth value\n");
+        return 1;
+      }
+      break;
+    case 'b':
+      if (kvs_backup_init(strtoul(optarg, &endptr, 10)) != 0 ||
+          *endptr != '\0') {
+        fprintf(stderr, "Invalid backup_threads value\n");
+        return 1;
+      }
+      break;
+    case 'r':
+      restore_path = optarg;
+      break;
+    case 'i':
+      image_path = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (watch_jobs && exit_after_jobs) {
+    fprintf(stderr, "-w and -e cannot be used together\n");
+    return 1;
+  }
+
+  if (restore_path != NULL && image_path != NULL) {
+    fprintf(stderr, "-r and -i cannot be used together\n");
     return 1;
   }
 
+  if (argc - optind < 4) {
+    usage(argv[0]);
+    return 1;
+  }
+  argv += optind - 1; // Argumentos posicionais ficam em argv[1..4]
+
   jobs_directory = argv[1];
-  char *register_pipe_path = argv[4];
+  register_pipe_path = argv[4];
 
-  char *endptr;
   max_backups = strtoul(argv[3], &endptr, 10);
   if (*endptr != '\0') {
     fprintf(stderr, "Invalid max_proc value\n");
@@ -580,14 +1536,59 @@ int main(int argc, char **argv) {
     return 0;
   }
 
+  // Um cliente que desapareça não deve terminar o servidor com SIGPIPE
+  signal(SIGPIPE, SIG_IGN);
+
   if (kvs_init()) {
     write_str(STDERR_FILENO, "Failed to initialize KVS\n");
     return 1;
   }
 
+  kvs_expiry_init(notify_expired);
+
+  if (max_memory > 0 && kvs_memory_init(max_memory, notify_evicted)) {
+    write_str(STDERR_FILENO, "Failed to set memory limit\n");
+    return 1;
+  }
+
+  if (compress_threshold > 0 && kvs_compression_init(compress_threshold)) {
+    write_str(STDERR_FILENO, "Failed to enable compression\n");
+    return 1;
+  }
+
+  if (intern_values && kvs_interning_init()) {
+    write_str(STDERR_FILENO, "Failed to enable interning\n");
+    return 1;
+  }
+
+  out_writer_init(out_backend);
+
+  if (trace_path != NULL && trace_init(trace_path)) {
+    write_str(STDERR_FILENO, "Failed to start tracing\n");
+    return 1;
+  }
+
+  if (cache_entries > 0 && kvs_cache_init(cache_entries)) {
+    write_str(STDERR_FILENO, "Failed to initialize read cache\n");
+    return 1;
+  }
+
+  // O backup e carregado antes de qualquer job ou cliente, com ate
+  // max_threads tarefas a ler segmentos
+  if (restore_path != NULL) {
+    size_t pairs = 0;
+    unsigned long start = metrics_now();
+    if (kvs_restore(restore_path, max_threads, &pairs) != 0) {
+      fprintf(stderr, "Failed to restore backup: %s\n", restore_path);
+      return 1;
+    }
+    printf("Restored %zu pairs from %s in %.3f s\n", pairs, restore_path,
+           (double)(metrics_now() - start) / 1e9);
+  }
+
   unlink(register_pipe_path); // Remover pipe de registo existente
 
-  if (mkfifo(register_pipe_path, 0666) == -1) {
+  if (!use_socket && mkfifo(register_pipe_path, 0666) == -1) {
     perror("Failed to create register pipe");
     return 1;
   }
@@ -598,23 +1599,63 @@ int main(int argc, char **argv) {
     return 0;
   }
 
+  // SIGUSR1 fica bloqueado em todas as tarefas exceto a anfitriã, e SIGUSR2
+  // em todas (e recebido pela tarefa das metricas com sigwait)
+  sigset_t usr1_set;
+  sigemptyset(&usr1_set);
+  sigaddset(&usr1_set, SIGUSR1);
+  sigaddset(&usr1_set, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &usr1_set, NULL);
+
+  // No maximo max_backups processos de backup a escrever ao mesmo tempo, e
+  // outros tantos a espera; com mais, BACKUP espera antes do fork
+  if (backup_sched_init(max_backups, max_backups) != 0) {
+    perror("Failed to start backup scheduler");
+    return 1;
+  }
+
+  // A imagem so e mapeada (o cabecalho e validado e mais nada), por isso os
+  // READs sao servidos logo; a fusao na tabela corre numa tarefa a parte,
+  // criada aqui para ja ter os sinais bloqueados. Sem imagem, comeca vazio.
+  if (image_path != NULL && access(image_path, F_OK) == 0) {
+    size_t pairs = 0;
+    unsigned long start = metrics_now();
+    if (kvs_image_open(image_path, &pairs) != 0) {
+      fprintf(stderr, "Failed to open image: %s\n", image_path);
+      return 1;
+    }
+    printf("Mapped image %s with %zu pairs in %.3f ms\n", image_path, pairs,
+           (double)(metrics_now() - start) / 1e6);
+  }
+
+  pthread_t metrics_thread;
+  if (pthread_create(&metrics_thread, NULL, metrics_task, NULL) != 0) {
+    perror("Failed to create metrics thread");
+    return 1;
+  }
+
   // Criar thread para despachar jobs
   if (pthread_create(&job_thread, NULL, job_dispatcher, (void *)dir) != 0) {
     perror("Failed to create job dispatcher thread");
     return 1;
   }
 
-  sem_init(&semEmpty, 0, MAX_SESSION_COUNT);
-  sem_init(&semFull, 0, 0);
+  if (conn_queue_init(&conn_queue) != 0) {
+    perror("Failed to initialize connection queue");
+    return 1;
+  }
 
   for (int i = 0; i < MAX_SESSION_COUNT; i++) {
     sessions[i].active = 0;
+    sessions[i].shm = NULL;
+    pthread_mutex_init(&sessions[i].notif_lock, NULL);
   }
 
   pthread_t host_thread;
   pthread_t manager_threads[MAX_SESSION_COUNT];
 
-  int register_fd = open(register_pipe_path, O_RDONLY);
+  int register_fd = use_socket ? create_register_socket(register_pipe_path)
+                               : open(register_pipe_path, O_RDONLY);
   if (register_fd == -1) {
     perror("Failed to open register pipe");
     return 1;
@@ -628,7 +1669,7 @@ int main(int argc, char **argv) {
 
   // Criar threads para gerir sessões
   for (int i = 0; i < MAX_SESSION_COUNT; i++) {
-    if (pthread_create(&manager_threads[i], NULL, manager_task, NULL) != 0) {
+    if (pthread_create(&manager_threads[i], NULL, manager_task, (void *)(size_t)i) != 0) {
       perror("Failed to create manager thread");
       return 1;
     }
@@ -648,14 +1689,13 @@ int main(int argc, char **argv) {
   unlink(register_pipe_path); // Remover pipe de registo
 
   // Esperar que todos os backups terminem
-  while (active_backups > 0) {
-    wait(NULL);
-    active_backups--;
+  backup_sched_wait_all();
+  if (image_path != NULL) {
+    save_image();
   }
 
   kvs_terminate();
   pthread_join(job_thread, NULL);
-  sem_destroy(&semEmpty);
-  sem_destroy(&semFull);
+  conn_queue_destroy(&conn_queue);
   return 0;
 }
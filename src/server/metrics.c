@@ -0,0 +1,237 @@
+#include "metrics.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "io.h"
+
+/// Histograms of one thread. Slots are never freed: when a thread exits its
+/// slot is marked free and handed to the next thread that records, so the
+/// counts stay cumulative and the list stays as long as the peak number of
+/// threads.
+typedef struct MetricSlot {
+  MetricHistogram hist[METRIC_OPS];
+  atomic_ulong counters[METRIC_COUNTERS];
+  struct MetricSlot *next;
+  int in_use;
+} MetricSlot;
+
+static const char *metric_names[METRIC_OPS] = {
+    "write", "read", "delete", "show", "backup", "lock_wait", "notify"};
+
+static const char *counter_names[METRIC_COUNTERS] = {
+    "cache_hits", "cache_misses", "cache_evictions"};
+
+static MetricSlot *slots = NULL;
+static pthread_mutex_t slots_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t slot_key;
+static pthread_once_t slot_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local MetricSlot *thread_slot = NULL;
+
+static void slot_release(void *arg) {
+  MetricSlot *slot = arg;
+  pthread_mutex_lock(&slots_lock);
+  slot->in_use = 0;
+  pthread_mutex_unlock(&slots_lock);
+}
+
+static void slot_key_create(void) {
+  pthread_key_create(&slot_key, slot_release);
+}
+
+/// Gets the calling thread's slot, taking a free one or allocating one on its
+/// first call.
+/// @return The slot, or NULL if out of memory.
+static MetricSlot *slot_acquire(void) {
+  if (thread_slot != NULL) {
+    return thread_slot;
+  }
+  pthread_once(&slot_key_once, slot_key_create);
+
+  pthread_mutex_lock(&slots_lock);
+  MetricSlot *slot = slots;
+  while (slot != NULL && slot->in_use) {
+    slot = slot->next;
+  }
+  if (slot == NULL) {
+    slot = calloc(1, sizeof(MetricSlot));
+    if (slot == NULL) {
+      pthread_mutex_unlock(&slots_lock);
+      return NULL;
+    }
+    slot->next = slots;
+    slots = slot;
+  }
+  slot->in_use = 1;
+  pthread_mutex_unlock(&slots_lock);
+
+  pthread_setspecific(slot_key, slot);
+  thread_slot = slot;
+  return slot;
+}
+
+/// Bucket of a value: exact below METRICS_SUB_BUCKETS, then the top
+/// METRICS_SUB_BITS bits after the leading one select the sub-bucket.
+static size_t bucket_index(unsigned long value) {
+  if (value < METRICS_SUB_BUCKETS) {
+    return value;
+  }
+  int exp = 63 - __builtin_clzl(value);
+  if (exp >= METRICS_MAX_BITS) {
+    return METRICS_BUCKETS - 1;
+  }
+  size_t sub = (value >> (exp - METRICS_SUB_BITS)) & (METRICS_SUB_BUCKETS - 1);
+  return (size_t)(exp - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS + sub;
+}
+
+/// Smallest value counted in a bucket.
+static unsigned long bucket_value(size_t index) {
+  if (index < METRICS_SUB_BUCKETS) {
+    return index;
+  }
+  size_t exp = index / METRICS_SUB_BUCKETS + METRICS_SUB_BITS - 1;
+  unsigned long sub = index % METRICS_SUB_BUCKETS;
+  return (METRICS_SUB_BUCKETS + sub) << (exp - METRICS_SUB_BITS);
+}
+
+unsigned long metrics_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long)ts.tv_sec * 1000000000UL + (unsigned long)ts.tv_nsec;
+}
+
+/// Adds to a counter that only the calling thread writes.
+static void counter_add(atomic_ulong *counter, unsigned long value) {
+  atomic_store_explicit(
+      counter, atomic_load_explicit(counter, memory_order_relaxed) + value,
+      memory_order_relaxed);
+}
+
+void metrics_record(MetricOp op, unsigned long start_ns) {
+  MetricSlot *slot = slot_acquire();
+  if (slot == NULL) {
+    return;
+  }
+  unsigned long elapsed = metrics_now() - start_ns;
+  MetricHistogram *hist = &slot->hist[op];
+  counter_add(&hist->buckets[bucket_index(elapsed)], 1);
+  counter_add(&hist->count, 1);
+  counter_add(&hist->total_ns, elapsed);
+  if (elapsed > atomic_load_explicit(&hist->max_ns, memory_order_relaxed)) {
+    atomic_store_explicit(&hist->max_ns, elapsed, memory_order_relaxed);
+  }
+}
+
+void metrics_count(MetricCounter counter) {
+  MetricSlot *slot = slot_acquire();
+  if (slot != NULL) {
+    counter_add(&slot->counters[counter], 1);
+  }
+}
+
+unsigned long metrics_counter(MetricCounter counter) {
+  unsigned long total = 0;
+  pthread_mutex_lock(&slots_lock);
+  for (MetricSlot *slot = slots; slot != NULL; slot = slot->next) {
+    total += atomic_load_explicit(&slot->counters[counter],
+                                  memory_order_relaxed);
+  }
+  pthread_mutex_unlock(&slots_lock);
+  return total;
+}
+
+/// Sums one operation over every slot.
+static void histogram_merge(MetricOp op, unsigned long *buckets,
+                            unsigned long *count, unsigned long *total_ns,
+                            unsigned long *max_ns) {
+  *count = 0;
+  *total_ns = 0;
+  *max_ns = 0;
+  for (size_t i = 0; i < METRICS_BUCKETS; i++) {
+    buckets[i] = 0;
+  }
+  pthread_mutex_lock(&slots_lock);
+  for (MetricSlot *slot = slots; slot != NULL; slot = slot->next) {
+    MetricHistogram *hist = &slot->hist[op];
+    for (size_t i = 0; i < METRICS_BUCKETS; i++) {
+      buckets[i] +=
+          atomic_load_explicit(&hist->buckets[i], memory_order_relaxed);
+    }
+    *count += atomic_load_explicit(&hist->count, memory_order_relaxed);
+    *total_ns += atomic_load_explicit(&hist->total_ns, memory_order_relaxed);
+    unsigned long max =
+        atomic_load_explicit(&hist->max_ns, memory_order_relaxed);
+    if (max > *max_ns) {
+      *max_ns = max;
+    }
+  }
+  pthread_mutex_unlock(&slots_lock);
+}
+
+/// Value at a percentile (in thousandths), as the lower bound of its bucket.
+static unsigned long percentile(const unsigned long *buckets,
+                                unsigned long count, unsigned long per_mille) {
+  unsigned long rank = (count * per_mille + 999) / 1000;
+  unsigned long seen = 0;
+  for (size_t i = 0; i < METRICS_BUCKETS; i++) {
+    seen += buckets[i];
+    if (seen >= rank && seen > 0) {
+      return bucket_value(i);
+    }
+  }
+  return 0;
+}
+
+void metrics_dump(int fd) {
+  static const unsigned long per_mille[] = {500, 900, 990, 999};
+  unsigned long buckets[METRICS_BUCKETS];
+  char line[256];
+
+  snprintf(line, sizeof(line), "%-10s %12s %10s %10s %10s %10s %10s %10s\n",
+           "op", "count", "mean_us", "p50_us", "p90_us", "p99_us", "p99.9_us",
+           "max_us");
+  write_str(fd, line);
+  for (int op = 0; op < METRIC_OPS; op++) {
+    unsigned long count, total_ns, max_ns;
+    histogram_merge((MetricOp)op, buckets, &count, &total_ns, &max_ns);
+    double values[4];
+    for (size_t p = 0; p < 4; p++) {
+      values[p] = (double)percentile(buckets, count, per_mille[p]) / 1000.0;
+    }
+    double mean = count == 0 ? 0 : (double)total_ns / (double)count / 1000.0;
+    snprintf(line, sizeof(line),
+             "%-10s %12lu %10.2f %10.2f %10.2f %10.2f %10.2f %10.2f\n",
+             metric_names[op], count, mean, values[0], values[1], values[2],
+             values[3], (double)max_ns / 1000.0);
+    write_str(fd, line);
+  }
+  snprintf(line, sizeof(line), "%-16s %12s\n", "counter", "count");
+  write_str(fd, line);
+  for (int counter = 0; counter < METRIC_COUNTERS; counter++) {
+    snprintf(line, sizeof(line), "%-16s %12lu\n", counter_names[counter],
+             metrics_counter((MetricCounter)counter));
+    write_str(fd, line);
+  }
+}
+
+int metrics_dump_file(const char *path) {
+  char tmp_path[4096];
+  if ((size_t)snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >=
+      sizeof(tmp_path)) {
+    return 1;
+  }
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    return 1;
+  }
+  metrics_dump(fd);
+  if (close(fd) == -1 || rename(tmp_path, path) == -1) {
+    unlink(tmp_path);
+    return 1;
+  }
+  return 0;
+}
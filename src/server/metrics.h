@@ -0,0 +1,75 @@
+#ifndef KVS_METRICS_H
+#define KVS_METRICS_H
+
+#include <stdatomic.h>
+
+#define METRICS_SUB_BITS 4 // 16 buckets per power of two, about 6% precision
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BITS)
+#define METRICS_MAX_BITS 40 // Latencies up to 2^40 ns (about 18 minutes)
+#define METRICS_BUCKETS                                                        \
+  ((METRICS_MAX_BITS - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS)
+
+/// Instrumented operations.
+typedef enum MetricOp {
+  METRIC_WRITE,
+  METRIC_READ,
+  METRIC_DELETE,
+  METRIC_SHOW,
+  METRIC_BACKUP,
+  METRIC_LOCK_WAIT, // Time spent waiting for the table lock
+  METRIC_NOTIFY,    // Sending one notification to one session
+  METRIC_OPS
+} MetricOp;
+
+/// Counted events, dumped next to the histograms.
+typedef enum MetricCounter {
+  METRIC_CACHE_HIT,      // READ keys served from the read cache
+  METRIC_CACHE_MISS,     // READ keys looked up in the read cache and missed
+  METRIC_CACHE_EVICTION, // Read cache entries evicted to make room
+  METRIC_COUNTERS
+} MetricCounter;
+
+/// Log-linear (HDR style) latency histogram: exact below
+/// METRICS_SUB_BUCKETS ns, then METRICS_SUB_BUCKETS buckets per power of two.
+/// Only the thread that owns it writes to it, so the updates are plain
+/// relaxed stores; readers may see a sample counted in one field and not yet
+/// in another.
+typedef struct MetricHistogram {
+  atomic_ulong count;
+  atomic_ulong total_ns;
+  atomic_ulong max_ns;
+  atomic_ulong buckets[METRICS_BUCKETS];
+} MetricHistogram;
+
+/// Gets the monotonic clock, to pass as the start of a metrics_record.
+/// @return Nanoseconds since an arbitrary point.
+unsigned long metrics_now(void);
+
+/// Counts one operation in the calling thread's histograms. The first call
+/// of a thread registers its histograms; they are kept, and reused by a later
+/// thread, when it exits.
+/// @param op Operation.
+/// @param start_ns Value of metrics_now when the operation started.
+void metrics_record(MetricOp op, unsigned long start_ns);
+
+/// Counts one event in the calling thread's counters.
+/// @param counter Event.
+void metrics_count(MetricCounter counter);
+
+/// Sums a counter over all the threads.
+/// @param counter Event.
+/// @return Number of events counted so far.
+unsigned long metrics_counter(MetricCounter counter);
+
+/// Writes the count, mean and percentiles of every operation, summed over all
+/// the threads, one operation per line, followed by the counters.
+/// @param fd File descriptor to write to.
+void metrics_dump(int fd);
+
+/// Writes metrics_dump to a file, replacing it atomically (written to a
+/// temporary file that is then renamed).
+/// @param path File path.
+/// @return 0 on success, 1 otherwise.
+int metrics_dump_file(const char *path);
+
+#endif // KVS_METRICS_H
@@ -1,6 +1,7 @@
 #include "operations.h"
 
 #include <fcntl.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,9 +11,425 @@
 
 #include "constants.h"
 #include "io.h"
+#include "backup.h"
+#include "backup_sched.h"
+#include "image.h"
 #include "kvs.h"
+#include "metrics.h"
+#include "out_writer.h"
+#include "trace.h"
+#include "lock_profile.h" // Last: may wrap the pthread lock calls
 
 static struct HashTable *kvs_table = NULL;
+static size_t backup_threads = 1; // Above 1, backups are segmented
+
+/// Takes the table read lock, counting the wait in the lock metrics. A macro
+/// so that the lock profiler attributes the wait to the caller's line.
+#define table_rdlock()                                                         \
+  do {                                                                         \
+    unsigned long lock_start = metrics_now();                                  \
+    pthread_rwlock_rdlock(&kvs_table->tablelock);                              \
+    metrics_record(METRIC_LOCK_WAIT, lock_start);                              \
+    trace_wait("tablelock read wait", lock_start);                             \
+  } while (0)
+
+/// Takes the table write lock, counting the wait in the lock metrics.
+#define table_wrlock()                                                         \
+  do {                                                                         \
+    unsigned long lock_start = metrics_now();                                  \
+    pthread_rwlock_wrlock(&kvs_table->tablelock);                              \
+    metrics_record(METRIC_LOCK_WAIT, lock_start);                              \
+    trace_wait("tablelock write wait", lock_start);                            \
+  } while (0)
+
+/// Room for a "(key,value)" fragment whose value is no longer than a key.
+#define FRAGMENT_SIZE (2 * MAX_STRING_SIZE + 4)
+
+/// Maximum number of independently locked parts of the read cache.
+#define CACHE_SHARDS 64
+
+/// Entry of the hot-key read cache: the "(key,value)" fragment kvs_read writes
+/// for a key, so a hit costs neither a table lookup nor a strdup/snprintf.
+typedef struct CacheEntry {
+  char key[MAX_STRING_SIZE];
+  char fragment[FRAGMENT_SIZE];
+  KeyNode *node; // Node of the key, NULL if it was missing
+  long next; // Next entry in the same bucket, -1 ends the chain
+  int used;
+  int referenced; // CLOCK reference bit
+} CacheEntry;
+
+/// Part of the read cache with its own lock, bucket heads and CLOCK hand, so
+/// readers of keys in different shards never contend.
+typedef struct CacheShard {
+  CacheEntry *entries; // Slice of the cache's entries
+  long *buckets;       // Slice of the cache's bucket heads, indexes entries
+  size_t capacity;
+  size_t hand;
+  pthread_mutex_t lock;
+} CacheShard;
+
+/// Optional read cache, bounded to a fixed number of entries and evicted with
+/// CLOCK within each shard. Fills happen under the table read lock and
+/// invalidations under the write lock, so a cached fragment is never older
+/// than the table. Hits, misses and evictions are counted in the metrics.
+static struct {
+  CacheEntry *entries; // NULL while the cache is disabled
+  long *buckets;
+  CacheShard *shards;
+  size_t shard_count;
+} read_cache = {NULL, NULL, NULL, 0};
+
+/// Thread that deletes keys as their TTL runs out. It is only started by the
+/// first write with a TTL, so a store without TTLs pays nothing for it.
+static struct {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t stop_cond;
+  int started;
+  int stop;
+  void (*on_expire)(const char *key);
+} expiry = {0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, NULL};
+
+/// Optional memory limit of the table, enforced after every write by
+/// evicting cold pairs.
+static struct {
+  size_t max_memory; // 0 while there is no limit
+  unsigned long evictions;
+  void (*on_evict)(const char *key);
+} memory_limit = {0, 0, NULL};
+
+/// Finds the shard and the bucket of a key, with an FNV-1a hash.
+/// @param key Key to look up.
+/// @param bucket Set to the bucket of the key within the shard.
+/// @return The shard of the key.
+static CacheShard *cache_shard(const char *key, size_t *bucket) {
+  size_t h = 2166136261u;
+  for (; *key != '\0'; key++) {
+    h = (h ^ (unsigned char)*key) * 16777619u;
+  }
+  CacheShard *shard = &read_cache.shards[h % read_cache.shard_count];
+  *bucket = h / read_cache.shard_count % shard->capacity;
+  return shard;
+}
+
+/// Looks a key up in the read cache.
+/// @param key Key to look up.
+/// @param fragment Buffer of FRAGMENT_SIZE where a hit is copied.
+/// @return 1 on a hit, 0 otherwise.
+static int cache_lookup(const char *key, char *fragment) {
+  int hit = 0;
+  size_t bucket;
+  CacheShard *shard = cache_shard(key, &bucket);
+  pthread_mutex_lock(&shard->lock);
+  for (long i = shard->buckets[bucket]; i != -1; i = shard->entries[i].next) {
+    CacheEntry *entry = &shard->entries[i];
+    if (strcmp(entry->key, key) == 0) {
+      entry->referenced = 1;
+      memcpy(fragment, entry->fragment, FRAGMENT_SIZE);
+      if (entry->node != NULL) {
+        // A hit must keep the pair away from eviction like a table read
+        atomic_store_explicit(&entry->node->referenced, 1,
+                              memory_order_relaxed);
+      }
+      hit = 1;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&shard->lock);
+  metrics_count(hit ? METRIC_CACHE_HIT : METRIC_CACHE_MISS);
+  return hit;
+}
+
+/// Removes entry `slot` of a shard from its bucket chain. Called with the
+/// shard's lock.
+static void cache_unlink(CacheShard *shard, size_t slot) {
+  CacheEntry *entry = &shard->entries[slot];
+  size_t bucket;
+  cache_shard(entry->key, &bucket);
+  long *link = &shard->buckets[bucket];
+  while (*link != -1 && *link != (long)slot) {
+    link = &shard->entries[*link].next;
+  }
+  if (*link == (long)slot) {
+    *link = entry->next;
+  }
+  entry->used = 0;
+}
+
+/// Stores the fragment of a key, evicting with CLOCK when its shard is full.
+static void cache_insert(const char *key, const char *fragment,
+                         KeyNode *node) {
+  size_t bucket;
+  CacheShard *shard = cache_shard(key, &bucket);
+  pthread_mutex_lock(&shard->lock);
+  for (long i = shard->buckets[bucket]; i != -1; i = shard->entries[i].next) {
+    if (strcmp(shard->entries[i].key, key) == 0) {
+      // Another reader filled it first
+      pthread_mutex_unlock(&shard->lock);
+      return;
+    }
+  }
+
+  // The hand gives every referenced entry a second chance before evicting it
+  CacheEntry *victim;
+  int evicted = 0;
+  while (1) {
+    victim = &shard->entries[shard->hand];
+    if (!victim->used) {
+      break;
+    }
+    if (!victim->referenced) {
+      cache_unlink(shard, shard->hand);
+      evicted = 1;
+      break;
+    }
+    victim->referenced = 0;
+    shard->hand = (shard->hand + 1) % shard->capacity;
+  }
+  size_t slot = shard->hand;
+  shard->hand = (shard->hand + 1) % shard->capacity;
+
+  snprintf(victim->key, MAX_STRING_SIZE, "%s", key);
+  memcpy(victim->fragment, fragment, FRAGMENT_SIZE);
+  victim->node = node;
+  victim->used = 1;
+  victim->referenced = 0;
+  victim->next = shard->buckets[bucket];
+  shard->buckets[bucket] = (long)slot;
+  pthread_mutex_unlock(&shard->lock);
+  if (evicted) {
+    metrics_count(METRIC_CACHE_EVICTION);
+  }
+}
+
+/// Drops a key from the read cache. Called with the table write lock.
+static void cache_invalidate(const char *key) {
+  if (read_cache.entries == NULL) {
+    return;
+  }
+  size_t bucket;
+  CacheShard *shard = cache_shard(key, &bucket);
+  pthread_mutex_lock(&shard->lock);
+  for (long i = shard->buckets[bucket]; i != -1; i = shard->entries[i].next) {
+    if (strcmp(shard->entries[i].key, key) == 0) {
+      cache_unlink(shard, (size_t)i);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&shard->lock);
+}
+
+/// Body of the expiry thread: every tick, advances the table's timing wheel
+/// under the write lock and reports the expired keys after releasing it.
+static void *expiry_task(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&expiry.lock);
+  while (!expiry.stop) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += TIMER_TICK_MS * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&expiry.stop_cond, &expiry.lock, &deadline);
+    if (expiry.stop) {
+      break;
+    }
+    pthread_mutex_unlock(&expiry.lock);
+
+    char **keys;
+    table_wrlock();
+    size_t count = expire_pairs(kvs_table, timer_wheel_now(), &keys);
+    for (size_t i = 0; i < count; i++) {
+      cache_invalidate(keys[i]);
+    }
+    pthread_rwlock_unlock(&kvs_table->tablelock);
+
+    for (size_t i = 0; i < count; i++) {
+      if (expiry.on_expire != NULL) {
+        expiry.on_expire(keys[i]);
+      }
+      free(keys[i]);
+    }
+    free(keys);
+    pthread_mutex_lock(&expiry.lock);
+  }
+  pthread_mutex_unlock(&expiry.lock);
+  return NULL;
+}
+
+/// Starts the expiry thread if it is not running yet.
+/// @return 0 if the thread is running, 1 otherwise.
+static int expiry_start(void) {
+  int result = 0;
+  pthread_mutex_lock(&expiry.lock);
+  if (!expiry.started) {
+    if (pthread_create(&expiry.thread, NULL, expiry_task, NULL) == 0) {
+      expiry.started = 1;
+    } else {
+      fprintf(stderr, "Failed to create expiry thread\n");
+      result = 1;
+    }
+  }
+  pthread_mutex_unlock(&expiry.lock);
+  return result;
+}
+
+/// Evicts pairs until the table fits in the memory limit. Called with the
+/// table write lock.
+/// @param evicted Set to the evicted keys, to be passed to report_evictions
+/// once the lock is released.
+/// @return Number of evicted keys.
+static size_t enforce_memory_limit(char ***evicted) {
+  *evicted = NULL;
+  if (memory_limit.max_memory == 0) {
+    return 0;
+  }
+  size_t count = evict_pairs(kvs_table, memory_limit.max_memory, evicted);
+  for (size_t i = 0; i < count; i++) {
+    cache_invalidate((*evicted)[i]);
+  }
+  memory_limit.evictions += count;
+  return count;
+}
+
+/// Reports evicted keys to the eviction callback and frees them. Called
+/// without the table lock.
+static void report_evictions(char **evicted, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    if (memory_limit.on_evict != NULL) {
+      memory_limit.on_evict(evicted[i]);
+    }
+    free(evicted[i]);
+  }
+  free(evicted);
+}
+
+/// Table image being served while its pairs are merged into the table. The
+/// table is the overlay: a key written or deleted since startup is marked as
+/// replaced in the image, so neither reads nor the merge use the old pair.
+/// The marks and the merge are done under the table write lock, and the image
+/// is read under the read lock.
+static struct {
+  TableImage image;
+  unsigned char *replaced; // One byte per pair
+  size_t merged;           // Pairs the merge has gone through
+  atomic_int active;       // Image mapped and not merged yet
+  int started;             // Merge thread running or finished
+  int stop;                // Set by kvs_terminate
+  int done;                // Merge thread finished
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t merged_cond;
+} image = {.lock = PTHREAD_MUTEX_INITIALIZER,
+           .merged_cond = PTHREAD_COND_INITIALIZER};
+
+/// Finds the image pair of a key that is not in the table yet. Called with
+/// the table lock.
+/// @return Index of the pair, -1 if the image does not have it any more.
+static long image_lookup(const char *key) {
+  if (!atomic_load_explicit(&image.active, memory_order_acquire)) {
+    return -1;
+  }
+  long index = image_find(&image.image, key);
+  return index >= 0 && !image.replaced[index] ? index : -1;
+}
+
+/// Gets the value a key has in the image. Called with the table lock.
+/// @return The value, in the mapping, or NULL.
+static const char *image_value(const char *key) {
+  long index = image_lookup(key);
+  const char *image_key;
+  const char *value;
+  if (index < 0 ||
+      image_pair(&image.image, (size_t)index, &image_key, &value) != 0) {
+    return NULL;
+  }
+  return value;
+}
+
+/// Marks the image pair of a key as replaced by a write or a delete. Called
+/// with the table write lock.
+/// @return 1 if the image still had the key, 0 otherwise.
+static int image_replace(const char *key) {
+  long index = image_lookup(key);
+  if (index < 0) {
+    return 0;
+  }
+  image.replaced[index] = 1;
+  return 1;
+}
+
+/// Body of the merge thread: moves the image pairs that were not replaced
+/// into the table, a batch per write lock hold, then drops the image.
+static void *image_merge_task(void *arg) {
+  (void)arg;
+  unsigned long start = metrics_now();
+  unsigned long trace_start = trace_now();
+  size_t pairs = 0;
+  int stop = 0;
+  while (!stop && image.merged < image.image.pairs) {
+    table_wrlock();
+    size_t end = image.merged + IMAGE_MERGE_BATCH;
+    for (; image.merged < end && image.merged < image.image.pairs;
+         image.merged++) {
+      const char *key;
+      const char *value;
+      if (image.replaced[image.merged] ||
+          image_pair(&image.image, image.merged, &key, &value) != 0) {
+        continue;
+      }
+      image.replaced[image.merged] = 1;
+      cache_invalidate(key);
+      if (write_pair(kvs_table, key, value) != 0) {
+        fprintf(stderr, "Failed to merge key %s\n", key);
+      }
+      pairs++;
+    }
+    char **evicted;
+    size_t num_evicted = enforce_memory_limit(&evicted);
+    pthread_rwlock_unlock(&kvs_table->tablelock);
+    report_evictions(evicted, num_evicted);
+
+    pthread_mutex_lock(&image.lock);
+    stop = image.stop;
+    pthread_mutex_unlock(&image.lock);
+  }
+
+  // Readers only look at the image under the table lock
+  table_wrlock();
+  atomic_store_explicit(&image.active, 0, memory_order_release);
+  pthread_rwlock_unlock(&kvs_table->tablelock);
+  free(image.replaced);
+  image_close(&image.image);
+  if (!stop) {
+    fprintf(stderr, "Image merged: %zu pairs in %.3f s\n", pairs,
+            (double)(metrics_now() - start) / 1e9);
+  }
+  trace_span("image merge", "image", trace_start, NULL);
+
+  pthread_mutex_lock(&image.lock);
+  image.done = 1;
+  pthread_cond_broadcast(&image.merged_cond);
+  pthread_mutex_unlock(&image.lock);
+  return NULL;
+}
+
+/// Waits for the image to be merged. Operations that go over every pair, or
+/// that need to tell whether a key exists, call this first, without the
+/// table lock.
+static void image_settle(void) {
+  if (!atomic_load_explicit(&image.active, memory_order_acquire)) {
+    return;
+  }
+  pthread_mutex_lock(&image.lock);
+  while (!image.done) {
+    pthread_cond_wait(&image.merged_cond, &image.lock);
+  }
+  pthread_mutex_unlock(&image.lock);
+}
 
 /// Calculates a timespec from a delay in milliseconds.
 /// @param delay_ms Delay in milliseconds.
@@ -21,6 +438,25 @@ static struct timespec delay_to_timespec(unsigned int delay_ms) {
   return (struct timespec){delay_ms / 1000, (delay_ms % 1000) * 1000000};
 }
 
+/// Writes the "(key,value)" fragment of a pair. A fragment that fits in aux is
+/// formatted there and written at once; a longer value is written in pieces.
+/// @param aux Buffer of FRAGMENT_SIZE.
+/// @return 1 if the whole fragment was left in aux, 0 otherwise.
+static int write_fragment(int fd, const char *key, const char *value,
+                          char *aux) {
+  int n = snprintf(aux, FRAGMENT_SIZE, "(%s,%s)", key, value);
+  if (n >= 0 && n < FRAGMENT_SIZE) {
+    write_str(fd, aux);
+    return 1;
+  }
+  write_str(fd, "(");
+  write_str(fd, key);
+  write_str(fd, ",");
+  write_str(fd, value);
+  write_str(fd, ")");
+  return 0;
+}
+
 int kvs_init() {
   if (kvs_table != NULL) {
     fprintf(stderr, "KVS state has already been initialized\n");
@@ -31,33 +467,264 @@ int kvs_init() {
   return kvs_table == NULL;
 }
 
+int kvs_cache_init(size_t capacity) {
+  if (read_cache.entries != NULL || capacity == 0) {
+    return 1;
+  }
+  size_t shard_count = capacity < CACHE_SHARDS ? capacity : CACHE_SHARDS;
+  read_cache.entries = calloc(capacity, sizeof(CacheEntry));
+  read_cache.buckets = malloc(capacity * sizeof(long));
+  read_cache.shards = calloc(shard_count, sizeof(CacheShard));
+  if (read_cache.entries == NULL || read_cache.buckets == NULL ||
+      read_cache.shards == NULL) {
+    free(read_cache.entries);
+    free(read_cache.buckets);
+    free(read_cache.shards);
+    read_cache.entries = NULL;
+    read_cache.buckets = NULL;
+    read_cache.shards = NULL;
+    return 1;
+  }
+  for (size_t i = 0; i < capacity; i++) {
+    read_cache.buckets[i] = -1;
+  }
+  // Every shard gets an equal slice, the first ones one entry more
+  size_t first = 0;
+  for (size_t i = 0; i < shard_count; i++) {
+    CacheShard *shard = &read_cache.shards[i];
+    shard->capacity = capacity / shard_count + (i < capacity % shard_count);
+    shard->entries = read_cache.entries + first;
+    shard->buckets = read_cache.buckets + first;
+    shard->hand = 0;
+    pthread_mutex_init(&shard->lock, NULL);
+    first += shard->capacity;
+  }
+  read_cache.shard_count = shard_count;
+  return 0;
+}
+
+void kvs_cache_stats(unsigned long *hits, unsigned long *misses,
+                     unsigned long *evictions) {
+  *hits = metrics_counter(METRIC_CACHE_HIT);
+  *misses = metrics_counter(METRIC_CACHE_MISS);
+  *evictions = metrics_counter(METRIC_CACHE_EVICTION);
+}
+
 int kvs_terminate() {
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
 
+  pthread_mutex_lock(&expiry.lock);
+  int started = expiry.started;
+  expiry.stop = 1;
+  pthread_cond_signal(&expiry.stop_cond);
+  pthread_mutex_unlock(&expiry.lock);
+  if (started) {
+    pthread_join(expiry.thread, NULL);
+  }
+
+  if (image.started) {
+    pthread_mutex_lock(&image.lock);
+    image.stop = 1;
+    pthread_mutex_unlock(&image.lock);
+    pthread_join(image.thread, NULL);
+  }
+
+  if (memory_limit.max_memory > 0) {
+    fprintf(stderr, "Memory limit: %zu of %zu bytes used, %lu keys evicted\n",
+            kvs_table->memory_used, memory_limit.max_memory,
+            memory_limit.evictions);
+  }
+
+  const ValueCompression *compression = &kvs_table->compression;
+  if (compression->threshold > 0) {
+    fprintf(stderr,
+            "Compression: %zu values, %zu bytes stored in %zu, %zu byte "
+            "dictionary\n",
+            compression->packed_values, compression->raw_bytes,
+            compression->packed_bytes, compression->dict_size);
+  }
+
+  ValuePool *pool = &kvs_table->pool;
+  if (pool->buckets != NULL) {
+    size_t refs = atomic_load(&pool->refs);
+    size_t shared_bytes = atomic_load(&pool->shared_bytes);
+    fprintf(stderr,
+            "Interning: %zu values held by %zu keys, %zu bytes stored for "
+            "%zu (%.1fx)\n",
+            pool->entries, refs, pool->bytes, shared_bytes,
+            pool->bytes > 0 ? (double)shared_bytes / (double)pool->bytes : 1.0);
+  }
+
+  if (read_cache.entries != NULL) {
+    unsigned long hits, misses, evictions;
+    kvs_cache_stats(&hits, &misses, &evictions);
+    fprintf(stderr, "Read cache: %lu hits, %lu misses, %lu evictions\n", hits,
+            misses, evictions);
+    for (size_t i = 0; i < read_cache.shard_count; i++) {
+      pthread_mutex_destroy(&read_cache.shards[i].lock);
+    }
+    free(read_cache.entries);
+    free(read_cache.buckets);
+    free(read_cache.shards);
+    read_cache.entries = NULL;
+    read_cache.buckets = NULL;
+    read_cache.shards = NULL;
+    read_cache.shard_count = 0;
+  }
+
   free_table(kvs_table);
   kvs_table = NULL;
   return 0;
 }
 
+int kvs_memory_init(size_t max_memory, void (*on_evict)(const char *key)) {
+  if (kvs_table == NULL || max_memory == 0) {
+    return 1;
+  }
+  memory_limit.max_memory = max_memory;
+  memory_limit.on_evict = on_evict;
+  return 0;
+}
+
+int kvs_compression_init(size_t threshold) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+  table_wrlock();
+  enable_compression(kvs_table, threshold);
+  pthread_rwlock_unlock(&kvs_table->tablelock);
+  return 0;
+}
+
+int kvs_interning_init(void) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+  table_wrlock();
+  int result = enable_interning(kvs_table);
+  pthread_rwlock_unlock(&kvs_table->tablelock);
+  return result;
+}
+
+void kvs_expiry_init(void (*on_expire)(const char *key)) {
+  expiry.on_expire = on_expire;
+}
+
+int kvs_backup_init(size_t threads) {
+  if (threads == 0 || threads > BACKUP_MAX_SEGMENTS) {
+    return 1;
+  }
+  backup_threads = threads;
+  return 0;
+}
+
+int kvs_restore(const char *manifest, size_t threads, size_t *pairs) {
+  if (kvs_table == NULL) {
+    return 1;
+  }
+  return backup_restore(manifest, threads, kvs_write, pairs);
+}
+
+int kvs_image_open(const char *path, size_t *pairs) {
+  if (kvs_table == NULL || image.started) {
+    return 1;
+  }
+  if (image_open(&image.image, path) != 0) {
+    return 1;
+  }
+  // A large calloc is fresh zeroed pages, only touched when a mark is set
+  image.replaced = calloc(image.image.pairs + 1, 1);
+  if (image.replaced == NULL) {
+    image_close(&image.image);
+    return 1;
+  }
+  atomic_store_explicit(&image.active, 1, memory_order_release);
+  if (pthread_create(&image.thread, NULL, image_merge_task, NULL) != 0) {
+    atomic_store(&image.active, 0);
+    free(image.replaced);
+    image_close(&image.image);
+    return 1;
+  }
+  image.started = 1;
+  *pairs = image.image.pairs;
+  return 0;
+}
+
+int kvs_image_save(const char *path) {
+  if (kvs_table == NULL) {
+    return 1;
+  }
+  image_settle();
+
+  // Written by a forked child, like a backup, and admitted by the same
+  // scheduler, which also reaps it
+  BackupTicket ticket;
+  if (backup_sched_prepare(&ticket) != 0) {
+    return 1;
+  }
+  int trace_slot = trace_child_reserve();
+  table_rdlock();
+  pid_t pid = fork();
+  pthread_rwlock_unlock(&kvs_table->tablelock);
+  if (pid != 0) {
+    backup_sched_submit(&ticket, pid);
+  }
+  if (pid == 0) {
+    backup_sched_admit(&ticket);
+    unsigned long child_start = trace_now();
+    int failed = image_write(kvs_table, path) != 0;
+    if (failed) {
+      fprintf(stderr, "Failed to write image %s\n", path);
+    }
+    trace_child_span(trace_slot, "image child", child_start, path);
+    _exit(failed); // Like a backup child, see kvs_backup
+  }
+  return pid < 0;
+}
+
 int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE],
-              char values[][MAX_STRING_SIZE]) {
+              char *values[]) {
+  return kvs_write_ttl(num_pairs, keys, values, NULL);
+}
+
+int kvs_write_ttl(size_t num_pairs, char keys[][MAX_STRING_SIZE],
+                  char *values[], const unsigned int *ttls_ms) {
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
 
-  pthread_rwlock_wrlock(&kvs_table->tablelock);
+  if (ttls_ms != NULL) {
+    for (size_t i = 0; i < num_pairs; i++) {
+      if (ttls_ms[i] > 0 && expiry_start() != 0) {
+        return 1;
+      }
+    }
+  }
+
+  unsigned long start = metrics_now();
+  table_wrlock();
 
   for (size_t i = 0; i < num_pairs; i++) {
+    cache_invalidate(keys[i]);
+    image_replace(keys[i]);
     if (write_pair(kvs_table, keys[i], values[i]) != 0) {
       fprintf(stderr, "Failed to write key pair (%s,%s)\n", keys[i], values[i]);
+    } else if (ttls_ms != NULL && ttls_ms[i] > 0) {
+      set_expiry(kvs_table, keys[i], timer_wheel_deadline(ttls_ms[i]));
     }
   }
 
+  char **evicted;
+  size_t num_evicted = enforce_memory_limit(&evicted);
   pthread_rwlock_unlock(&kvs_table->tablelock);
+  report_evictions(evicted, num_evicted);
+  metrics_record(METRIC_WRITE, start);
   return 0;
 }
 
@@ -67,23 +734,33 @@ int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
     return 1;
   }
 
-  pthread_rwlock_rdlock(&kvs_table->tablelock);
+  unsigned long start = metrics_now();
+  table_rdlock();
 
+  char value[MAX_VALUE_SIZE + 1]; // Compressed values are decompressed here
   write_str(fd, "[");
   for (size_t i = 0; i < num_pairs; i++) {
-    char *result = read_pair(kvs_table, keys[i]);
-    char aux[MAX_STRING_SIZE];
-    if (result == NULL) {
-      snprintf(aux, MAX_STRING_SIZE, "(%s,KVSERROR)", keys[i]);
-    } else {
-      snprintf(aux, MAX_STRING_SIZE, "(%s,%s)", keys[i], result);
+    char aux[FRAGMENT_SIZE];
+    if (read_cache.entries != NULL && cache_lookup(keys[i], aux)) {
+      write_str(fd, aux);
+      continue;
+    }
+
+    KeyNode *node = lookup_pair(kvs_table, keys[i]);
+    const char *stored =
+        node != NULL ? pair_value(kvs_table, node, value) : image_value(keys[i]);
+    int fits = write_fragment(fd, keys[i], stored != NULL ? stored : "KVSERROR",
+                              aux);
+    // Fragments of long values are not worth a cache entry, and pairs still
+    // in the image have no node to check the entry against
+    if (fits && read_cache.entries != NULL && (node != NULL || stored == NULL)) {
+      cache_insert(keys[i], aux, node);
     }
-    write_str(fd, aux);
-    free(result);
   }
   write_str(fd, "]\n");
 
   pthread_rwlock_unlock(&kvs_table->tablelock);
+  metrics_record(METRIC_READ, start);
   return 0;
 }
 
@@ -93,11 +770,17 @@ int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
     return 1;
   }
 
-  pthread_rwlock_wrlock(&kvs_table->tablelock);
+  unsigned long start = metrics_now();
+  table_wrlock();
 
   int aux = 0;
   for (size_t i = 0; i < num_pairs; i++) {
-    if (delete_pair(kvs_table, keys[i]) != 0) {
+    cache_invalidate(keys[i]);
+    int missing = delete_pair(kvs_table, keys[i]) != 0;
+    if (image_replace(keys[i])) {
+      missing = 0;
+    }
+    if (missing) {
       if (!aux) {
         write_str(fd, "[");
         aux = 1;
@@ -112,65 +795,337 @@ int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
   }
 
   pthread_rwlock_unlock(&kvs_table->tablelock);
+  metrics_record(METRIC_DELETE, start);
   return 0;
 }
 
-void kvs_show(int fd) {
+int kvs_read_values(size_t num_pairs, char keys[][MAX_STRING_SIZE],
+                    char *values[], unsigned long *versions) {
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
-    return;
+    return 1;
   }
 
-  pthread_rwlock_rdlock(&kvs_table->tablelock);
-  char aux[MAX_STRING_SIZE];
+  if (versions != NULL) {
+    image_settle(); // Keys still in the image have no version yet
+  }
 
-  for (int i = 0; i < TABLE_SIZE; i++) {
-    KeyNode *keyNode = kvs_table->table[i]; // Get the next list head
-    while (keyNode != NULL) {
-      snprintf(aux, MAX_STRING_SIZE, "(%s, %s)\n", keyNode->key,
-               keyNode->value);
-      write_str(fd, aux);
-      keyNode = keyNode->next; // Move to the next node of the list
+  unsigned long start = metrics_now();
+  table_rdlock();
+
+  for (size_t i = 0; i < num_pairs; i++) {
+    values[i] = read_pair(kvs_table, keys[i]);
+    const char *stored = values[i] == NULL ? image_value(keys[i]) : NULL;
+    if (stored != NULL) {
+      values[i] = strdup(stored);
+    }
+    if (versions != NULL) {
+      versions[i] = read_version(kvs_table, keys[i]);
+    }
+  }
+
+  pthread_rwlock_unlock(&kvs_table->tablelock);
+  metrics_record(METRIC_READ, start);
+  return 0;
+}
+
+int kvs_cas(size_t num_pairs, char keys[][MAX_STRING_SIZE],
+            const unsigned long *versions, char *values[],
+            unsigned long *new_versions, int *conflicts) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return -1;
+  }
+
+  image_settle();
+  table_wrlock();
+
+  // Validate every read version before writing anything
+  int conflict = 0;
+  for (size_t i = 0; i < num_pairs; i++) {
+    conflicts[i] = read_version(kvs_table, keys[i]) != versions[i];
+    conflict |= conflicts[i];
+  }
+
+  if (!conflict) {
+    for (size_t i = 0; i < num_pairs; i++) {
+      cache_invalidate(keys[i]);
+      if (write_pair(kvs_table, keys[i], values[i]) != 0) {
+        fprintf(stderr, "Failed to write key pair (%s,%s)\n", keys[i],
+                values[i]);
+      }
+      new_versions[i] = read_version(kvs_table, keys[i]);
+    }
+  }
+
+  char **evicted;
+  size_t num_evicted = enforce_memory_limit(&evicted);
+  pthread_rwlock_unlock(&kvs_table->tablelock);
+  report_evictions(evicted, num_evicted);
+  return conflict;
+}
+
+int kvs_version(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+
+  image_settle();
+  table_rdlock();
+
+  write_str(fd, "[");
+  for (size_t i = 0; i < num_pairs; i++) {
+    char aux[2 * MAX_STRING_SIZE];
+    snprintf(aux, sizeof(aux), "(%s,%lu)", keys[i],
+             read_version(kvs_table, keys[i]));
+    write_str(fd, aux);
+  }
+  write_str(fd, "]\n");
+
+  pthread_rwlock_unlock(&kvs_table->tablelock);
+  return 0;
+}
+
+int kvs_remove(const char *key) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+
+  table_wrlock();
+  cache_invalidate(key);
+  int result = delete_pair(kvs_table, key);
+  if (image_replace(key)) {
+    result = 0;
+  }
+  pthread_rwlock_unlock(&kvs_table->tablelock);
+  return result;
+}
+
+/// Writes, in key order and with the format of kvs_read, the pairs from
+/// `first` on that are not greater than `end` and start with `prefix`.
+/// Called with the table read lock.
+/// @param first First node of the range.
+/// @param end Inclusive upper bound, NULL for none.
+/// @param prefix Prefix every key must have, NULL for none.
+/// @param fd File descriptor to write the output.
+static void write_ordered(KeyNode *first, const char *end, const char *prefix,
+                          int fd) {
+  size_t prefix_len = prefix != NULL ? strlen(prefix) : 0;
+  char value[MAX_VALUE_SIZE + 1];
+  write_str(fd, "[");
+  for (KeyNode *node = first; node != NULL; node = node->forward[0]) {
+    if ((end != NULL && strcmp(node->key, end) > 0) ||
+        (prefix != NULL && strncmp(node->key, prefix, prefix_len) != 0)) {
+      break;
     }
+    char aux[FRAGMENT_SIZE];
+    write_fragment(fd, node->key, pair_value(kvs_table, node, value), aux);
+  }
+  write_str(fd, "]\n");
+}
+
+int kvs_scan(const char *start, const char *end, int fd) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
   }
 
+  image_settle();
+  table_rdlock();
+  write_ordered(index_seek(kvs_table, start), end, NULL, fd);
   pthread_rwlock_unlock(&kvs_table->tablelock);
+  return 0;
+}
+
+int kvs_prefix(const char *prefix, int fd) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+
+  // Keys with the prefix are contiguous in key order, starting at the prefix
+  image_settle();
+  table_rdlock();
+  write_ordered(index_seek(kvs_table, prefix), NULL, prefix, fd);
+  pthread_rwlock_unlock(&kvs_table->tablelock);
+  return 0;
+}
+
+/// Output of SHOW that is formatted under the table lock and written after it
+/// is released.
+typedef struct ShowBuffer {
+  char *data;
+  size_t len;
+  size_t cap;
+} ShowBuffer;
+
+/// Appends the "(key, value)" line of every pair in a bucket to the buffer.
+/// Called with the table read lock.
+/// @return 0 on success, 1 if the buffer could not grow.
+static int show_format_bucket(ShowBuffer *buf, KeyNode *keyNode) {
+  char value[MAX_VALUE_SIZE + 1];
+  for (; keyNode != NULL; keyNode = keyNode->next) {
+    // "(" key ", " value ")\n" and the '\0'
+    size_t line = strlen(keyNode->key) + keyNode->value_size + 6;
+    if (buf->cap - buf->len < line) {
+      size_t cap = buf->cap * 2 + line;
+      char *data = realloc(buf->data, cap);
+      if (data == NULL) {
+        return 1;
+      }
+      buf->data = data;
+      buf->cap = cap;
+    }
+    buf->len += (size_t)snprintf(buf->data + buf->len, line, "(%s, %s)\n",
+                                 keyNode->key,
+                                 pair_value(kvs_table, keyNode, value));
+  }
+  return 0;
+}
+
+/// Advances a SHOW cursor by one chunk (a bucket): its pairs are copied into
+/// the buffer under a short read lock hold.
+/// @param cursor Next bucket to copy, starts at 0.
+/// @param buf Buffer the chunk is appended to.
+/// @return 1 if a chunk was copied, 0 when the table is exhausted, -1 on
+/// error.
+static int show_next_chunk(int *cursor, ShowBuffer *buf) {
+  if (*cursor >= TABLE_SIZE) {
+    return 0;
+  }
+  table_rdlock();
+  int result = show_format_bucket(buf, kvs_table->table[*cursor]);
+  pthread_rwlock_unlock(&kvs_table->tablelock);
+  (*cursor)++;
+  return result == 0 ? 1 : -1;
+}
+
+void kvs_show(int fd, int snapshot) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return;
+  }
+
+  image_settle();
+  unsigned long start = metrics_now();
+  ShowBuffer buf = {NULL, 0, 0};
+  if (snapshot) {
+    // Copy every bucket under the same lock hold, then write it all
+    table_rdlock();
+    int failed = 0;
+    for (int i = 0; i < TABLE_SIZE && !failed; i++) {
+      failed = show_format_bucket(&buf, kvs_table->table[i]);
+    }
+    pthread_rwlock_unlock(&kvs_table->tablelock);
+    if (failed) {
+      fprintf(stderr, "Failed to allocate SHOW output\n");
+    } else if (buf.len > 0) {
+      write_str(fd, buf.data);
+    }
+    free(buf.data);
+    metrics_record(METRIC_SHOW, start);
+    return;
+  }
+
+  // Writers only wait for one bucket to be copied, never for the output I/O
+  int cursor = 0;
+  int result;
+  while ((result = show_next_chunk(&cursor, &buf)) == 1) {
+    if (buf.len > 0) {
+      write_str(fd, buf.data);
+      buf.len = 0;
+    }
+  }
+  if (result < 0) {
+    fprintf(stderr, "Failed to allocate SHOW output\n");
+  }
+  free(buf.data);
+  metrics_record(METRIC_SHOW, start);
 }
 
 int kvs_backup(size_t num_backup, char *job_filename, char *directory) {
   pid_t pid;
-  char bck_name[50];
+  char bck_name[MAX_JOB_FILE_NAME_SIZE + 32]; // Room for a segment suffix
   snprintf(bck_name, sizeof(bck_name), "%s/%s-%ld.bck", directory,
            strtok(job_filename, "."), num_backup);
 
-  pthread_rwlock_rdlock(&kvs_table->tablelock);
+  image_settle();
+
+  // Only the parent's side is timed: the lock and the fork. Writing waits in
+  // the child until the scheduler admits it, so the job goes on meanwhile
+  unsigned long start = metrics_now();
+  BackupTicket ticket;
+  if (backup_sched_prepare(&ticket) != 0) {
+    return -1;
+  }
+  int trace_slot = trace_child_reserve();
+  table_rdlock();
   pid = fork();
   pthread_rwlock_unlock(&kvs_table->tablelock);
+  if (pid != 0) {
+    backup_sched_submit(&ticket, pid);
+  }
+  if (pid > 0) {
+    metrics_record(METRIC_BACKUP, start);
+    trace_span("backup fork", "backup", start, bck_name);
+  }
   if (pid == 0) {
-    // functions used here have to be async signal safe, since this
-    // fork happens in a multi thread context (see man fork)
+    backup_sched_admit(&ticket);
+    unsigned long child_start = trace_now();
+    // POSIX only allows async-signal-safe functions in the child of a
+    // multithreaded process (see man fork), and this child goes further:
+    // it uses stdio and mmap and, with -b, creates threads. That relies on
+    // glibc, whose fork resets the stdio and malloc locks in the child; the
+    // only other lock, the table's, is not taken here, since the child's
+    // copy of the table is private. The child ends with _exit, so the
+    // parent's atexit handlers and stdio buffers are not run again.
     int fd = open(bck_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (backup_threads > 1) {
+      int failed = fd == -1 || backup_write_segments(kvs_table, bck_name, fd,
+                                                     backup_threads) != 0;
+      if (failed) {
+        fprintf(stderr, "Failed to write backup %s\n", bck_name);
+      }
+      trace_child_span(trace_slot, "backup child", child_start, bck_name);
+      _exit(failed);
+    }
+    OutWriter writer; // Replaces the job's writer, inherited from the parent
+    out_writer_open(&writer, fd);
+    char value_buf[MAX_VALUE_SIZE + 1];
     for (int i = 0; i < TABLE_SIZE; i++) {
       KeyNode *keyNode = kvs_table->table[i]; // Get the next list head
       while (keyNode != NULL) {
-        char aux[MAX_STRING_SIZE];
+        const char *value = pair_value(kvs_table, keyNode, value_buf);
+        char aux[FRAGMENT_SIZE + 2];
         aux[0] = '(';
         size_t num_bytes_copied = 1; // the "("
         // the - 1 are all to leave space for the '/0'
         num_bytes_copied += strn_memcpy(aux + num_bytes_copied, keyNode->key,
-                                        MAX_STRING_SIZE - num_bytes_copied - 1);
+                                        sizeof(aux) - num_bytes_copied - 1);
         num_bytes_copied += strn_memcpy(aux + num_bytes_copied, ", ",
-                                        MAX_STRING_SIZE - num_bytes_copied - 1);
-        num_bytes_copied += strn_memcpy(aux + num_bytes_copied, keyNode->value,
-                                        MAX_STRING_SIZE - num_bytes_copied - 1);
+                                        sizeof(aux) - num_bytes_copied - 1);
+        if (keyNode->value_size < sizeof(aux) - num_bytes_copied - 2) {
+          num_bytes_copied += strn_memcpy(aux + num_bytes_copied, value,
+                                          sizeof(aux) - num_bytes_copied - 1);
+        } else {
+          // A long value goes straight from the node, no copy is needed
+          aux[num_bytes_copied] = '\0';
+          write_str(fd, aux);
+          write_str(fd, value);
+          num_bytes_copied = 0;
+        }
         num_bytes_copied += strn_memcpy(aux + num_bytes_copied, ")\n",
-                                        MAX_STRING_SIZE - num_bytes_copied - 1);
+                                        sizeof(aux) - num_bytes_copied - 1);
         aux[num_bytes_copied] = '\0';
         write_str(fd, aux);
         keyNode = keyNode->next; // Move to the next node of the list
       }
     }
-    exit(1);
+    int failed = fd == -1 || out_writer_close(&writer) != 0;
+    trace_child_span(trace_slot, "backup child", child_start, bck_name);
+    _exit(failed);
   } else if (pid < 0) {
     return -1;
   }
@@ -184,8 +1139,11 @@ void kvs_wait(unsigned int delay_ms) {
 
 int kvs_key_exists(const char *key) {
   int index = hash(key);
+  if (index < 0) {
+    return 0;
+  }
 
-  pthread_rwlock_rdlock(&kvs_table->tablelock);
+  table_rdlock();
   KeyNode *keyNode = kvs_table->table[index];
   while (keyNode != NULL) {
     if (strcmp(keyNode->key, key) == 0) {
@@ -194,6 +1152,7 @@ int kvs_key_exists(const char *key) {
     }
     keyNode = keyNode->next;
   }
+  int in_image = image_lookup(key) >= 0;
   pthread_rwlock_unlock(&kvs_table->tablelock);
-  return 0; // Key does not exist
+  return in_image; // Key does not exist, unless it is still in the image
 }
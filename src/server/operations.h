@@ -9,6 +9,19 @@
 /// @return 0 if the KVS state was initialized successfully, 1 otherwise.
 int kvs_init();
 
+/// Enables the hot-key read cache, which keeps the formatted output of READ
+/// for up to `capacity` keys. Must be called after kvs_init.
+/// @param capacity Maximum number of cached keys.
+/// @return 0 if the cache was enabled, 1 otherwise.
+int kvs_cache_init(size_t capacity);
+
+/// Gets the read cache counters.
+/// @param hits Number of keys served from the cache.
+/// @param misses Number of keys read from the table.
+/// @param evictions Number of entries evicted to make room.
+void kvs_cache_stats(unsigned long *hits, unsigned long *misses,
+                     unsigned long *evictions);
+
 /// Destroys the KVS state.
 /// @return 0 if the KVS state was terminated successfully, 1 otherwise.
 int kvs_terminate();
@@ -16,10 +29,47 @@ int kvs_terminate();
 /// Writes a key value pair to the KVS. If key already exists it is updated.
 /// @param num_pairs Number of pairs being written.
 /// @param keys Array of keys' strings.
+/// @param values Array of values' strings, up to MAX_VALUE_SIZE characters.
+/// @return 0 if the pairs were written successfully, 1 otherwise.
+int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char *values[]);
+
+/// Writes key value pairs that expire after a given time. A pair written
+/// without a TTL (ttl 0, or with kvs_write) never expires.
+/// @param num_pairs Number of pairs being written.
+/// @param keys Array of keys' strings.
 /// @param values Array of values' strings.
+/// @param ttls_ms TTL of each pair in milliseconds, 0 for none. May be NULL.
 /// @return 0 if the pairs were written successfully, 1 otherwise.
-int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE],
-              char values[][MAX_STRING_SIZE]);
+int kvs_write_ttl(size_t num_pairs, char keys[][MAX_STRING_SIZE],
+                  char *values[], const unsigned int *ttls_ms);
+
+/// Limits the memory taken by the pairs. When a write goes over the limit,
+/// pairs that were not used recently are evicted (deleted). Must be called
+/// after kvs_init.
+/// @param max_memory Limit in bytes.
+/// @param on_evict Function called, without any KVS lock held, for every
+/// evicted key. May be NULL.
+/// @return 0 if the limit was set, 1 otherwise.
+int kvs_memory_init(size_t max_memory, void (*on_evict)(const char *key));
+
+/// Compresses values that are at least threshold bytes long. They are stored
+/// compressed and only decompressed when read. A dictionary is trained from
+/// the first large values and used for the ones written after it. Must be
+/// called after kvs_init.
+/// @param threshold Minimum value length to compress.
+/// @return 0 if compression was enabled, 1 otherwise.
+int kvs_compression_init(size_t threshold);
+
+/// Makes the keys that hold identical values share a single refcounted copy
+/// of them, for values longer than fit inside a node and of up to
+/// INTERN_MAX_SIZE bytes. Must be called after kvs_init.
+/// @return 0 if interning was enabled, 1 otherwise.
+int kvs_interning_init(void);
+
+/// Sets the function called, without any KVS lock held, for every key that
+/// is deleted because its TTL ran out.
+/// @param on_expire Callback that receives the expired key.
+void kvs_expiry_init(void (*on_expire)(const char *key));
 
 /// Reads values from the KVS.
 /// @param num_pairs Number of pairs to read.
@@ -34,15 +84,102 @@ int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd);
 /// @return 0 if the pairs were deleted successfully, 1 otherwise.
 int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd);
 
-/// Writes the state of the KVS.
+/// Reads values from the KVS into the given buffers.
+/// @param num_pairs Number of pairs to read.
+/// @param keys Array of keys' strings.
+/// @param values values[i] is set to a copy of the value of keys[i], to be
+/// released with free, or to NULL if the key does not exist.
+/// @param versions If not NULL, versions[i] is set to the version of keys[i].
+/// @return 0 if the values were read, 1 otherwise.
+int kvs_read_values(size_t num_pairs, char keys[][MAX_STRING_SIZE],
+                    char *values[], unsigned long *versions);
+
+/// Writes key value pairs only if every key still has the version it was
+/// read with (compare-and-set). Validation and writes happen atomically.
+/// @param num_pairs Number of pairs being written.
+/// @param keys Array of keys' strings.
+/// @param versions Expected version of each key, 0 for a key that must not
+/// exist.
+/// @param values Array of values' strings.
+/// @param new_versions Set to the version of each key after the commit.
+/// @param conflicts conflicts[i] is set to 1 if keys[i] had another version.
+/// @return 0 if the pairs were written, 1 on a version conflict (nothing is
+/// written), -1 on error.
+int kvs_cas(size_t num_pairs, char keys[][MAX_STRING_SIZE],
+            const unsigned long *versions, char *values[],
+            unsigned long *new_versions, int *conflicts);
+
+/// Writes the current version of each key, 0 for missing keys.
+/// @param num_pairs Number of keys.
+/// @param keys Array of keys' strings.
+/// @param fd File descriptor to write the output.
+/// @return 0 if the versions were written, 1 otherwise.
+int kvs_version(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd);
+
+/// Deletes a single key from the KVS.
+/// @param key Key to be deleted.
+/// @return 0 if the key was deleted, 1 if it did not exist or on error.
+int kvs_remove(const char *key);
+
+/// Writes, in key order, the pairs whose key is between start and end
+/// (inclusive). Costs O(log n + k) for k pairs in the range.
+/// @param start First key of the range.
+/// @param end Last key of the range.
+/// @param fd File descriptor to write the output.
+/// @return 0 if the range was written, 1 otherwise.
+int kvs_scan(const char *start, const char *end, int fd);
+
+/// Writes, in key order, the pairs whose key starts with prefix.
+/// @param prefix Prefix of the keys.
+/// @param fd File descriptor to write the output.
+/// @return 0 if the pairs were written, 1 otherwise.
+int kvs_prefix(const char *prefix, int fd);
+
+/// Writes the state of the KVS. By default the table is copied one bucket at
+/// a time and each chunk is written with the lock released, so a pair
+/// changed during the dump may appear with either value. A snapshot copies
+/// the whole table under a single lock hold, and is consistent.
 /// @param fd File descriptor to write the output.
-void kvs_show(int fd);
+/// @param snapshot Whether the output must be a consistent snapshot.
+void kvs_show(int fd, int snapshot);
 
 /// Creates a backup of the KVS state and stores it in the correspondent
 /// backup file
 /// @return 0 if the backup was successful, 1 otherwise.
 int kvs_backup(size_t num_backup, char *job_filename, char *directory);
 
+/// Makes backups parallel: each backup is written by `threads` threads as
+/// that many segment files, with the .bck file as their manifest (see
+/// backup.h). With 1, the default, backups are a single list of pairs.
+/// @param threads Number of backup writer threads, up to BACKUP_MAX_SEGMENTS.
+/// @return 0 if the setting was applied, 1 otherwise.
+int kvs_backup_init(size_t threads);
+
+/// Loads a parallel backup into the KVS, reading its segments in parallel.
+/// Must be called after kvs_init.
+/// @param manifest Path of the backup's .bck file.
+/// @param threads Maximum number of reader threads.
+/// @param pairs Set to the number of pairs restored.
+/// @return 0 if the backup was restored, 1 otherwise.
+int kvs_restore(const char *manifest, size_t threads, size_t *pairs);
+
+/// Serves the pairs of a table image (see image.h) at once, without loading
+/// it: READs of keys that are not in the table fall through to the mapped
+/// image, while writes and deletes go to the table and hide the image's pair.
+/// A background thread merges the rest of the image into the table; SHOW,
+/// SCAN, PREFIX, BACKUP, CAS and versions wait for it. Must be called after
+/// kvs_init, and before any write.
+/// @param path Path of the image.
+/// @param pairs Set to the number of pairs in the image.
+/// @return 0 if the image is being served, 1 otherwise.
+int kvs_image_open(const char *path, size_t *pairs);
+
+/// Writes an image of the KVS state from a forked child, admitted and reaped
+/// like a backup. Waits for an image being merged first.
+/// @param path Path of the image, replaced only once the new one is complete.
+/// @return 0 if the child was started, 1 otherwise.
+int kvs_image_save(const char *path);
+
 /// Waits for the last backup to be called.
 void kvs_wait_backup();
 
@@ -0,0 +1,348 @@
+#define _GNU_SOURCE // syscall, MAP_ANONYMOUS
+#include "out_writer.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+static OutBackend backend = OUT_DIRECT;
+static _Thread_local OutWriter *current = NULL;
+
+static int uring_setup(unsigned entries, struct io_uring_params *params) {
+  return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                       unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                      NULL, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, const void *arg,
+                          unsigned nr_args) {
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void ring_unmap(OutRing *ring) {
+  if (ring->sqes != NULL) {
+    munmap(ring->sqes, ring->sqes_size);
+  }
+  if (ring->cq_map != NULL && ring->cq_map != ring->sq_map) {
+    munmap(ring->cq_map, ring->cq_map_size);
+  }
+  if (ring->sq_map != NULL) {
+    munmap(ring->sq_map, ring->sq_map_size);
+  }
+  if (ring->fd != -1) {
+    close(ring->fd); // Also unregisters the buffers
+  }
+  ring->sqes = NULL;
+  ring->cq_map = NULL;
+  ring->sq_map = NULL;
+  ring->fd = -1;
+}
+
+/// Sets up an io_uring instance with the writer's buffers registered.
+/// @return 0 on success, 1 otherwise (the ring is left closed).
+static int ring_open(OutRing *ring, char *buffers) {
+  memset(ring, 0, sizeof(OutRing));
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring->fd = uring_setup(OUT_BUFFERS, &params);
+  if (ring->fd == -1) {
+    return 1;
+  }
+
+  ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_map_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  int single = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single && ring->cq_map_size > ring->sq_map_size) {
+    ring->sq_map_size = ring->cq_map_size;
+  }
+  ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_map == MAP_FAILED) {
+    ring->sq_map = NULL;
+    ring_unmap(ring);
+    return 1;
+  }
+  ring->cq_map = single ? ring->sq_map
+                        : mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_POPULATE, ring->fd,
+                               IORING_OFF_CQ_RING);
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED) {
+    ring->cq_map = ring->cq_map == MAP_FAILED ? NULL : ring->cq_map;
+    ring->sqes = ring->sqes == MAP_FAILED ? NULL : ring->sqes;
+    ring_unmap(ring);
+    return 1;
+  }
+
+  char *sq = ring->sq_map;
+  char *cq = ring->cq_map;
+  ring->sq_tail = (unsigned *)(void *)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned *)(void *)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(void *)(sq + params.sq_off.array);
+  ring->cq_head = (unsigned *)(void *)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(void *)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned *)(void *)(cq + params.cq_off.ring_mask);
+  ring->cqes = cq + params.cq_off.cqes;
+
+  // Registered (fixed) buffers are pinned once instead of on every write
+  struct iovec iov[OUT_BUFFERS];
+  for (size_t i = 0; i < OUT_BUFFERS; i++) {
+    iov[i].iov_base = buffers + i * OUT_BUFFER_SIZE;
+    iov[i].iov_len = OUT_BUFFER_SIZE;
+  }
+  if (uring_register(ring->fd, IORING_REGISTER_BUFFERS, iov, OUT_BUFFERS) ==
+      -1) {
+    ring_unmap(ring);
+    return 1;
+  }
+  return 0;
+}
+
+OutBackend out_writer_init(OutBackend requested) {
+  backend = requested;
+  if (backend != OUT_URING) {
+    return backend;
+  }
+  // Probe once, so that a kernel without io_uring is reported at startup
+  OutWriter probe;
+  probe.buffers = mmap(NULL, OUT_BUFFERS * OUT_BUFFER_SIZE,
+                       PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+                       0);
+  if (probe.buffers == MAP_FAILED || ring_open(&probe.ring, probe.buffers)) {
+    fprintf(stderr, "io_uring unavailable (%s), using synchronous output\n",
+            strerror(errno));
+    backend = OUT_SYNC;
+  } else {
+    ring_unmap(&probe.ring);
+  }
+  if (probe.buffers != MAP_FAILED) {
+    munmap(probe.buffers, OUT_BUFFERS * OUT_BUFFER_SIZE);
+  }
+  return backend;
+}
+
+/// Opens a writer with the given backend, which is not OUT_DIRECT.
+static int writer_open(OutWriter *writer, int fd, OutBackend mode) {
+  writer->buffers = mmap(NULL, OUT_BUFFERS * OUT_BUFFER_SIZE,
+                         PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                         -1, 0);
+  if (writer->buffers == MAP_FAILED) {
+    return 1;
+  }
+  writer->ring.fd = -1;
+  if (mode == OUT_URING && ring_open(&writer->ring, writer->buffers) != 0) {
+    writer->ring.fd = -1; // This writer falls back to synchronous writes
+  }
+  writer->fd = fd;
+  writer->current = 0;
+  writer->used = 0;
+  memset(writer->lengths, 0, sizeof(writer->lengths));
+  writer->in_flight = 0;
+  off_t offset = lseek(fd, 0, SEEK_CUR);
+  writer->offset = offset == -1 ? 0 : offset;
+  writer->failed = 0;
+  current = writer;
+  return 0;
+}
+
+int out_writer_open(OutWriter *writer, int fd) {
+  writer->fd = -1;
+  if (backend == OUT_DIRECT) {
+    return 1;
+  }
+  return writer_open(writer, fd, backend);
+}
+
+int out_writer_open_buffered(OutWriter *writer, int fd) {
+  writer->fd = -1;
+  return writer_open(writer, fd, backend == OUT_DIRECT ? OUT_SYNC : backend);
+}
+
+/// Writes a whole range at an offset, synchronously.
+static void write_range(OutWriter *writer, const char *data, size_t len,
+                        off_t offset) {
+  while (len > 0) {
+    ssize_t written = pwrite(writer->fd, data, len, offset);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("Error writing output");
+      writer->failed = 1;
+      return;
+    }
+    data += written;
+    len -= (size_t)written;
+    offset += written;
+  }
+}
+
+/// Gives up on the ring after an error that leaves its completions unknown:
+/// the writes in flight are done again synchronously, at the same offsets,
+/// and the writer goes on without the ring. The kernel may still be reading
+/// the old buffers, so the writer moves to new ones.
+static void ring_abandon(OutWriter *writer) {
+  writer->failed = 1;
+  for (size_t i = 0; i < OUT_BUFFERS; i++) {
+    if (writer->lengths[i] != 0) {
+      write_range(writer, writer->buffers + i * OUT_BUFFER_SIZE,
+                  writer->lengths[i], writer->offsets[i]);
+      writer->lengths[i] = 0;
+    }
+  }
+  writer->in_flight = 0;
+  ring_unmap(&writer->ring);
+  char *buffers = mmap(NULL, OUT_BUFFERS * OUT_BUFFER_SIZE,
+                       PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+                       0);
+  if (buffers != MAP_FAILED) {
+    munmap(writer->buffers, OUT_BUFFERS * OUT_BUFFER_SIZE);
+    writer->buffers = buffers;
+  }
+}
+
+/// Waits for at least one write in flight and frees the buffers of every
+/// completed one. A short write is finished synchronously.
+static void reap(OutWriter *writer) {
+  OutRing *ring = &writer->ring;
+  int result;
+  while ((result = uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS)) ==
+             -1 &&
+         errno == EINTR) {
+  }
+  if (result == -1) {
+    perror("Error waiting for output");
+    ring_abandon(writer);
+    return;
+  }
+  unsigned head = *ring->cq_head;
+  unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  struct io_uring_cqe *cqes = ring->cqes;
+  for (; head != tail; head++) {
+    struct io_uring_cqe *cqe = &cqes[head & *ring->cq_mask];
+    size_t index = (size_t)cqe->user_data;
+    size_t len = writer->lengths[index];
+    if (cqe->res < 0) {
+      errno = -cqe->res;
+      perror("Error writing output");
+      writer->failed = 1;
+    } else if ((size_t)cqe->res < len) {
+      write_range(writer,
+                  writer->buffers + index * OUT_BUFFER_SIZE + cqe->res,
+                  len - (size_t)cqe->res,
+                  writer->offsets[index] + cqe->res);
+    }
+    writer->lengths[index] = 0;
+    writer->in_flight--;
+  }
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/// Hands the current buffer to io_uring and moves to a free buffer, waiting
+/// for one if all of them are in flight. Synchronous writers write it here.
+static void submit_current(OutWriter *writer) {
+  if (writer->used == 0) {
+    return;
+  }
+  char *data = writer->buffers + writer->current * OUT_BUFFER_SIZE;
+  if (writer->ring.fd == -1) {
+    write_range(writer, data, writer->used, writer->offset);
+    writer->offset += (off_t)writer->used;
+    writer->used = 0;
+    return;
+  }
+
+  OutRing *ring = &writer->ring;
+  unsigned tail = *ring->sq_tail;
+  unsigned index = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = (struct io_uring_sqe *)ring->sqes + index;
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_WRITE_FIXED;
+  sqe->fd = writer->fd;
+  sqe->addr = (unsigned long)data;
+  sqe->len = (unsigned)writer->used;
+  sqe->off = (unsigned long long)writer->offset;
+  sqe->buf_index = (unsigned short)writer->current;
+  sqe->user_data = writer->current;
+  ring->sq_array[index] = index;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  writer->lengths[writer->current] = writer->used;
+  writer->offsets[writer->current] = writer->offset;
+  writer->offset += (off_t)writer->used;
+  writer->in_flight++;
+  int submitted;
+  while ((submitted = uring_enter(ring->fd, 1, 0, 0)) == -1 && errno == EINTR) {
+  }
+  if (submitted == -1) {
+    // The entry stays queued, so the ring cannot be used again: finish the
+    // writes in flight, drop the ring with the entry and go synchronous
+    perror("Error submitting output");
+    writer->lengths[writer->current] = 0;
+    writer->in_flight--;
+    write_range(writer, data, writer->used, writer->offsets[writer->current]);
+    while (writer->in_flight > 0) {
+      reap(writer);
+    }
+    ring_unmap(ring);
+  }
+
+  writer->used = 0;
+  while (writer->in_flight == OUT_BUFFERS) {
+    reap(writer);
+  }
+  while (writer->lengths[writer->current] != 0) {
+    writer->current = (writer->current + 1) % OUT_BUFFERS;
+  }
+}
+
+int out_writer_write(int fd, const char *data, size_t len) {
+  OutWriter *writer = current;
+  if (writer == NULL || writer->fd != fd) {
+    return 1;
+  }
+  while (len > 0) {
+    size_t room = OUT_BUFFER_SIZE - writer->used;
+    size_t n = len < room ? len : room;
+    memcpy(writer->buffers + writer->current * OUT_BUFFER_SIZE + writer->used,
+           data, n);
+    writer->used += n;
+    data += n;
+    len -= n;
+    if (writer->used == OUT_BUFFER_SIZE) {
+      submit_current(writer);
+    }
+  }
+  return 0;
+}
+
+int out_writer_close(OutWriter *writer) {
+  if (writer->fd == -1) {
+    return 0;
+  }
+  submit_current(writer);
+  while (writer->in_flight > 0) {
+    reap(writer);
+  }
+  if (writer->ring.fd != -1) {
+    ring_unmap(&writer->ring);
+  }
+  munmap(writer->buffers, OUT_BUFFERS * OUT_BUFFER_SIZE);
+  if (current == writer) {
+    current = NULL;
+  }
+  writer->fd = -1;
+  return writer->failed;
+}
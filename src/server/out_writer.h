@@ -0,0 +1,81 @@
+#ifndef KVS_OUT_WRITER_H
+#define KVS_OUT_WRITER_H
+
+#include <sys/types.h>
+
+#define OUT_BUFFER_SIZE (64 * 1024)
+#define OUT_BUFFERS 4 // Per writer: one being filled, the rest in flight
+
+/// How job output and backups reach their files.
+typedef enum OutBackend {
+  OUT_DIRECT, // Each write_str is a write() (default)
+  OUT_SYNC,   // Buffered, a write() per full buffer
+  OUT_URING   // Buffered, full buffers written by io_uring while work goes on
+} OutBackend;
+
+/// Submission and completion rings of an io_uring instance, mapped in this
+/// process. The pointers are into the shared mappings.
+typedef struct OutRing {
+  int fd; // -1 when the writer is synchronous
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  void *sqes;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  void *cqes;
+  void *sq_map;
+  size_t sq_map_size;
+  void *cq_map; // Same as sq_map with a single mapping
+  size_t cq_map_size;
+  size_t sqes_size;
+} OutRing;
+
+/// Buffered output to one file. While a writer is open, write_str calls of
+/// the opening thread on its file descriptor go to the buffers instead of
+/// write(). Buffers are mapped with mmap, not malloc, so a writer can be used
+/// by a forked backup child.
+typedef struct OutWriter {
+  int fd; // -1 if not open (OUT_DIRECT)
+  char *buffers; // OUT_BUFFERS * OUT_BUFFER_SIZE
+  size_t current; // Buffer being filled
+  size_t used;    // Bytes in the current buffer
+  size_t lengths[OUT_BUFFERS]; // Bytes submitted, 0 if the buffer is free
+  off_t offsets[OUT_BUFFERS];  // File offset of each submitted buffer
+  size_t in_flight;
+  off_t offset; // File offset of the next buffer
+  int failed;
+  OutRing ring;
+} OutWriter;
+
+/// Selects the backend of every writer opened afterwards. OUT_URING falls
+/// back to OUT_SYNC, with a message, if io_uring cannot be used.
+/// @return The backend in use.
+OutBackend out_writer_init(OutBackend backend);
+
+/// Opens a writer for a file and attaches it to the calling thread. With
+/// OUT_DIRECT this does nothing.
+/// @param writer Writer to initialize.
+/// @param fd File descriptor, written from its current offset.
+/// @return 0 on success, 1 if it fell back to direct writes.
+int out_writer_open(OutWriter *writer, int fd);
+
+/// Opens a writer like out_writer_open, but with OUT_DIRECT it buffers like
+/// OUT_SYNC. For files written in bulk, such as backup segments, which have
+/// no reader waiting on each write.
+/// @param writer Writer to initialize.
+/// @param fd File descriptor, written from its current offset.
+/// @return 0 on success, 1 if the buffers could not be mapped.
+int out_writer_open_buffered(OutWriter *writer, int fd);
+
+/// Writes what is buffered, waits for every write in flight, detaches the
+/// writer and releases it. Does nothing for a writer that is not open.
+/// @return 0 on success, 1 if some write failed.
+int out_writer_close(OutWriter *writer);
+
+/// Buffers data for the calling thread's writer. Used by write_str.
+/// @return 0 if it was buffered, 1 if fd has no writer in this thread.
+int out_writer_write(int fd, const char *data, size_t len);
+
+#endif // KVS_OUT_WRITER_H
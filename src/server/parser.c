@@ -128,18 +128,65 @@ enum Command get_next(int fd) {
     return CMD_DELETE;
 
   case 'S':
-    if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "SHOW", 4) != 0) {
+    if (read(fd, buf + 1, 3) != 3) {
       cleanup(fd);
       return CMD_INVALID;
     }
 
-    if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
+    if (strncmp(buf, "SCAN", 4) == 0) {
+      if (read(fd, buf + 4, 1) != 1 || buf[4] != ' ') {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+      return CMD_SCAN;
+    }
+
+    if (strncmp(buf, "SHOW", 4) != 0) {
+      cleanup(fd);
+      return CMD_INVALID;
+    }
+
+    ssize_t bytes_read = read(fd, buf + 4, 1);
+    if (bytes_read == 1 && buf[4] == ' ') {
+      if (read(fd, buf + 5, 8) != 8 || strncmp(buf, "SHOW SNAPSHOT", 13) != 0 ||
+          (read(fd, buf + 13, 1) != 0 && buf[13] != '\n')) {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+      return CMD_SHOW_SNAPSHOT;
+    }
+
+    if (bytes_read != 0 && buf[4] != '\n') {
       cleanup(fd);
       return CMD_INVALID;
     }
 
     return CMD_SHOW;
 
+  case 'P':
+    if (read(fd, buf + 1, 6) != 6 || strncmp(buf, "PREFIX ", 7) != 0) {
+      cleanup(fd);
+      return CMD_INVALID;
+    }
+
+    return CMD_PREFIX;
+
+  case 'C':
+    if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "CAS ", 4) != 0) {
+      cleanup(fd);
+      return CMD_INVALID;
+    }
+
+    return CMD_CAS;
+
+  case 'V':
+    if (read(fd, buf + 1, 7) != 7 || strncmp(buf, "VERSION ", 8) != 0) {
+      cleanup(fd);
+      return CMD_INVALID;
+    }
+
+    return CMD_VERSION;
+
   case 'B':
     if (read(fd, buf + 1, 5) != 5 || strncmp(buf, "BACKUP", 6) != 0) {
       cleanup(fd);
@@ -179,18 +226,27 @@ enum Command get_next(int fd) {
   }
 }
 
-// Parses a key value pair.
+// Parses a key value pair, with an optional TTL.
 // @param fd File decriptor to read from.
 // @param key Pointer where the key will be stored
-// @param value Pointer where the value will be stored
+// @param value Pointer where the value will be stored, MAX_VALUE_SIZE + 2
+// @param ttl Pointer where the TTL will be stored, 0 if there is none
 // @return 1 if successful, 0 otherwise.
-int parse_pair(int fd, char *key, char *value) {
+int parse_pair(int fd, char *key, char *value, unsigned int *ttl) {
   if (read_string(fd, key, MAX_STRING_SIZE) != 0) {
     cleanup(fd);
     return 0;
   }
 
-  if (read_string(fd, value, MAX_STRING_SIZE) != 1) {
+  *ttl = 0;
+  int output = read_string(fd, value, MAX_VALUE_SIZE + 1);
+  if (output == 0) {
+    char next;
+    if (read_uint(fd, ttl, &next) != 0 || next != ')') {
+      cleanup(fd);
+      return 0;
+    }
+  } else if (output != 1) {
     cleanup(fd);
     return 0;
   }
@@ -198,8 +254,21 @@ int parse_pair(int fd, char *key, char *value) {
   return 1;
 }
 
-size_t parse_write(int fd, char keys[][MAX_STRING_SIZE],
-                   char values[][MAX_STRING_SIZE], size_t max_pairs,
+// Releases the values parsed before a command turned out to be invalid.
+// @param fd File descriptor to skip to the next line.
+// @param values Values parsed so far.
+// @param num_pairs Number of values parsed so far.
+// @return 0, the number of pairs of an invalid command.
+static size_t discard_values(int fd, char *values[], size_t num_pairs) {
+  for (size_t i = 0; i < num_pairs; i++) {
+    free(values[i]);
+  }
+  cleanup(fd);
+  return 0;
+}
+
+size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char *values[],
+                   unsigned int *ttls, size_t max_pairs,
                    size_t max_string_size) {
   char ch;
 
@@ -215,19 +284,20 @@ size_t parse_write(int fd, char keys[][MAX_STRING_SIZE],
 
   size_t num_pairs = 0;
   char key[max_string_size];
-  char value[max_string_size];
+  char value[MAX_VALUE_SIZE + 2]; // read_string also stores the delimiter
   while (num_pairs < max_pairs) {
-    if (parse_pair(fd, key, value) == 0) {
-      cleanup(fd);
-      return 0;
+    if (parse_pair(fd, key, value, &ttls[num_pairs]) == 0) {
+      return discard_values(fd, values, num_pairs);
     }
 
     strcpy(keys[num_pairs], key);
-    strcpy(values[num_pairs++], value);
+    if ((values[num_pairs] = strdup(value)) == NULL) {
+      return discard_values(fd, values, num_pairs);
+    }
+    num_pairs++;
 
     if (read(fd, &ch, 1) != 1 || (ch != '(' && ch != ']')) {
-      cleanup(fd);
-      return 0;
+      return discard_values(fd, values, num_pairs);
     }
 
     if (ch == ']') {
@@ -236,15 +306,69 @@ size_t parse_write(int fd, char keys[][MAX_STRING_SIZE],
   }
 
   if (num_pairs == max_pairs) {
+    return discard_values(fd, values, num_pairs);
+  }
+
+  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
+    return discard_values(fd, values, num_pairs);
+  }
+
+  return num_pairs;
+}
+
+size_t parse_cas(int fd, char keys[][MAX_STRING_SIZE], unsigned long *versions,
+                 char *values[], size_t max_pairs, size_t max_string_size) {
+  char ch;
+
+  if (read(fd, &ch, 1) != 1 || ch != '[') {
     cleanup(fd);
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
+  if (read(fd, &ch, 1) != 1 || ch != '(') {
     cleanup(fd);
     return 0;
   }
 
+  size_t num_pairs = 0;
+  char key[max_string_size];
+  char version[max_string_size];
+  char value[MAX_VALUE_SIZE + 2]; // read_string also stores the delimiter
+  while (num_pairs < max_pairs) {
+    char *end;
+    if (read_string(fd, key, max_string_size) != 0 ||
+        read_string(fd, version, max_string_size) != 0 || version[0] == '\0' ||
+        read_string(fd, value, MAX_VALUE_SIZE + 1) != 1) {
+      return discard_values(fd, values, num_pairs);
+    }
+
+    versions[num_pairs] = strtoul(version, &end, 10);
+    if (*end != '\0') {
+      return discard_values(fd, values, num_pairs);
+    }
+    strcpy(keys[num_pairs], key);
+    if ((values[num_pairs] = strdup(value)) == NULL) {
+      return discard_values(fd, values, num_pairs);
+    }
+    num_pairs++;
+
+    if (read(fd, &ch, 1) != 1 || (ch != '(' && ch != ']')) {
+      return discard_values(fd, values, num_pairs);
+    }
+
+    if (ch == ']') {
+      break;
+    }
+  }
+
+  if (num_pairs == max_pairs) {
+    return discard_values(fd, values, num_pairs);
+  }
+
+  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
+    return discard_values(fd, values, num_pairs);
+  }
+
   return num_pairs;
 }
 
@@ -9,7 +9,12 @@ enum Command {
   CMD_WRITE,
   CMD_READ,
   CMD_DELETE,
+  CMD_CAS,
+  CMD_VERSION,
   CMD_SHOW,
+  CMD_SHOW_SNAPSHOT,
+  CMD_SCAN,
+  CMD_PREFIX,
   CMD_WAIT,
   CMD_BACKUP,
   CMD_HELP,
@@ -24,17 +29,31 @@ enum Command {
 // @return enum Command Command code.
 enum Command get_next(int fd);
 
-/// Parses a WRITE command.
+/// Parses a WRITE command. Each pair may carry a TTL: (key,value,ttl_ms).
 /// @param fd File descriptor to read from.
 /// @param keys Array to store the keys
-/// @param values Array to store the values
+/// @param values Array to store the values, up to MAX_VALUE_SIZE characters.
+/// Each value is allocated and must be released with free.
+/// @param ttls Array to store the TTLs in milliseconds, 0 when absent.
 /// @param max_pairs Maximum number of pairs it will write.
-/// @param max_string_size Maximum string size allowed.
+/// @param max_string_size Maximum key size allowed.
+/// @return 0 if the command was not parsed successfully (no value is left
+//          allocated), otherwise return the of pairs parsed.
+size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char *values[],
+                   unsigned int *ttls, size_t max_pairs,
+                   size_t max_string_size);
+
+/// Parses a CAS command: [(key,version,value)(key2,version2,value2),...].
+/// @param fd File descriptor to read from.
+/// @param keys Array to store the keys
+/// @param versions Array to store the expected versions
+/// @param values Array to store the values, allocated as in parse_write.
+/// @param max_pairs Maximum number of pairs it will write.
+/// @param max_string_size Maximum key size allowed.
 /// @return 0 if the command was not parsed successfully, otherwise return the
 //          of pairs parsed.
-size_t parse_write(int fd, char keys[][MAX_STRING_SIZE],
-                   char values[][MAX_STRING_SIZE], size_t max_pairs,
-                   size_t max_string_size);
+size_t parse_cas(int fd, char keys[][MAX_STRING_SIZE], unsigned long *versions,
+                 char *values[], size_t max_pairs, size_t max_string_size);
 
 // Parses a READ or a DELETE command.
 // @param fd File descriptor to read from.
@@ -0,0 +1,132 @@
+#include "timer_wheel.h"
+
+#include <time.h>
+
+#define TIMER_LEVEL_MASK (TIMER_LEVEL_SLOTS - 1)
+#define TIMER_RANGE (1UL << (TIMER_LEVEL_BITS * TIMER_LEVELS))
+
+unsigned long timer_wheel_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  unsigned long ms = (unsigned long)ts.tv_sec * 1000UL +
+                     (unsigned long)ts.tv_nsec / 1000000UL;
+  return ms / TIMER_TICK_MS;
+}
+
+unsigned long timer_wheel_deadline(unsigned int delay_ms) {
+  return timer_wheel_now() + (delay_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+}
+
+void timer_wheel_init(TimerWheel *wheel, unsigned long now) {
+  for (int level = 0; level < TIMER_LEVELS; level++) {
+    for (int slot = 0; slot < TIMER_LEVEL_SLOTS; slot++) {
+      TimerEntry *head = &wheel->slots[level][slot];
+      head->next = head;
+      head->prev = head;
+    }
+  }
+  wheel->now = now;
+  wheel->count = 0;
+}
+
+void timer_init(TimerEntry *timer) {
+  timer->next = NULL;
+  timer->prev = NULL;
+  timer->expires = 0;
+}
+
+/// Links a timer in the slot that covers its expiry.
+/// @param base Next tick the wheel will process.
+static void timer_place(TimerWheel *wheel, TimerEntry *timer,
+                        unsigned long base) {
+  unsigned long expires = timer->expires;
+  if (expires < base) {
+    expires = base; // Already due: fire on the next tick
+  } else if (expires - base >= TIMER_RANGE) {
+    // Park it in the farthest slot; it is placed again when cascaded
+    expires = base + TIMER_RANGE - 1;
+  }
+
+  unsigned long delta = expires - base;
+  int level = 0;
+  while (level < TIMER_LEVELS - 1 &&
+         delta >= 1UL << (TIMER_LEVEL_BITS * (level + 1))) {
+    level++;
+  }
+  unsigned long slot =
+      (expires >> (TIMER_LEVEL_BITS * level)) & TIMER_LEVEL_MASK;
+
+  TimerEntry *head = &wheel->slots[level][slot];
+  timer->next = head->next;
+  timer->prev = head;
+  head->next->prev = timer;
+  head->next = timer;
+}
+
+void timer_wheel_add(TimerWheel *wheel, TimerEntry *timer,
+                     unsigned long expires) {
+  timer->expires = expires;
+  timer_place(wheel, timer, wheel->now + 1);
+  wheel->count++;
+}
+
+void timer_wheel_cancel(TimerWheel *wheel, TimerEntry *timer) {
+  if (timer->prev == NULL) {
+    return;
+  }
+  timer->prev->next = timer->next;
+  timer->next->prev = timer->prev;
+  timer->next = NULL;
+  timer->prev = NULL;
+  wheel->count--;
+}
+
+/// Moves every timer of a slot to the lower levels.
+/// @param tick Tick being processed.
+static void timer_cascade(TimerWheel *wheel, int level, unsigned long tick) {
+  unsigned long slot =
+      (tick >> (TIMER_LEVEL_BITS * level)) & TIMER_LEVEL_MASK;
+  TimerEntry *head = &wheel->slots[level][slot];
+  TimerEntry *timer = head->next;
+  head->next = head;
+  head->prev = head;
+  while (timer != head) {
+    TimerEntry *next = timer->next;
+    timer_place(wheel, timer, tick);
+    timer = next;
+  }
+}
+
+TimerEntry *timer_wheel_advance(TimerWheel *wheel, unsigned long now) {
+  TimerEntry *fired = NULL;
+  if (wheel->count == 0) {
+    wheel->now = now > wheel->now ? now : wheel->now;
+    return NULL;
+  }
+
+  while (wheel->now < now) {
+    unsigned long tick = ++wheel->now;
+
+    // A level is cascaded when every level below it wraps around
+    for (int level = 1; level < TIMER_LEVELS; level++) {
+      if ((tick >> (TIMER_LEVEL_BITS * level)) << (TIMER_LEVEL_BITS * level) !=
+          tick) {
+        break;
+      }
+      timer_cascade(wheel, level, tick);
+    }
+
+    TimerEntry *head = &wheel->slots[0][tick & TIMER_LEVEL_MASK];
+    while (head->next != head) {
+      TimerEntry *timer = head->next;
+      timer_wheel_cancel(wheel, timer);
+      timer->next = fired;
+      fired = timer;
+    }
+
+    if (wheel->count == 0) {
+      wheel->now = now;
+    }
+  }
+  return fired;
+}
@@ -0,0 +1,64 @@
+#ifndef KVS_TIMER_WHEEL_H
+#define KVS_TIMER_WHEEL_H
+
+#include <stddef.h>
+
+#define TIMER_TICK_MS 10    // Resolution of the wheel
+#define TIMER_LEVEL_BITS 6  // Each level has 2^TIMER_LEVEL_BITS slots
+#define TIMER_LEVEL_SLOTS (1 << TIMER_LEVEL_BITS)
+#define TIMER_LEVELS 4      // Covers 2^24 ticks (about 46 hours)
+
+/// Timer linked in one slot of the wheel. Embedded in the object it expires.
+typedef struct TimerEntry {
+  struct TimerEntry *next;
+  struct TimerEntry *prev; // NULL while the timer is not armed
+  unsigned long expires;   // Tick at which the timer fires
+} TimerEntry;
+
+/// Hierarchical timing wheel: level l holds the timers that fire within
+/// 2^(TIMER_LEVEL_BITS * (l + 1)) ticks, and its slots are cascaded to the
+/// level below as time reaches them. Adding, cancelling and firing a timer
+/// are O(1). Not thread safe.
+typedef struct TimerWheel {
+  TimerEntry slots[TIMER_LEVELS][TIMER_LEVEL_SLOTS]; // List heads
+  unsigned long now;                                 // Last processed tick
+  size_t count;                                      // Armed timers
+} TimerWheel;
+
+/// Gets the current tick of the monotonic clock.
+/// @return Milliseconds since an arbitrary point, divided by TIMER_TICK_MS.
+unsigned long timer_wheel_now(void);
+
+/// Converts a delay in milliseconds into the tick it expires at.
+/// @param delay_ms Delay from now.
+/// @return Expiry tick, rounded up so that a timer never fires early.
+unsigned long timer_wheel_deadline(unsigned int delay_ms);
+
+/// Initializes an empty wheel.
+/// @param wheel Wheel to initialize.
+/// @param now Current tick.
+void timer_wheel_init(TimerWheel *wheel, unsigned long now);
+
+/// Initializes a timer that is not armed.
+/// @param timer Timer to initialize.
+void timer_init(TimerEntry *timer);
+
+/// Arms a timer. It must not be armed already.
+/// @param wheel Wheel to add the timer to.
+/// @param timer Timer to arm.
+/// @param expires Tick at which the timer fires.
+void timer_wheel_add(TimerWheel *wheel, TimerEntry *timer,
+                     unsigned long expires);
+
+/// Disarms a timer. Does nothing if it is not armed.
+/// @param wheel Wheel the timer was added to.
+/// @param timer Timer to disarm.
+void timer_wheel_cancel(TimerWheel *wheel, TimerEntry *timer);
+
+/// Advances the wheel up to a given tick and removes the timers that fired.
+/// @param wheel Wheel to advance.
+/// @param now Current tick.
+/// @return List of the fired timers, linked through next, NULL if none.
+TimerEntry *timer_wheel_advance(TimerWheel *wheel, unsigned long now);
+
+#endif // KVS_TIMER_WHEEL_H
@@ -0,0 +1,264 @@
+#define _GNU_SOURCE // MAP_ANONYMOUS
+#include "trace.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+typedef struct TraceEvent {
+  const char *name;
+  const char *cat;
+  unsigned long start_ns;
+  unsigned long dur_ns;
+  char detail[TRACE_DETAIL_SIZE];
+} TraceEvent;
+
+typedef struct TraceChunk {
+  TraceEvent events[TRACE_CHUNK_EVENTS];
+  _Atomic(struct TraceChunk *) next;
+} TraceChunk;
+
+/// Events of one thread, appended only by that thread. The count is published
+/// after each event is filled in, so the writer can read a live buffer.
+typedef struct TraceBuffer {
+  TraceChunk *first;
+  TraceChunk *last; // Only used by the owning thread
+  atomic_size_t count;
+  int tid;
+  struct TraceBuffer *next;
+} TraceBuffer;
+
+/// Span of a forked child, in memory shared with the parent.
+typedef struct TraceChild {
+  atomic_int done;
+  int pid;
+  const char *name; // Same address in the child, it is a fork
+  unsigned long start_ns;
+  unsigned long dur_ns;
+  char detail[TRACE_DETAIL_SIZE];
+} TraceChild;
+
+static atomic_int enabled = 0;
+static const char *trace_path;
+static pid_t trace_pid; // Backup children exit too, but do not write
+static unsigned long trace_epoch; // Timestamps are relative to trace_init
+
+static TraceBuffer *buffers = NULL;
+static pthread_mutex_t buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+static int next_tid = 1;
+static _Thread_local TraceBuffer *thread_buffer = NULL;
+
+static TraceChild *children; // TRACE_CHILD_SLOTS, shared mapping
+static atomic_int next_child = 0;
+
+static void write_at_exit(void) {
+  if (getpid() == trace_pid && trace_write() != 0) {
+    perror("Failed to write trace");
+  }
+}
+
+int trace_init(const char *path) {
+  children = mmap(NULL, TRACE_CHILD_SLOTS * sizeof(TraceChild),
+                  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (children == MAP_FAILED) {
+    return 1;
+  }
+  trace_path = path;
+  trace_pid = getpid();
+  trace_epoch = metrics_now();
+  atexit(write_at_exit);
+  atomic_store(&enabled, 1);
+  return 0;
+}
+
+unsigned long trace_now(void) {
+  return atomic_load_explicit(&enabled, memory_order_relaxed) ? metrics_now()
+                                                               : 0;
+}
+
+/// Gets the calling thread's buffer, registering it on the first call.
+/// @return The buffer, or NULL if out of memory.
+static TraceBuffer *buffer_get(void) {
+  if (thread_buffer != NULL) {
+    return thread_buffer;
+  }
+  TraceBuffer *buffer = calloc(1, sizeof(TraceBuffer));
+  TraceChunk *chunk = calloc(1, sizeof(TraceChunk));
+  if (buffer == NULL || chunk == NULL) {
+    free(buffer);
+    free(chunk);
+    return NULL;
+  }
+  buffer->first = chunk;
+  buffer->last = chunk;
+  pthread_mutex_lock(&buffers_lock);
+  buffer->tid = next_tid++;
+  buffer->next = buffers;
+  buffers = buffer;
+  pthread_mutex_unlock(&buffers_lock);
+  thread_buffer = buffer;
+  return buffer;
+}
+
+/// Copies a detail string, truncated, with no library call that is not
+/// async-signal-safe.
+static void copy_detail(char *dest, const char *src) {
+  size_t i = 0;
+  for (; src != NULL && src[i] != '\0' && i < TRACE_DETAIL_SIZE - 1; i++) {
+    dest[i] = src[i];
+  }
+  dest[i] = '\0';
+}
+
+void trace_span(const char *name, const char *cat, unsigned long start_ns,
+                const char *detail) {
+  if (!atomic_load_explicit(&enabled, memory_order_relaxed) || start_ns == 0) {
+    return;
+  }
+  unsigned long end = metrics_now();
+  TraceBuffer *buffer = buffer_get();
+  if (buffer == NULL) {
+    return;
+  }
+  size_t count = atomic_load_explicit(&buffer->count, memory_order_relaxed);
+  if (count >= TRACE_MAX_EVENTS) {
+    return;
+  }
+  if (count > 0 && count % TRACE_CHUNK_EVENTS == 0) {
+    TraceChunk *chunk = calloc(1, sizeof(TraceChunk));
+    if (chunk == NULL) {
+      return;
+    }
+    atomic_store_explicit(&buffer->last->next, chunk, memory_order_release);
+    buffer->last = chunk;
+  }
+  TraceEvent *event = &buffer->last->events[count % TRACE_CHUNK_EVENTS];
+  event->name = name;
+  event->cat = cat;
+  event->start_ns = start_ns;
+  event->dur_ns = end - start_ns;
+  copy_detail(event->detail, detail);
+  atomic_store_explicit(&buffer->count, count + 1, memory_order_release);
+}
+
+void trace_wait(const char *name, unsigned long start_ns) {
+  if (atomic_load_explicit(&enabled, memory_order_relaxed) &&
+      metrics_now() - start_ns >= TRACE_MIN_WAIT_NS) {
+    trace_span(name, "lock", start_ns, NULL);
+  }
+}
+
+int trace_child_reserve(void) {
+  if (!atomic_load_explicit(&enabled, memory_order_relaxed)) {
+    return -1;
+  }
+  int slot = atomic_fetch_add(&next_child, 1);
+  return slot < TRACE_CHILD_SLOTS ? slot : -1;
+}
+
+void trace_child_span(int slot, const char *name, unsigned long start_ns,
+                      const char *detail) {
+  if (slot < 0 || start_ns == 0) {
+    return;
+  }
+  TraceChild *child = &children[slot];
+  child->pid = getpid();
+  child->name = name;
+  child->start_ns = start_ns;
+  child->dur_ns = metrics_now() - start_ns;
+  copy_detail(child->detail, detail);
+  atomic_store_explicit(&child->done, 1, memory_order_release);
+}
+
+/// Writes a string as a JSON string literal.
+static void write_json_string(FILE *out, const char *str) {
+  fputc('"', out);
+  for (; *str != '\0'; str++) {
+    unsigned char ch = (unsigned char)*str;
+    if (ch == '"' || ch == '\\') {
+      fputc('\\', out);
+      fputc(ch, out);
+    } else if (ch < 0x20) {
+      fprintf(out, "\\u%04x", ch);
+    } else {
+      fputc(ch, out);
+    }
+  }
+  fputc('"', out);
+}
+
+/// Writes one complete ("X") event; timestamps are in microseconds.
+static void write_event(FILE *out, const char *name, const char *cat, int pid,
+                        int tid, unsigned long start_ns, unsigned long dur_ns,
+                        const char *detail) {
+  fputs(",\n{\"name\":", out);
+  write_json_string(out, name);
+  fprintf(out, ",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,", cat, pid,
+          tid);
+  fprintf(out, "\"ts\":%.3f,\"dur\":%.3f",
+          (double)(start_ns - trace_epoch) / 1000.0, (double)dur_ns / 1000.0);
+  if (detail[0] != '\0') {
+    fputs(",\"args\":{\"detail\":", out);
+    write_json_string(out, detail);
+    fputc('}', out);
+  }
+  fputc('}', out);
+}
+
+int trace_write(void) {
+  if (!atomic_load(&enabled)) {
+    return 0;
+  }
+  char tmp_path[4096];
+  if ((size_t)snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", trace_path) >=
+      sizeof(tmp_path)) {
+    return 1;
+  }
+  FILE *out = fopen(tmp_path, "w");
+  if (out == NULL) {
+    return 1;
+  }
+
+  fprintf(out,
+          "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+          "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+          "\"args\":{\"name\":\"kvs\"}}",
+          (int)trace_pid);
+  pthread_mutex_lock(&buffers_lock);
+  for (TraceBuffer *buffer = buffers; buffer != NULL; buffer = buffer->next) {
+    size_t count = atomic_load_explicit(&buffer->count, memory_order_acquire);
+    TraceChunk *chunk = buffer->first;
+    for (size_t i = 0; i < count; i++) {
+      if (i > 0 && i % TRACE_CHUNK_EVENTS == 0) {
+        chunk = atomic_load_explicit(&chunk->next, memory_order_acquire);
+      }
+      TraceEvent *event = &chunk->events[i % TRACE_CHUNK_EVENTS];
+      write_event(out, event->name, event->cat, (int)trace_pid, buffer->tid,
+                  event->start_ns, event->dur_ns, event->detail);
+    }
+  }
+  pthread_mutex_unlock(&buffers_lock);
+
+  int reserved = atomic_load(&next_child);
+  for (int i = 0; i < reserved && i < TRACE_CHILD_SLOTS; i++) {
+    TraceChild *child = &children[i];
+    if (atomic_load_explicit(&child->done, memory_order_acquire)) {
+      // Each child shows up as its own process
+      write_event(out, child->name, "backup", child->pid, child->pid,
+                  child->start_ns, child->dur_ns, child->detail);
+    }
+  }
+  fputs("\n]}\n", out);
+
+  if (fclose(out) != 0 || rename(tmp_path, trace_path) != 0) {
+    unlink(tmp_path);
+    return 1;
+  }
+  return 0;
+}
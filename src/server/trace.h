@@ -0,0 +1,48 @@
+#ifndef KVS_TRACE_H
+#define KVS_TRACE_H
+
+#define TRACE_CHUNK_EVENTS 4096      // Events per buffer chunk
+#define TRACE_MAX_EVENTS (1 << 20)   // Per thread, later events are dropped
+#define TRACE_DETAIL_SIZE 48         // Job file, key, ... shown with a span
+#define TRACE_CHILD_SLOTS 4096       // Spans of forked children (backups)
+#define TRACE_MIN_WAIT_NS 10000      // Shorter lock waits are not traced
+
+/// Starts tracing: from now on spans are recorded, and they are written to
+/// `path` as Chrome trace-event JSON (chrome://tracing, ui.perfetto.dev) when
+/// the process exits. Without it every trace call is a no-op.
+/// @param path Output file.
+/// @return 0 on success, 1 otherwise.
+int trace_init(const char *path);
+
+/// Gets the start time of a span.
+/// @return Nanoseconds of the monotonic clock, 0 while tracing is off.
+unsigned long trace_now(void);
+
+/// Records a span that started at `start_ns` and ends now, in the calling
+/// thread's buffer. Only the owning thread appends to a buffer, so no lock is
+/// taken.
+/// @param name Span name, must be a string literal.
+/// @param cat Category, must be a string literal.
+/// @param start_ns Value of trace_now (or metrics_now) at the start.
+/// @param detail Shown with the span, may be NULL; truncated.
+void trace_span(const char *name, const char *cat, unsigned long start_ns,
+                const char *detail);
+
+/// Like trace_span, but only records waits of at least TRACE_MIN_WAIT_NS.
+void trace_wait(const char *name, unsigned long start_ns);
+
+/// Reserves the slot a child about to be forked records its span in.
+/// @return Slot, or -1 if tracing is off or the slots ran out.
+int trace_child_reserve(void);
+
+/// Records the span of a forked child in its reserved slot, which the parent
+/// reads when it writes the trace. Async-signal-safe.
+/// @param slot Value of trace_child_reserve, -1 is ignored.
+void trace_child_span(int slot, const char *name, unsigned long start_ns,
+                      const char *detail);
+
+/// Writes every span recorded so far to the trace file, replacing it.
+/// @return 0 on success, 1 otherwise.
+int trace_write(void);
+
+#endif // KVS_TRACE_H
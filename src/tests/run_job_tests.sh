@@ -0,0 +1,81 @@
+#!/bin/sh
+# Testes de jobs: cada diretoria em src/tests/jobs e um caso, com um .job e os
+# ficheiros que o servidor tem de produzir ao corre-lo (.out, .bck). Um caso
+# com subdiretorias 1/, 2/, ... corre o servidor uma vez por etapa, por ordem,
+# com a mesma diretoria de trabalho (ex.: um backup e depois -r desse backup).
+# Um ficheiro args da as opcoes do servidor da etapa; $WORK e a diretoria de
+# trabalho do caso.
+#
+# Uso: src/tests/run_job_tests.sh [caso...]   (ou make test)
+
+KVS=${KVS:-src/server/kvs}
+TESTS=$(dirname "$0")/jobs
+ROOT=$(mktemp -d /tmp/kvs_job_tests.XXXXXX) || exit 1
+trap 'rm -rf "$ROOT"' EXIT
+
+# Corre uma etapa e compara os ficheiros esperados com os produzidos.
+# $1 = diretoria da etapa, $2 = diretoria onde os jobs correm
+run_stage() {
+  mkdir -p "$2"
+  cp "$1"/*.job "$2"/
+  args=""
+  if [ -f "$1/args" ]; then
+    args=$(eval "echo $(cat "$1/args")")
+  fi
+  # Uma tarefa e um backup de cada vez, para a saida ser deterministica
+  # shellcheck disable=SC2086
+  if ! timeout 30 "$KVS" -e $args "$2" 1 1 "$WORK/register" \
+      > "$2/server.log" 2>&1; then
+    echo "  server failed:"
+    sed 's/^/    /' "$2/server.log"
+    return 1
+  fi
+  for expected in "$1"/*; do
+    file=$(basename "$expected")
+    case "$file" in
+      *.job | args) continue ;;
+    esac
+    [ -d "$expected" ] && continue
+    if ! cmp -s "$expected" "$2/$file"; then
+      echo "  $file differs from the expected output:"
+      diff "$expected" "$2/$file" 2>&1 | head -20 | sed 's/^/    /'
+      return 1
+    fi
+  done
+  return 0
+}
+
+if [ ! -x "$KVS" ]; then
+  echo "$KVS not found, run make first" >&2
+  exit 1
+fi
+
+if [ $# -eq 0 ]; then
+  set -- $(ls "$TESTS")
+fi
+
+passed=0
+failed=0
+for name in "$@"; do
+  case_dir=$TESTS/$name
+  WORK=$ROOT/$name
+  mkdir -p "$WORK"
+  result=0
+  if ls "$case_dir"/*.job > /dev/null 2>&1; then
+    run_stage "$case_dir" "$WORK/jobs" || result=1
+  else
+    for stage in $(ls "$case_dir"); do
+      run_stage "$case_dir/$stage" "$WORK/$stage" || { result=1; break; }
+    done
+  fi
+  if [ $result -eq 0 ]; then
+    echo "PASS $name"
+    passed=$((passed + 1))
+  else
+    echo "FAIL $name"
+    failed=$((failed + 1))
+  fi
+done
+
+echo "$passed passed, $failed failed"
+[ $failed -eq 0 ]